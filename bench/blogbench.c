@@ -0,0 +1,841 @@
+/*
+ * blogbench.c - Throughput and latency of blogd against pty consoles
+ *
+ * Copyright 2026 Werner Fink
+ * Copyright 2026 SUSE Software Solutions Germany GmbH
+ *
+ * This source is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <endian.h>
+#include <err.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <ftw.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/mount.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "libconsole.h"
+#include "harness.h"
+
+#ifndef  _PATH_BLOG_FIFO
+# define _PATH_BLOG_FIFO	"/dev/blog"
+#endif
+#ifndef  BOOT_LOGFILE
+# define BOOT_LOGFILE		"/var/log/boot.log"
+#endif
+
+/*
+ * The benchmark runs blogd in a sandbox directory, see sandbox.c, and
+ * therefore without any privilege.  With -N blogd runs instead in its
+ * own mount, network and pid name space where /dev, /run, /var/log and
+ * the shared memory are private tmpfs, this requires root but blogd
+ * does redirect the system console with TIOCCONS as on a real boot.
+ *
+ * The consoles are pty pairs announced by a fake /proc/consoles, the
+ * first one is read with the speed given by -r, which is also the
+ * speed blogd is told by blog.console.<tty>.speed= of a fake
+ * /proc/cmdline.  Neither /dev/blog nor the boot log of the host are
+ * touched.  Every line carries its sequence number and the time it
+ * was sent, each reader of a console and of the boot log takes the
+ * time the line arrives.
+ *
+ * The mode password does not flood but forks many requesters which ask
+ * at once on the control socket for a few passwords, a reader of a fast
+ * console answers every prompt it sees with the secret of the prompt.
+ * The time is taken until all requesters have got their secret, a
+ * requester getting the password cached for another prompt asks again.
+ * The mode question does the same with questions, which blogd does not
+ * answer from the cache, that is only the queue and the merging count.
+ */
+
+__attribute__((noreturn)) void error (const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    verr(EXIT_FAILURE, fmt, ap);
+    va_end(ap);
+}
+
+enum { MODE_PTY, MODE_FIFO, MODE_SOCKET, MODE_PASSWORD, MODE_QUESTION, MODE_MAX };
+static const char *modes[MODE_MAX] = { "pty", "fifo", "socket", "password", "question" };
+
+#define PROMPT		"Unlock disk "
+#define SECRET		"secret"
+
+static struct {
+    const char *blogd;
+    unsigned int lines;
+    unsigned int size;
+    unsigned int consoles;
+    unsigned int baud;
+    unsigned int timeout;
+    unsigned int mode;
+    unsigned int requesters;
+    unsigned int prompts;
+    int ns;
+} opt = {
+    .blogd = "./blogd",
+    .lines = 20000,
+    .size = 100,
+    .consoles = 3,
+    .baud = 9600,
+    .timeout = 10,
+    .mode = (1<<MODE_PTY)|(1<<MODE_FIFO)|(1<<MODE_SOCKET),
+    .requesters = 64,
+    .prompts = 4,
+};
+
+typedef struct sink_s {
+    char name[32];
+    int fd;
+    int master, slave;
+    unsigned int baud;			/* Read speed, 0 is unlimited */
+    const char *path;			/* The boot log is followed */
+    pthread_t thread;
+    uint64_t *lat;			/* Latency per sequence, 0 is missing */
+    uint64_t lines, bytes, last;
+    size_t fill;
+    char line[4096];
+} sink_t;
+
+static sink_t *sinks;
+static unsigned int nsinks;
+static volatile unsigned int current;	/* The mode of the running flood */
+static volatile int stop;
+static pid_t blogd;
+static sink_t *answerer;		/* The console which answers the prompts */
+static volatile unsigned int answers;
+
+/*
+ * A line is "BENCH <mode> <seq> <ns> xxx..." and may be preceded by a time
+ * stamp or followed by a carriage return, only the first arrival of a line
+ * of the running flood is counted.  The slow console may still show lines
+ * of an earlier flood.
+ */
+static void account(sink_t *s, const char *line, size_t len, uint64_t t)
+{
+    const char *p = memmem(line, len, "BENCH ", 6);
+    const size_t mlen = strlen(modes[current]);
+    unsigned long seq;
+    uint64_t sent;
+    char *end;
+
+    if (!p || (size_t)(line + len - p) < 6 + mlen + 1)
+	return;
+    p += 6;
+    if (strncmp(p, modes[current], mlen) || p[mlen] != ' ')
+	return;
+    seq = strtoul(p + mlen, &end, 10);
+    sent = strtoull(end, NULL, 10);
+    if (seq >= opt.lines || s->lat[seq] || !sent || sent > t)
+	return;
+    s->lat[seq] = t - sent ? : 1;
+    s->lines++;
+    s->last = t;
+}
+
+static void consume(sink_t *s, const char *buf, size_t len)
+{
+    const uint64_t t = now();
+
+    s->bytes += len;
+    while (len > 0) {
+	const char *nl = memchr(buf, '\n', len);
+	size_t part = nl ? (size_t)(nl - buf) + 1 : len;
+
+	if (s->fill + part > sizeof(s->line))
+	    s->fill = 0;		/* Overlong line, drop it */
+	memcpy(&s->line[s->fill], buf, part);
+	s->fill += part;
+	if (nl) {
+	    account(s, s->line, s->fill, t);
+	    s->fill = 0;
+	}
+	buf += part;
+	len -= part;
+    }
+}
+
+/*
+ * The prompt is not terminated by a new line, it is answered as soon as
+ * its number is seen
+ */
+static void answer(sink_t *s)
+{
+    const char *p = memmem(s->line, s->fill, PROMPT, strlen(PROMPT));
+    const char *end = s->line + s->fill;
+    unsigned int k = 0;
+    char secret[32];
+    int len;
+
+    if (!p)
+	return;
+    for (p += strlen(PROMPT); p < end && *p >= '0' && *p <= '9'; p++)
+	k = k * 10 + (unsigned int)(*p - '0');
+    if (p >= end || p[-1] == ' ')
+	return;				/* The number is not yet complete */
+    len = snprintf(secret, sizeof(secret), SECRET "%u\n", k);
+    s->fill = 0;
+    safeout(s->master, secret, (size_t)len, SSIZE_MAX);
+    answers++;
+}
+
+/*
+ * The serial stand-in reads at most one byte per ten bits of its
+ * speed, in chunks of ten milli seconds like a slow UART does.
+ */
+static void *reader(void *arg)
+{
+    sink_t *s = arg;
+    char buf[65536];
+
+    while (!stop) {
+	size_t max = sizeof(buf);
+	ssize_t r;
+
+	if (s->path) {
+	    if (s->fd < 0 && (s->fd = open(s->path, O_RDONLY|O_CLOEXEC)) < 0) {
+		usleep(1000);
+		continue;
+	    }
+	    if ((r = read(s->fd, buf, max)) <= 0) {
+		usleep(1000);
+		continue;
+	    }
+	    consume(s, buf, (size_t)r);
+	    continue;
+	}
+
+	if (s->baud) {
+	    max = s->baud / 1000 ? : 1;
+	    usleep(10000);
+	}
+	if (!can_read(s->fd, 100))
+	    continue;
+	if ((r = read(s->fd, buf, max)) <= 0) {
+	    if (r < 0 && errno != EAGAIN && errno != EINTR && errno != EIO)
+		warn("can not read from %s", s->name);
+	    continue;
+	}
+	consume(s, buf, (size_t)r);
+	if (s == answerer && current >= MODE_PASSWORD)
+	    answer(s);
+    }
+    return NULL;
+}
+
+/*
+ * The fifo is only copied to the boot log
+ */
+static int expected(const sink_t *s)
+{
+    return s->path || current != MODE_FIFO;
+}
+
+static void sinks_reset(void)
+{
+    unsigned int n;
+
+    for (n = 0; n < nsinks; n++) {
+	memset(sinks[n].lat, 0, opt.lines * sizeof(uint64_t));
+	sinks[n].lines = sinks[n].bytes = sinks[n].last = 0;
+    }
+}
+
+static void xmount(const char *src, const char *dst, const char *type, unsigned long flags)
+{
+    if (mount(src, dst, type, flags, NULL) < 0)
+	error("can not mount %s on %s", src ? src : type, dst);
+}
+
+/*
+ * Bind a node of the old /dev into the new one
+ */
+static void bind_dev(const char *dev, const char *src, const char *name, int dir)
+{
+    char dst[PATH_MAX];
+    int fd;
+
+    snprintf(dst, sizeof(dst), "%s/%s", dev, name);
+    if (access(src, F_OK) < 0)
+	return;
+    if (dir)
+	(void)mkdir(dst, 0755);
+    else if ((fd = open(dst, O_WRONLY|O_CREAT|O_CLOEXEC, 0600)) >= 0)
+	close(fd);
+    xmount(src, dst, NULL, MS_BIND|MS_REC);
+}
+
+/*
+ * The contents of the fake consoles and cmdline files
+ */
+static void fake_proc(char **consoles, char **cmdline)
+{
+    size_t clen, mlen;
+    FILE *cf, *mf;
+    unsigned int n;
+
+    if (!(cf = open_memstream(consoles, &clen)) || !(mf = open_memstream(cmdline, &mlen)))
+	error("can not allocate string");
+    fputs("quiet", mf);
+    for (n = 0; n < opt.consoles; n++) {
+	pty_console(cf, sinks[n].name, sinks[n].slave, n == opt.consoles-1);
+	if (sinks[n].baud)
+	    fprintf(mf, " blog.console.%s.speed=%u", sinks[n].name, sinks[n].baud);
+    }
+    fputc('\n', mf);
+    fclose(cf);
+    fclose(mf);
+}
+
+/*
+ * The private file system of blogd in the name spaces
+ */
+static void setup_ns(const char *dir)
+{
+    char path[PATH_MAX], node[PATH_MAX+8], *consoles, *cmdline;
+
+    xmount(NULL, "/", NULL, MS_REC|MS_PRIVATE);
+    xmount("proc", "/proc", "proc", MS_NOSUID|MS_NODEV|MS_NOEXEC);
+    xmount("tmpfs", dir, "tmpfs", 0);
+
+    fake_proc(&consoles, &cmdline);
+    snprintf(path, sizeof(path), "%s/consoles", dir);
+    xwrite(path, consoles);
+    xmount(path, "/proc/consoles", NULL, MS_BIND);
+    snprintf(path, sizeof(path), "%s/cmdline", dir);
+    xwrite(path, cmdline);
+    xmount(path, "/proc/cmdline", NULL, MS_BIND);
+    free(consoles);
+    free(cmdline);
+
+    snprintf(path, sizeof(path), "%s/dev", dir);
+    (void)mkdir(path, 0755);
+    xmount("tmpfs", path, "tmpfs", MS_NOSUID);
+    bind_dev(path, "/dev/pts", "pts", 1);
+    snprintf(node, sizeof(node), "%s/ptmx", path);
+    if (symlink("pts/ptmx", node) < 0)	/* A bound ptmx would not find its pts */
+	error("can not create %s", node);
+    bind_dev(path, "/dev/null", "null", 0);
+    bind_dev(path, "/dev/zero", "zero", 0);
+    bind_dev(path, "/dev/urandom", "urandom", 0);
+    bind_dev(path, "/dev/tty", "tty", 0);
+    bind_dev(path, "/dev/console", "console", 0);
+    snprintf(path, sizeof(path), "%s/dev/shm", dir);
+    (void)mkdir(path, 01777);
+    snprintf(path, sizeof(path), "%s/dev", dir);
+    xmount(path, "/dev", NULL, MS_MOVE);
+
+    xmount("tmpfs", "/run", "tmpfs", MS_NOSUID|MS_NODEV);
+    xmount("tmpfs", "/var/log", "tmpfs", MS_NOSUID|MS_NODEV);
+    if (access("/sys/devices/virtual/tty", F_OK) == 0)
+	xmount("tmpfs", "/sys/devices/virtual/tty", "tmpfs", MS_NOSUID|MS_NODEV);
+}
+
+/*
+ * The file system of blogd in the sandbox with a few kernel records
+ */
+static void setup_sandbox(const char *dir)
+{
+    char *consoles, *cmdline;
+    unsigned int n;
+
+    fake_proc(&consoles, &cmdline);
+    sandbox_tree(dir, consoles, cmdline,
+		 "6,1,1000,-;blogbench: first kernel record\n"
+		 " SUBSYSTEM=bench\n"
+		 "6,2,2000,-;blogbench: second kernel record\n"
+		 "4,3,3000,-;blogbench: third kernel record\n");
+    for (n = 0; n < opt.consoles; n++)
+	sandbox_link(dir, sinks[n].master, sinks[n].slave, n == opt.consoles-1);
+    free(consoles);
+    free(cmdline);
+}
+
+static size_t mkline(char *buf, unsigned int seq, size_t size)
+{
+    int len = snprintf(buf, size, "BENCH %s %u %" PRIu64 " ", modes[current], seq, now());
+
+    if (len < 0 || (size_t)len >= size - 1)
+	len = (int)size - 2;
+    memset(&buf[len], 'x', size - 1 - (size_t)len);
+    buf[size-1] = '\n';
+    return size;
+}
+
+/*
+ * Floods through a file descriptor are written in pages, each line
+ * has the time when it was put into the page.
+ */
+static void flood(int fd)
+{
+    char page[8192];
+    size_t fill = 0;
+    unsigned int seq;
+
+    for (seq = 0; seq < opt.lines; seq++) {
+	fill += mkline(&page[fill], seq, opt.size);
+	if (fill + opt.size > sizeof(page) || seq == opt.lines-1) {
+	    safeout(fd, page, fill, SSIZE_MAX);
+	    fill = 0;
+	}
+    }
+}
+
+/*
+ * The control socket takes one display-message per connection
+ */
+static void flood_socket(void)
+{
+    const size_t size = opt.size > UCHAR_MAX-1 ? UCHAR_MAX-1 : opt.size;
+    char req[UCHAR_MAX+4];
+    unsigned int seq;
+
+    for (seq = 0; seq < opt.lines; seq++) {
+	req[0] = MAGIC_SHOW_MSG;
+	req[1] = '\002';
+	req[2] = (char)size;
+	mkline(&req[3], seq, size);
+	req[3+size-1] = '\0';
+	if (command(req, 3 + size) < 0)
+	    warnx("message %u not acknowledged", seq);
+    }
+}
+
+/*
+ * A requester asks on a new connection for each try like a keyscript
+ * does and sends the time it has waited for its secret and the number
+ * of wrong answers to the pipe
+ */
+static void requester(unsigned int n, int out, char magic)
+{
+    char req[UCHAR_MAX+4], secret[32], ans, buf[64];
+    uint64_t start = now(), res[2] = { 0, 0 };
+    uint32_t len;
+    int fd, size;
+
+    size = snprintf(&req[3], sizeof(req) - 3, PROMPT "%u", n % opt.prompts) + 1;
+    req[0] = magic;
+    req[1] = '\002';
+    req[2] = (char)size;
+    snprintf(secret, sizeof(secret), SECRET "%u", n % opt.prompts);
+    while (res[1] <= 4 * opt.prompts && (fd = open_un_socket_and_connect()) >= 0) {
+	int got = 0;
+
+	safeout(fd, req, 3 + size, SSIZE_MAX);
+	if (can_read(fd, (int)opt.timeout * 1000) && safein(fd, &ans, 1) == 1 && ans == ANSWER_MLT[0] &&
+	    can_read(fd, 1000) && safein(fd, &len, sizeof(len)) == sizeof(len) &&
+	    (len = le32toh(len)) < sizeof(buf) && can_read(fd, 1000) &&
+	    safein(fd, buf, len) == (ssize_t)len && len > 0)
+	    got = 1;
+	close(fd);
+	if (!got)
+	    break;
+	if (strcmp(buf, secret) == 0) {
+	    res[0] = now() - start ? : 1;
+	    break;
+	}
+	res[1]++;			/* The password of another prompt */
+    }
+    safeout(out, res, sizeof(res), SSIZE_MAX);
+    _exit(res[0] ? 0 : 1);
+}
+
+static int cmp(const void *a, const void *b)
+{
+    const uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static const char *usec(uint64_t nsec, char *buf, size_t size)
+{
+    if (nsec >= 10000000ULL)
+	snprintf(buf, size, "%" PRIu64 "ms", nsec / 1000000);
+    else
+	snprintf(buf, size, "%" PRIu64 "us", nsec / 1000);
+    return buf;
+}
+
+/*
+ * Wait until all lines are seen on every sink or no sink got a new
+ * line for one second, the slow serial console may never catch up.
+ */
+static void settle(void)
+{
+    const uint64_t end = now() + (uint64_t)opt.timeout * 1000000000ULL;
+    uint64_t last = 0, idle = now();
+
+    while (now() < end) {
+	uint64_t lines = 0;
+	unsigned int n, done = 0;
+
+	for (n = 0; n < nsinks; n++) {
+	    lines += sinks[n].lines;
+	    if (sinks[n].lines >= opt.lines || !expected(&sinks[n]))
+		done++;
+	}
+	if (done == nsinks)
+	    break;
+	if (lines != last) {
+	    last = lines;
+	    idle = now();
+	} else if (now() - idle > 1000000000ULL)
+	    break;
+	usleep(10000);
+    }
+}
+
+static void report(unsigned int mode, uint64_t start, uint64_t sent, uint64_t cpu, const char *before)
+{
+    const double mb = (double)opt.lines * (double)opt.size / 1e6;
+    uint64_t *lat, wall = 0;
+    char *text, *line, *next;
+    unsigned int n;
+
+    if (!(lat = malloc(opt.lines * sizeof(uint64_t))))
+	error("memory allocation failed");
+    for (n = 0; n < nsinks; n++)		/* Without the slow console */
+	if (!sinks[n].baud && sinks[n].last > start && sinks[n].last - start > wall)
+	    wall = sinks[n].last - start;
+
+    printf("%s: %u lines of %u bytes sent in %.3fs (%.2f MB/s), blogd cpu %.3fs (%.0f%%)\n",
+	   modes[mode], opt.lines, opt.size, (double)sent/1e9, mb/((double)sent/1e9),
+	   (double)cpu/1e9, wall ? 100.0*(double)cpu/(double)wall : 0.0);
+    printf("  %-12s %8s %8s %9s %8s %8s %8s %8s\n", "sink", "lines", "drops", "MB/s", "p50", "p90", "p99", "max");
+
+    for (n = 0; n < nsinks; n++) {
+	sink_t *s = &sinks[n];
+	char b[4][32];
+	size_t k = 0, i;
+
+	if (!expected(s))
+	    continue;
+	for (i = 0; i < opt.lines; i++)
+	    if (s->lat[i])
+		lat[k++] = s->lat[i];
+	if (!k) {
+	    printf("  %-12s %8u %8u %9s\n", s->name, 0, opt.lines, "-");
+	    continue;
+	}
+	qsort(lat, k, sizeof(uint64_t), cmp);
+	printf("  %-12s %8zu %8zu %9.2f %8s %8s %8s %8s\n", s->name, k, opt.lines - k,
+	       (double)s->bytes/1e6/((double)(s->last - start)/1e9),
+	       usec(lat[k*50/100], b[0], sizeof(b[0])), usec(lat[k*90/100], b[1], sizeof(b[1])),
+	       usec(lat[k*99/100], b[2], sizeof(b[2])), usec(lat[k-1], b[3], sizeof(b[3])));
+    }
+    free(lat);
+
+    /* The own drop counters and rounds of the loop of blogd during this flood */
+    if ((text = stats_request())) {
+	for (line = text; line && *line; line = next) {
+	    char *eq = strchr(line, '=');
+
+	    if ((next = strchr(line, '\n')))
+		*next++ = '\0';
+	    if (eq && strncmp(line, "loop.waits=", 11) == 0) {
+		const unsigned long long waits = strtoull(eq + 1, NULL, 10) -
+		    (before ? counter(before, "loop.waits", 10) : 0);
+		printf("  blogd loop.waits=%llu (%.1f per MB)\n", waits, (double)waits / mb);
+		continue;
+	    }
+	    if (!eq || !(strstr(line, ".dropped=") || strstr(line, ".lost=")))
+		continue;
+	    printf("  blogd %.*s=%llu\n", (int)(eq - line), line,
+		   strtoull(eq + 1, NULL, 10) - (before ? counter(before, line, (size_t)(eq - line)) : 0));
+	}
+	free(text);
+    }
+}
+
+/*
+ * All requesters ask at once, the prompts are queued and the requesters
+ * of the same prompt merged in blogd.  Requesters of passwords coming
+ * after an answer get the password cached and ask again if it is not
+ * their one.
+ */
+static void unlock(unsigned int mode)
+{
+    const char *keys[] = { "password.prompts", "password.merged", "password.cached", "password.canceled" };
+    uint64_t *lat, start, wall, retries = 0;
+    unsigned int n, k = 0;
+    char *before, *text, b[4][32];
+    pid_t *pids;
+    int pfd[2];
+
+    if (!answerer)
+	errx(EXIT_FAILURE, "the password mode needs a console without speed limit");
+    if (!(lat = calloc(opt.requesters, sizeof(uint64_t))) || !(pids = calloc(opt.requesters, sizeof(pid_t))))
+	error("memory allocation failed");
+    if (pipe2(pfd, O_CLOEXEC) < 0)
+	error("can not open pipe");
+
+    current = mode;
+    answers = 0;
+    before = stats_request();
+    start = now();
+    for (n = 0; n < opt.requesters; n++) {
+	switch ((pids[n] = fork())) {
+	case -1:
+	    error("can not fork");
+	case 0:
+	    close(pfd[0]);
+	    requester(n, pfd[1], (mode == MODE_QUESTION) ? MAGIC_QUESTION : MAGIC_ASK_PWD);
+	default:
+	    break;
+	}
+    }
+    close(pfd[1]);
+    for (n = 0; n < opt.requesters; n++) {
+	uint64_t res[2];
+
+	if (!can_read(pfd[0], (int)opt.timeout * 1000) || safein(pfd[0], res, sizeof(res)) != sizeof(res))
+	    break;
+	if (res[0])
+	    lat[k++] = res[0];
+	retries += res[1];
+    }
+    wall = now() - start;
+    close(pfd[0]);
+    for (n = 0; n < opt.requesters; n++)
+	(void)waitpid(pids[n], NULL, 0);
+
+    printf("%s: %u requesters of %u prompts unlocked in %.3fs, %u prompts answered\n",
+	   modes[mode], opt.requesters, opt.prompts, (double)wall/1e9, answers);
+    printf("  %-12s %8s %8s %8s %8s %8s %8s %8s\n", "requesters", "answered", "failed", "retries",
+	   "p50", "p90", "p99", "max");
+    if (k) {
+	qsort(lat, k, sizeof(uint64_t), cmp);
+	printf("  %-12s %8u %8u %8" PRIu64 " %8s %8s %8s %8s\n", "socket", k, opt.requesters - k, retries,
+	       usec(lat[k*50/100], b[0], sizeof(b[0])), usec(lat[k*90/100], b[1], sizeof(b[1])),
+	       usec(lat[k*99/100], b[2], sizeof(b[2])), usec(lat[k-1], b[3], sizeof(b[3])));
+    } else
+	printf("  %-12s %8u %8u %8" PRIu64 "\n", "socket", 0, opt.requesters, retries);
+    if ((text = stats_request())) {
+	for (n = 0; n < sizeof(keys)/sizeof(keys[0]); n++) {
+	    const size_t klen = strlen(keys[n]);
+	    printf("  blogd %s=%llu\n", keys[n], counter(text, keys[n], klen) -
+		   (before ? counter(before, keys[n], klen) : 0));
+	}
+	free(text);
+    }
+    free(before);
+    free(pids);
+    free(lat);
+}
+
+static void run(unsigned int mode)
+{
+    uint64_t start, sent, cpu;
+    char *before;
+    int fd = -1;
+
+    if (mode >= MODE_PASSWORD) {
+	unlock(mode);
+	return;
+    }
+    current = mode;
+    sinks_reset();
+    before = stats_request();
+    cpu = cputime(blogd);
+    start = now();
+    switch (mode) {
+    case MODE_PTY: {
+	char path[64];
+
+	snprintf(path, sizeof(path), "/proc/%d/fd/1", blogd);
+	if ((fd = open(path, O_WRONLY|O_NOCTTY|O_CLOEXEC)) < 0)
+	    error("can not open the pty of blogd");
+	flood(fd);
+	break;
+    }
+    case MODE_FIFO:
+	if ((fd = open(sandbox_path(_PATH_BLOG_FIFO), O_WRONLY|O_NOCTTY|O_CLOEXEC)) < 0)
+	    error("can not open %s", sandbox_path(_PATH_BLOG_FIFO));
+	flood(fd);
+	break;
+    case MODE_SOCKET:
+	flood_socket();
+	break;
+    default:
+	break;
+    }
+    sent = now() - start;
+    settle();
+    if (fd >= 0)
+	close(fd);
+    report(mode, start, sent, cputime(blogd) - cpu, before);
+    free(before);
+}
+
+static int bench(const char *dir)
+{
+    unsigned int n, mode;
+
+    if (opt.ns)
+	setup_ns(dir);
+    else
+	setup_sandbox(dir);
+
+    for (n = 0; n < nsinks; n++) {
+	if (pthread_create(&sinks[n].thread, NULL, reader, &sinks[n]))
+	    error("can not start reader thread");
+    }
+    blogd = start_blogd(opt.blogd);
+    usleep(100000);		/* Let the start messages pass */
+
+    for (mode = 0; mode < MODE_MAX; mode++) {
+	if (opt.mode & (1<<mode))
+	    run(mode);
+    }
+
+    stop_blogd(blogd);
+    stop = 1;
+    for (n = 0; n < nsinks; n++)
+	pthread_join(sinks[n].thread, NULL);
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+	    "Usage: %s [-N] [-b BLOGD] [-n LINES] [-s SIZE] [-c CONSOLES] [-r BAUD] [-t SECS] [-p NUMBER] [-m MODES]\n"
+	    "  -N           Run blogd in name spaces instead of a sandbox, requires root\n"
+	    "  -b BLOGD     The blogd to run, default ./blogd\n"
+	    "  -n LINES     Lines per flood, default %u\n"
+	    "  -s SIZE      Bytes per line, default %u\n"
+	    "  -c CONSOLES  Number of pty consoles, default %u\n"
+	    "  -r BAUD      Speed of the serial console, 0 for none, default %u\n"
+	    "  -t SECS      Time to wait for the lines of a flood, default %u\n"
+	    "  -p NUMBER    Requesters of the password mode, default %u\n"
+	    "  -m MODES     Comma separated list of pty, fifo, socket, password, and question\n",
+	    prog, opt.lines, opt.size, opt.consoles, opt.baud, opt.timeout, opt.requesters);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    char dir[] = "/tmp/blogbench.XXXXXX";
+    unsigned int n;
+    int c, status;
+    pid_t pid;
+
+    while ((c = getopt(argc, argv, "b:n:s:c:r:t:p:m:Nh")) != -1) {
+	switch (c) {
+	case 'N':
+	    opt.ns = 1;
+	    break;
+	case 'b':
+	    opt.blogd = optarg;
+	    break;
+	case 'n':
+	    opt.lines = (unsigned int)strtoul(optarg, NULL, 0);
+	    break;
+	case 's':
+	    opt.size = (unsigned int)strtoul(optarg, NULL, 0);
+	    break;
+	case 'c':
+	    opt.consoles = (unsigned int)strtoul(optarg, NULL, 0);
+	    break;
+	case 'r':
+	    opt.baud = (unsigned int)strtoul(optarg, NULL, 0);
+	    break;
+	case 't':
+	    opt.timeout = (unsigned int)strtoul(optarg, NULL, 0);
+	    break;
+	case 'p':
+	    opt.requesters = (unsigned int)strtoul(optarg, NULL, 0);
+	    break;
+	case 'm': {
+	    char *tok, *save = NULL;
+
+	    opt.mode = 0;
+	    for (tok = strtok_r(optarg, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		unsigned int m;
+		for (m = 0; m < MODE_MAX; m++)
+		    if (strcmp(tok, modes[m]) == 0)
+			break;
+		if (m == MODE_MAX)
+		    usage(argv[0]);
+		opt.mode |= 1<<m;
+	    }
+	    break;
+	}
+	default:
+	    usage(argv[0]);
+	}
+    }
+    if (!opt.lines || opt.size < 48 || opt.size > 4000 || !opt.consoles || opt.consoles > 16 || !opt.requesters)
+	usage(argv[0]);
+    if (access(opt.blogd, X_OK) < 0)
+	error("can not execute %s", opt.blogd);
+    if (opt.ns && geteuid() != 0)
+	errx(EXIT_FAILURE, "the name spaces of the benchmark require root");
+    if (!mkdtemp(dir))
+	error("can not create %s", dir);
+    if (!opt.ns && setenv(SANDBOX_ENV, dir, 1) < 0)
+	error("can not set %s", SANDBOX_ENV);
+
+    /* The consoles and the boot log */
+    nsinks = opt.consoles + 1;
+    if (!(sinks = calloc(nsinks, sizeof(sink_t))))
+	error("memory allocation failed");
+    for (n = 0; n < nsinks; n++) {
+	sink_t *s = &sinks[n];
+
+	if (!(s->lat = calloc(opt.lines, sizeof(uint64_t))))
+	    error("memory allocation failed");
+	s->fd = s->master = s->slave = -1;
+	if (n == opt.consoles) {
+	    s->path = sandbox_path(BOOT_LOGFILE);
+	    strncpy(s->name, "boot.log", sizeof(s->name)-1);
+	    continue;
+	}
+	pty_open(&s->master, &s->slave, s->name, sizeof(s->name));
+	s->fd = s->master;
+	if (n == 0)
+	    s->baud = opt.baud;
+	if (!s->baud && !answerer)
+	    answerer = s;
+    }
+
+    if (!opt.ns) {
+	(void)prctl(PR_SET_CHILD_SUBREAPER, 1);	/* The daemon of blogd is ours */
+	status = bench(dir);
+	if (nftw(dir, unlink_cb, 16, FTW_DEPTH|FTW_PHYS) < 0)
+	    warn("can not remove %s", dir);
+	return status;
+    }
+
+    if (unshare(CLONE_NEWNS|CLONE_NEWNET|CLONE_NEWPID) < 0)
+	error("can not unshare the name spaces");
+
+    switch ((pid = fork())) {
+    case -1:
+	error("can not fork");
+    case 0:
+	status = bench(dir);		/* The pid 1 of the new name space */
+	fflush(stdout);
+	_exit(status);
+    default:
+	break;
+    }
+    if (waitpid(pid, &status, 0) < 0)
+	error("can not wait on benchmark");
+    (void)umount2(dir, MNT_DETACH);
+    (void)rmdir(dir);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE;
+}
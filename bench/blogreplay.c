@@ -0,0 +1,371 @@
+/*
+ * blogreplay.c - Replay a tape recorded by blogd in a sandbox
+ *
+ * Copyright 2026 Werner Fink
+ * Copyright 2026 SUSE Software Solutions Germany GmbH
+ *
+ * This source is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <err.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "libconsole.h"
+#include "harness.h"
+
+#ifndef  _PATH_BLOG_FIFO
+# define _PATH_BLOG_FIFO	"/dev/blog"
+#endif
+
+/*
+ * A tape written by blogd with blog.record=<file>, see record.c, is
+ * fed into a new blogd running in a sandbox with pty pairs as consoles
+ * like the one of blogbench.  The kernel records are put into the
+ * /dev/kmsg of the sandbox as blogd reads them only once at start.
+ * The chunks of the pty are written to the pty of blogd, the ones of
+ * the fifo to its /dev/blog, and each request of the control socket
+ * is sent on a new connection.  Requests which would wait on an answer
+ * of a user, change the root, or end blogd are skipped.  The records
+ * are sent with the original time between them, divided by the speed,
+ * or as fast as possible with speed 0.
+ */
+
+__attribute__((noreturn)) void error (const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    verr(EXIT_FAILURE, fmt, ap);
+    va_end(ap);
+}
+
+static struct {
+    const char *blogd;
+    const char *append;
+    unsigned int consoles;
+    double speed;
+    int keep;
+} opt = {
+    .blogd = "./blogd",
+    .append = "",
+    .consoles = 1,
+    .speed = 1.0,
+};
+
+typedef struct sink_s {
+    char name[32];
+    int master, slave;
+    pthread_t thread;
+    uint64_t bytes;
+} sink_t;
+
+static sink_t *sinks;
+static volatile int stop;
+
+static struct {
+    uint64_t records, bytes;
+} sent[UCHAR_MAX+1], skipped;
+
+static void *reader(void *arg)
+{
+    sink_t *s = arg;
+    char buf[65536];
+
+    while (!stop) {
+	ssize_t r;
+
+	if (!can_read(s->master, 100))
+	    continue;
+	if ((r = read(s->master, buf, sizeof(buf))) > 0)
+	    s->bytes += (uint64_t)r;
+    }
+    return NULL;
+}
+
+/*
+ * All kernel records of the tape, one per line
+ */
+static char *kmsg_records(const char *tape)
+{
+    tape_record_t rec = {};
+    char *text = NULL;
+    size_t tlen;
+    uint64_t wall;
+    FILE *fp, *mf;
+    int ret;
+
+    if (!(fp = tape_open(tape, &wall)))
+	error("can not open tape %s", tape);
+    if (!(mf = open_memstream(&text, &tlen)))
+	error("can not allocate string");
+    while ((ret = tape_next(fp, &rec)) > 0) {
+	if (rec.type != TAPE_KMSG)
+	    continue;
+	fwrite(rec.data, 1, rec.len, mf);
+	fputc('\n', mf);
+    }
+    if (ret < 0)
+	warnx("tape %s is truncated", tape);
+    fclose(mf);
+    fclose(fp);
+    free(rec.data);
+    return text;
+}
+
+static void setup_sandbox(const char *dir, const char *tape)
+{
+    char *consoles, *cmdline, *kmsg;
+    size_t clen, mlen;
+    FILE *cf, *mf;
+    unsigned int n;
+
+    if (!(cf = open_memstream(&consoles, &clen)) || !(mf = open_memstream(&cmdline, &mlen)))
+	error("can not allocate string");
+    for (n = 0; n < opt.consoles; n++)
+	pty_console(cf, sinks[n].name, sinks[n].slave, n == opt.consoles-1);
+    fprintf(mf, "quiet %s\n", opt.append);
+    fclose(cf);
+    fclose(mf);
+
+    kmsg = kmsg_records(tape);
+    sandbox_tree(dir, consoles, cmdline, kmsg);
+    for (n = 0; n < opt.consoles; n++)
+	sandbox_link(dir, sinks[n].master, sinks[n].slave, n == opt.consoles-1);
+    free(consoles);
+    free(cmdline);
+    free(kmsg);
+}
+
+/*
+ * Requests which would block or change the state beyond the replay
+ */
+static int replayable(const tape_record_t *rec)
+{
+    if (rec->len < 2)
+	return 0;
+    switch (rec->data[0]) {
+    case MAGIC_ASK_PWD:
+    case MAGIC_QUESTION:
+    case MAGIC_CHROOT:
+    case MAGIC_QUIT:
+    case MAGIC_FINAL:
+	return 0;
+    default:
+	return 1;
+    }
+}
+
+static void pause_until(uint64_t ns)
+{
+    struct timespec ts = { .tv_sec = (time_t)(ns / 1000000000ULL), .tv_nsec = (long)(ns % 1000000000ULL) };
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+	;
+}
+
+static uint64_t replay(const char *tape, pid_t blogd)
+{
+    tape_record_t rec = {};
+    uint64_t start, offset = 0, wall;
+    char path[64];
+    int pty, fifo, ret;
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "/proc/%d/fd/1", blogd);
+    if ((pty = open(path, O_WRONLY|O_NOCTTY|O_CLOEXEC)) < 0)
+	error("can not open the pty of blogd");
+    if ((fifo = open(sandbox_path(_PATH_BLOG_FIFO), O_WRONLY|O_NOCTTY|O_CLOEXEC)) < 0)
+	error("can not open %s", sandbox_path(_PATH_BLOG_FIFO));
+    if (!(fp = tape_open(tape, &wall)))
+	error("can not open tape %s", tape);
+
+    start = now();
+    while ((ret = tape_next(fp, &rec)) > 0) {
+	if (rec.type == TAPE_KMSG)
+	    continue;			/* Already in /dev/kmsg */
+
+	offset += rec.delta;
+	if (opt.speed > 0)
+	    pause_until(start + (uint64_t)((double)offset / opt.speed));
+
+	switch (rec.type) {
+	case TAPE_PTY:
+	    safeout(pty, rec.data, rec.len, SSIZE_MAX);
+	    break;
+	case TAPE_FIFO:
+	    safeout(fifo, rec.data, rec.len, SSIZE_MAX);
+	    break;
+	case TAPE_SOCKET:
+	    if (!replayable(&rec)) {
+		skipped.records++;
+		skipped.bytes += rec.len;
+		continue;
+	    }
+	    if (command(rec.data, rec.len) < 0)
+		warnx("request '%c' not acknowledged", rec.data[0]);
+	    break;
+	default:
+	    skipped.records++;
+	    skipped.bytes += rec.len;
+	    continue;
+	}
+	sent[rec.type].records++;
+	sent[rec.type].bytes += rec.len;
+    }
+    if (ret < 0)
+	warnx("tape %s is truncated", tape);
+    fclose(fp);
+    free(rec.data);
+    close(fifo);
+    close(pty);
+    return offset;
+}
+
+static void report(uint64_t recorded, uint64_t took, uint64_t cpu, const char *before)
+{
+    static const struct { int type; const char *name; } types[] = {
+	{ TAPE_PTY, "pty" }, { TAPE_FIFO, "fifo" }, { TAPE_SOCKET, "socket" },
+    };
+    char *text, *line, *next;
+    uint64_t total = 0;
+    unsigned int n;
+
+    for (n = 0; n < sizeof(types)/sizeof(types[0]); n++) {
+	printf("%-8s %8" PRIu64 " records %12" PRIu64 " bytes\n", types[n].name,
+	       sent[types[n].type].records, sent[types[n].type].bytes);
+	total += sent[types[n].type].bytes;
+    }
+    printf("%-8s %8" PRIu64 " records %12" PRIu64 " bytes\n", "skipped", skipped.records, skipped.bytes);
+    printf("recorded %.3fs, replayed in %.3fs (%.2f MB/s), blogd cpu %.3fs (%.0f%%)\n",
+	   (double)recorded/1e9, (double)took/1e9, took ? (double)total/1e6/((double)took/1e9) : 0.0,
+	   (double)cpu/1e9, took ? 100.0*(double)cpu/(double)took : 0.0);
+    for (n = 0; n < opt.consoles; n++)
+	printf("  %-12s %12" PRIu64 " bytes\n", sinks[n].name, sinks[n].bytes);
+
+    if ((text = stats_request())) {
+	for (line = text; line && *line; line = next) {
+	    char *eq = strchr(line, '=');
+
+	    if ((next = strchr(line, '\n')))
+		*next++ = '\0';
+	    if (!eq || !(strstr(line, ".dropped=") || strstr(line, ".lost=")))
+		continue;
+	    printf("  blogd %.*s=%llu\n", (int)(eq - line), line,
+		   strtoull(eq + 1, NULL, 10) - (before ? counter(before, line, (size_t)(eq - line)) : 0));
+	}
+	free(text);
+    }
+}
+
+static int run(const char *dir, const char *tape)
+{
+    const char ping[2] = { MAGIC_PING, '\0' };
+    uint64_t start, recorded, took, cpu;
+    char *before;
+    unsigned int n;
+    pid_t blogd;
+
+    setup_sandbox(dir, tape);
+    for (n = 0; n < opt.consoles; n++) {
+	if (pthread_create(&sinks[n].thread, NULL, reader, &sinks[n]))
+	    error("can not start reader thread");
+    }
+    blogd = start_blogd(opt.blogd);
+    usleep(100000);		/* Let the start messages pass */
+
+    before = stats_request();
+    cpu = cputime(blogd);
+    start = now();
+    recorded = replay(tape, blogd);
+    (void)command(ping, sizeof(ping));
+    took = now() - start;
+    report(recorded, took, cputime(blogd) - cpu, before);
+    free(before);
+
+    stop_blogd(blogd);
+    stop = 1;
+    for (n = 0; n < opt.consoles; n++)
+	pthread_join(sinks[n].thread, NULL);
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+	    "Usage: %s [-b BLOGD] [-c CONSOLES] [-x SPEED] [-a ARGS] [-k] TAPE\n"
+	    "  -b BLOGD     The blogd to run, default ./blogd\n"
+	    "  -c CONSOLES  Number of pty consoles, default %u\n"
+	    "  -x SPEED     Factor of the original speed, 0 or max for no pauses, default 1\n"
+	    "  -a ARGS      Append ARGS to the kernel command line of blogd\n"
+	    "  -k           Keep the sandbox directory, e.g. for its boot log\n",
+	    prog, opt.consoles);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    char dir[] = "/tmp/blogreplay.XXXXXX";
+    const char *tape;
+    unsigned int n;
+    int c, status;
+
+    while ((c = getopt(argc, argv, "b:c:x:a:kh")) != -1) {
+	switch (c) {
+	case 'b':
+	    opt.blogd = optarg;
+	    break;
+	case 'c':
+	    opt.consoles = (unsigned int)strtoul(optarg, NULL, 0);
+	    break;
+	case 'x':
+	    opt.speed = strcmp(optarg, "max") == 0 ? 0.0 : strtod(optarg, NULL);
+	    break;
+	case 'a':
+	    opt.append = optarg;
+	    break;
+	case 'k':
+	    opt.keep = 1;
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+    if (optind != argc - 1 || !opt.consoles || opt.consoles > 16 || opt.speed < 0)
+	usage(argv[0]);
+    tape = argv[optind];
+    if (access(tape, R_OK) < 0)
+	error("can not read %s", tape);
+    if (access(opt.blogd, X_OK) < 0)
+	error("can not execute %s", opt.blogd);
+    if (!mkdtemp(dir))
+	error("can not create %s", dir);
+    if (setenv(SANDBOX_ENV, dir, 1) < 0)
+	error("can not set %s", SANDBOX_ENV);
+
+    if (!(sinks = calloc(opt.consoles, sizeof(sink_t))))
+	error("memory allocation failed");
+    for (n = 0; n < opt.consoles; n++)
+	pty_open(&sinks[n].master, &sinks[n].slave, sinks[n].name, sizeof(sinks[n].name));
+
+    (void)prctl(PR_SET_CHILD_SUBREAPER, 1);	/* The daemon of blogd is ours */
+    status = run(dir, tape);
+    if (opt.keep)
+	printf("sandbox kept in %s\n", dir);
+    else if (nftw(dir, unlink_cb, 16, FTW_DEPTH|FTW_PHYS) < 0)
+	warn("can not remove %s", dir);
+    return status;
+}
@@ -0,0 +1,292 @@
+/*
+ * harness.c - Common parts of the tools running blogd in a sandbox
+ *
+ * Copyright 2026 Werner Fink
+ * Copyright 2026 SUSE Software Solutions Germany GmbH
+ *
+ * This source is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <dirent.h>
+#include <endian.h>
+#include <err.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/wait.h>
+#include "libconsole.h"
+#include "harness.h"
+
+/*
+ * The tools create the file system blogd depends on below a directory
+ * and export this as BLOG_SANDBOX, see sandbox.c.  The consoles are pty
+ * pairs, the tool reads the master side.  The blogd daemon is a child
+ * of the tool as the tool is its subreaper.
+ */
+
+uint64_t now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+void xwrite(const char *path, const char *text)
+{
+    int fd;
+
+    if ((fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644)) < 0)
+	error("can not create %s", path);
+    safeout(fd, text, strlen(text), SSIZE_MAX);
+    close(fd);
+}
+
+void xmkdir(const char *dir, const char *name)
+{
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    if (mkdir(path, 0755) < 0 && errno != EEXIST)
+	error("can not create %s", path);
+}
+
+void xsymlink(const char *target, const char *dir, const char *name)
+{
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    if (symlink(target, path) < 0)
+	error("can not create %s", path);
+}
+
+int unlink_cb(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+    (void)st; (void)ftw;
+    if (flag == FTW_DP)
+	return rmdir(path) < 0 ? -1 : 0;
+    return unlink(path) < 0 ? -1 : 0;
+}
+
+/*
+ * A pty pair in raw mode, the name is the one of /proc/consoles
+ */
+void pty_open(int *master, int *slave, char *name, size_t size)
+{
+    struct termios tio;
+
+    if ((*master = posix_openpt(O_RDWR|O_NOCTTY|O_NONBLOCK|O_CLOEXEC)) < 0 ||
+	grantpt(*master) < 0 || unlockpt(*master) < 0)
+	error("can not open pty");
+    if ((*slave = open(ptsname(*master), O_RDWR|O_NOCTTY|O_CLOEXEC)) < 0)
+	error("can not open %s", ptsname(*master));
+    if (tcgetattr(*slave, &tio) == 0) {
+	cfmakeraw(&tio);
+	(void)tcsetattr(*slave, TCSANOW, &tio);
+    }
+    strncpy(name, ptsname(*master) + 5, size-1);
+    name[size-1] = '\0';
+}
+
+/*
+ * The line of a console in /proc/consoles
+ */
+void pty_console(FILE *fp, const char *name, int slave, int consdev)
+{
+    struct stat st;
+
+    if (fstat(slave, &st) < 0)
+	error("can not stat %s", name);
+    fprintf(fp, "%s -W- (E%s p a) %u:%u\n", name, consdev ? "C" : "",
+	    major(st.st_rdev), minor(st.st_rdev));
+}
+
+/*
+ * The file system of blogd in the sandbox.  The kmsg is a plain
+ * file with the given records.
+ */
+void sandbox_tree(const char *dir, const char *consoles, const char *cmdline, const char *kmsg)
+{
+    char path[PATH_MAX];
+
+    xmkdir(dir, "proc");
+    xmkdir(dir, "dev");
+    xmkdir(dir, "dev/char");
+    xmkdir(dir, "dev/shm");
+    xmkdir(dir, "run");
+    xmkdir(dir, "run/systemd");
+    xmkdir(dir, "run/systemd/ask-password");
+    xmkdir(dir, "var");
+    xmkdir(dir, "var/log");
+    xsymlink("../run", dir, "var/run");
+
+    snprintf(path, sizeof(path), "%s/proc/consoles", dir);
+    xwrite(path, consoles);
+    snprintf(path, sizeof(path), "%s/proc/cmdline", dir);
+    xwrite(path, cmdline);
+    snprintf(path, sizeof(path), "%s/dev/kmsg", dir);
+    xwrite(path, kmsg);
+}
+
+/*
+ * The device link of a console points to the pty slave
+ */
+void sandbox_link(const char *dir, int master, int slave, int consdev)
+{
+    char name[64];
+    struct stat st;
+
+    if (fstat(slave, &st) < 0)
+	error("can not stat %s", ptsname(master));
+    snprintf(name, sizeof(name), "dev/char/%u:%u", major(st.st_rdev), minor(st.st_rdev));
+    xsymlink(ptsname(master), dir, name);
+    if (consdev)
+	xsymlink(ptsname(master), dir, "dev/console");
+}
+
+/*
+ * Send a request on a new connection, wait for the answer of blogd
+ */
+int command(const void *req, size_t len)
+{
+    char ans[2] = {};
+    int fd;
+
+    if ((fd = open_un_socket_and_connect()) < 0)
+	return -1;
+    safeout(fd, req, len, SSIZE_MAX);
+    if (can_read(fd, 5000))
+	(void)safein(fd, ans, sizeof(ans));
+    close(fd);
+    return ans[0] == '\x6' ? 0 : -1;
+}
+
+pid_t start_blogd(const char *blogd)
+{
+    const char ping[2] = { MAGIC_PING, '\0' };
+    const char ready[2] = { MAGIC_SYS_INIT, '\0' };
+    int tries, status;
+    pid_t pid;
+    FILE *fp;
+
+    switch ((pid = fork())) {
+    case -1:
+	error("can not fork");
+    case 0:
+	close(0);
+	if (open("/dev/null", O_RDONLY) != 0)
+	    _exit(1);
+	execl(blogd, blogd, (char*)0);
+	_exit(127);
+    default:
+	break;
+    }
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status))
+	errx(EXIT_FAILURE, "%s failed with %d", blogd, status);
+
+    for (tries = 0; tries < 500; tries++) {
+	if (command(ping, sizeof(ping)) == 0)
+	    break;
+	usleep(10000);
+    }
+    if (!(fp = fopen(sandbox_path("/run/blogd.pid"), "re")) || fscanf(fp, "%d", &pid) != 1)
+	errx(EXIT_FAILURE, "blogd did not start");
+    fclose(fp);
+    if (command(ready, sizeof(ready)) < 0)
+	errx(EXIT_FAILURE, "blogd does not answer");
+    return pid;
+}
+
+void stop_blogd(pid_t pid)
+{
+    const char quit[2] = { MAGIC_QUIT, '\0' };
+    unsigned int n;
+    int status;
+
+    (void)command(quit, sizeof(quit));
+    for (n = 0; n < 100 && waitpid(pid, &status, WNOHANG) == 0; n++)
+	usleep(10000);
+    if (n == 100) {
+	(void)kill(pid, SIGTERM);
+	(void)waitpid(pid, &status, 0);
+    }
+}
+
+/*
+ * The run time of all threads of blogd in nano seconds
+ */
+uint64_t cputime(pid_t pid)
+{
+    unsigned long long run;
+    uint64_t sum = 0;
+    struct dirent *d;
+    char path[PATH_MAX];
+    DIR *dir;
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "/proc/%d/task", pid);
+    if (!(dir = opendir(path)))
+	return 0;
+    while ((d = readdir(dir))) {
+	if (d->d_name[0] == '.')
+	    continue;
+	snprintf(path, sizeof(path), "/proc/%d/task/%s/schedstat", pid, d->d_name);
+	if (!(fp = fopen(path, "re")))
+	    continue;
+	if (fscanf(fp, "%llu", &run) == 1)
+	    sum += run;
+	fclose(fp);
+    }
+    closedir(dir);
+    return sum;
+}
+
+/*
+ * The counters of blogd, answered like a password with ANSWER_MLT
+ */
+char *stats_request(void)
+{
+    const char req[2] = { MAGIC_STATS, '\0' };
+    char ans, *text = NULL;
+    uint32_t len;
+    int fd;
+
+    if ((fd = open_un_socket_and_connect()) < 0)
+	return NULL;
+    safeout(fd, req, sizeof(req), SSIZE_MAX);
+    if (can_read(fd, 1000) && safein(fd, &ans, 1) == 1 && ans == ANSWER_MLT[0] &&
+	can_read(fd, 1000) && safein(fd, &len, sizeof(len)) == sizeof(len)) {
+	size_t got = 0;
+	ssize_t r;
+
+	len = le32toh(len);
+	if (!(text = calloc(1, (size_t)len + 1)))
+	    error("memory allocation failed");
+	while (got < len && can_read(fd, 1000) && (r = safein(fd, text + got, len - got)) > 0)
+	    got += (size_t)r;
+    }
+    close(fd);
+    return text;
+}
+
+/*
+ * The value of a key in the answer of MAGIC_STATS
+ */
+unsigned long long counter(const char *text, const char *key, size_t klen)
+{
+    const char *p;
+
+    for (p = text; p && *p; p = strchr(p, '\n'), p = p ? p + 1 : NULL) {
+	if (strncmp(p, key, klen) == 0 && p[klen] == '=')
+	    return strtoull(p + klen + 1, NULL, 10);
+    }
+    return 0;
+}
@@ -0,0 +1,39 @@
+/*
+ * harness.h - Common parts of the tools running blogd in a sandbox
+ *
+ * Copyright 2026 Werner Fink
+ * Copyright 2026 SUSE Software Solutions Germany GmbH
+ *
+ * This source is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef _HARNESS_H_
+#define _HARNESS_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+struct stat;
+struct FTW;
+
+extern uint64_t now(void);
+extern void xwrite(const char *path, const char *text);
+extern void xmkdir(const char *dir, const char *name);
+extern void xsymlink(const char *target, const char *dir, const char *name);
+extern int unlink_cb(const char *path, const struct stat *st, int flag, struct FTW *ftw);
+extern void pty_open(int *master, int *slave, char *name, size_t size);
+extern void pty_console(FILE *fp, const char *name, int slave, int consdev);
+extern void sandbox_tree(const char *dir, const char *consoles, const char *cmdline, const char *kmsg);
+extern void sandbox_link(const char *dir, int master, int slave, int consdev);
+extern int command(const void *req, size_t len);
+extern pid_t start_blogd(const char *blogd);
+extern void stop_blogd(pid_t pid);
+extern uint64_t cputime(pid_t pid);
+extern char *stats_request(void);
+extern unsigned long long counter(const char *text, const char *key, size_t klen);
+
+#endif /* _HARNESS_H_ */
@@ -0,0 +1,383 @@
+/*
+ * parsebench.c - Throughput of the log parser and the console filters
+ *
+ * Copyright 2026 Werner Fink
+ * Copyright 2026 SUSE Software Solutions Germany GmbH
+ *
+ * This source is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <err.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#if defined(__x86_64__) || defined(__i386__)
+# include <x86intrin.h>
+# define HAVE_TSC	1
+#endif
+#include "libconsole.h"
+
+/*
+ * The recorded corpora of bench/corpus are fed in chunks of the size
+ * blogd reads from the pty, that is TRANS_BUFFER_SIZE, into parselog(),
+ * copylog() and the filters of filter.c.  Only the calls themselves are
+ * timed, the log ring is emptied between the chunks as no log file is
+ * open.  Of several passes the fastest one counts.  The result may be
+ * written as baseline and later compared against this baseline, a stage
+ * being slower than the threshold fails.
+ */
+
+__attribute__((noreturn)) void error (const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    verr(EXIT_FAILURE, fmt, ap);
+    va_end(ap);
+}
+
+static struct {
+    const char *dir;
+    const char *check;
+    const char *write;
+    unsigned int kbytes;
+    unsigned int passes;
+    unsigned int threshold;
+} opt = {
+    .dir = "bench/corpus",
+    .kbytes = 4096,
+    .passes = 5,
+    .threshold = 25,
+};
+
+typedef struct corpus_s {
+    const char *name;
+    char *data;
+    size_t len;
+} corpus_t;
+
+static corpus_t corpora[] = {
+    { .name = "systemd-colour" },	/* systemd status lines with SGR colours */
+    { .name = "spinner" },		/* fsck and dracut progress with \r and \b */
+    { .name = "oops" },			/* kernel oops with call trace */
+    { .name = "cjk" },			/* localized UTF-8 output */
+    { .name = "random" },		/* binary, generated */
+};
+#define NCORPORA	(sizeof(corpora)/sizeof(corpora[0]))
+#define RANDOM_SIZE	65536
+
+static struct console con;
+
+static inline uint64_t nsec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static inline uint64_t cycles(void)
+{
+#ifdef HAVE_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/*
+ * The stages, each gets one chunk and returns after the work to
+ * be timed, the preparation of a chunk is done by prep
+ */
+static char *scratch;
+
+static void prep_ring(const char *in, size_t len)
+{
+    (void)in; (void)len;
+    writelog();
+}
+
+static void run_parselog(const char *in, size_t len)
+{
+    parselog(in, len);
+}
+
+static void run_copylog(const char *in, size_t len)
+{
+    copylog(in, len);
+}
+
+static void run_ansi(const char *in, size_t len)
+{
+    (void)filter_ansi(&con, in, len, scratch);
+}
+
+static void prep_prio(const char *in, size_t len)
+{
+    memcpy(scratch, in, len);
+}
+
+static void run_prio(const char *in, size_t len)
+{
+    (void)in;
+    (void)filter_prio(&con, scratch, len);
+}
+
+static void run_wrap(const char *in, size_t len)
+{
+    struct iovec iov[WRAP_IOV];
+
+    while (len > 0)
+	(void)filter_wrap(&con, &in, &len, iov, WRAP_IOV);
+}
+
+typedef struct stage_s {
+    const char *name;
+    void (*prep)(const char *, size_t);
+    void (*run)(const char *, size_t);
+    int filter, prio, wrap;
+} stage_t;
+
+static const stage_t stages[] = {
+    { .name = "parselog", .prep = prep_ring, .run = run_parselog },
+    { .name = "copylog",  .prep = prep_ring, .run = run_copylog },
+    { .name = "strip",    .run = run_ansi,  .filter = FILTER_STRIP, .prio = PRIO_ALL },
+    { .name = "sgr",      .run = run_ansi,  .filter = FILTER_SGR,   .prio = PRIO_ALL },
+    { .name = "prio",     .prep = prep_prio, .run = run_prio, .filter = FILTER_RAW, .prio = LOG_NOTICE },
+    { .name = "wrap",     .run = run_wrap,  .filter = FILTER_RAW,   .prio = PRIO_ALL, .wrap = 80 },
+};
+#define NSTAGES		(sizeof(stages)/sizeof(stages[0]))
+
+typedef struct result_s {
+    double ns, cyc;		/* Per byte */
+} result_t;
+
+static void load(corpus_t *c)
+{
+    char path[PATH_MAX];
+    struct stat st;
+    FILE *fp;
+
+    if (strcmp(c->name, "random") == 0) {
+	uint64_t x = 0x9e3779b97f4a7c15ULL;	/* Fixed seed, xorshift64 */
+	size_t n;
+
+	if (!(c->data = malloc(RANDOM_SIZE)))
+	    error("memory allocation failed");
+	for (n = 0; n < RANDOM_SIZE; n++) {
+	    x ^= x << 13;
+	    x ^= x >> 7;
+	    x ^= x << 17;
+	    c->data[n] = (char)(x >> 56);
+	}
+	c->len = RANDOM_SIZE;
+	return;
+    }
+
+    snprintf(path, sizeof(path), "%s/%s", opt.dir, c->name);
+    if (!(fp = fopen(path, "re")))
+	error("can not open corpus %s", path);
+    if (fstat(fileno(fp), &st) < 0 || st.st_size <= 0)
+	errx(EXIT_FAILURE, "corpus %s is empty", path);
+    c->len = (size_t)st.st_size;
+    if (!(c->data = malloc(c->len)))
+	error("memory allocation failed");
+    if (fread(c->data, 1, c->len, fp) != c->len)
+	error("can not read corpus %s", path);
+    fclose(fp);
+}
+
+/*
+ * One pass over the corpus repeated up to the wanted amount of bytes
+ */
+static void pass(const stage_t *s, const corpus_t *c, size_t total, uint64_t *ns, uint64_t *cyc)
+{
+    size_t done = 0, off = 0;
+
+    memset(&con, 0, sizeof(con));
+    con.tty = "bench";
+    con.filter = s->filter;
+    con.prio = s->prio;
+    con.lprio = -1;
+    con.wrap = s->wrap;
+
+    *ns = *cyc = 0;
+    while (done < total) {
+	size_t len = c->len - off;
+	uint64_t t, y;
+
+	if (len > TRANS_BUFFER_SIZE)
+	    len = TRANS_BUFFER_SIZE;
+	if (s->prep)
+	    s->prep(c->data + off, len);
+
+	t = nsec();
+	y = cycles();
+	s->run(c->data + off, len);
+	*cyc += cycles() - y;
+	*ns += nsec() - t;
+
+	done += len;
+	if ((off += len) >= c->len)
+	    off = 0;
+    }
+    writelog();
+    free(con.fbuf);
+}
+
+static result_t measure(const stage_t *s, const corpus_t *c)
+{
+    const size_t total = (size_t)opt.kbytes * 1024;
+    result_t res = { 0, 0 };
+    uint64_t best = UINT64_MAX, bcyc = 0;
+    unsigned int n;
+
+    for (n = 0; n < opt.passes; n++) {
+	uint64_t ns, cyc;
+
+	pass(s, c, total, &ns, &cyc);
+	if (ns < best) {
+	    best = ns;
+	    bcyc = cyc;
+	}
+    }
+    res.ns = (double)best / (double)total;
+    res.cyc = (double)bcyc / (double)total;
+    return res;
+}
+
+/*
+ * The baseline has one line "corpus stage ns/byte" per measurement
+ */
+static int baseline(const char *path, const char *corpus, const char *stage, double *ns)
+{
+    char line[256], cname[64], sname[64];
+    int found = 0;
+    FILE *fp;
+
+    if (!(fp = fopen(path, "re")))
+	error("can not open baseline %s", path);
+    while (!found && fgets(line, sizeof(line), fp)) {
+	if (*line == '#')
+	    continue;
+	if (sscanf(line, "%63s %63s %lf", cname, sname, ns) != 3)
+	    continue;
+	if (strcmp(cname, corpus) == 0 && strcmp(sname, stage) == 0)
+	    found = 1;
+    }
+    fclose(fp);
+    return found;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+	    "Usage: %s [-d DIR] [-s KBYTES] [-p PASSES] [-c BASELINE [-t PERCENT]] [-w BASELINE]\n"
+	    "  -d DIR       Directory of the corpora, default %s\n"
+	    "  -s KBYTES    Input per pass, default %u\n"
+	    "  -p PASSES    Passes of which the fastest counts, default %u\n"
+	    "  -c BASELINE  Fail if a stage is slower than the baseline\n"
+	    "  -t PERCENT   Tolerated slow down, default %u\n"
+	    "  -w BASELINE  Write the results as new baseline\n",
+	    prog, opt.dir, opt.kbytes, opt.passes, opt.threshold);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    result_t res[NCORPORA][NSTAGES];
+    unsigned int n, s, slower = 0;
+    FILE *out = NULL;
+    int c;
+
+    while ((c = getopt(argc, argv, "d:s:p:c:t:w:h")) != -1) {
+	switch (c) {
+	case 'd':
+	    opt.dir = optarg;
+	    break;
+	case 's':
+	    opt.kbytes = (unsigned int)strtoul(optarg, NULL, 0);
+	    break;
+	case 'p':
+	    opt.passes = (unsigned int)strtoul(optarg, NULL, 0);
+	    break;
+	case 'c':
+	    opt.check = optarg;
+	    break;
+	case 't':
+	    opt.threshold = (unsigned int)strtoul(optarg, NULL, 0);
+	    break;
+	case 'w':
+	    opt.write = optarg;
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+    if (!opt.kbytes || !opt.passes || optind < argc)
+	usage(argv[0]);
+
+    for (n = 0; n < NCORPORA; n++)
+	load(&corpora[n]);
+    if (!(scratch = malloc(TRANS_BUFFER_SIZE + sizeof(con.seq) + sizeof(con.head))))
+	error("memory allocation failed");
+
+    printf("%-16s %-10s %10s %12s %10s\n", "corpus", "stage", "ns/byte", "cycles/byte", "MB/s");
+    for (n = 0; n < NCORPORA; n++) {
+	for (s = 0; s < NSTAGES; s++) {
+	    char cyc[32] = "-";
+
+	    res[n][s] = measure(&stages[s], &corpora[n]);
+#ifdef HAVE_TSC
+	    snprintf(cyc, sizeof(cyc), "%.3f", res[n][s].cyc);
+#endif
+	    printf("%-16s %-10s %10.3f %12s %10.1f\n", corpora[n].name, stages[s].name,
+		   res[n][s].ns, cyc, res[n][s].ns > 0 ? 1000.0 / res[n][s].ns : 0.0);
+	}
+    }
+
+    if (opt.check) {
+	for (n = 0; n < NCORPORA; n++) {
+	    for (s = 0; s < NSTAGES; s++) {
+		double base, limit;
+
+		if (!baseline(opt.check, corpora[n].name, stages[s].name, &base)) {
+		    printf("%s %s: not in baseline %s\n", corpora[n].name, stages[s].name, opt.check);
+		    continue;
+		}
+		limit = base * (100.0 + opt.threshold) / 100.0;
+		if (res[n][s].ns > limit) {
+		    printf("%s %s: %.3f ns/byte, baseline %.3f ns/byte, %+.0f%%\n",
+			   corpora[n].name, stages[s].name, res[n][s].ns, base,
+			   (res[n][s].ns - base) * 100.0 / base);
+		    slower++;
+		}
+	    }
+	}
+	if (slower)
+	    printf("%u of %zu stages slower than %u%% above baseline\n", slower, NCORPORA*NSTAGES, opt.threshold);
+	else
+	    printf("all stages within %u%% of baseline\n", opt.threshold);
+    }
+
+    if (opt.write) {
+	if (!(out = fopen(opt.write, "we")))
+	    error("can not write baseline %s", opt.write);
+	fprintf(out, "# corpus stage ns/byte, written by parsebench -w\n");
+	for (n = 0; n < NCORPORA; n++)
+	    for (s = 0; s < NSTAGES; s++)
+		fprintf(out, "%s %s %.3f\n", corpora[n].name, stages[s].name, res[n][s].ns);
+	if (fclose(out) != 0)
+	    error("can not write baseline %s", opt.write);
+    }
+
+    return slower ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -20,6 +20,8 @@
 #include <string.h>
 #include <poll.h>
 #include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
 #include "libconsole.h"
 
 /*
@@ -41,7 +43,114 @@ static int getsocket(void)
     return fd;
 }
 
+/*
+ * In batch mode all commands share one connection opened with
+ * MAGIC_SESSION.  The commands only acknowledged by blogd are not
+ * waited on, their answers are read in order before a command with
+ * a real answer, if the pipeline is full, and at the end.
+ */
+#define PIPELINE	64
+#define WAIT_ANSWER	10000	/* Milli seconds, e.g. for the sync of the log */
+#define SYNC_RETRY	100	/* Milli seconds until a sync is asked again on ENQ */
+#define MAX_ARGS	32
+static int batched, session = -1;
+static unsigned int lineno, pending, pline[PIPELINE];
+static int failed;
+
+static int recvall(int fd, void *ptr, size_t len);
+
+/*
+ * Send a request with its payload, in the framing of plymouthd if short
+ * enough and otherwise in the extended frame of blogd
+ */
+static void sendframe(int fd, char magic, const void *data, size_t len)
+{
+    unsigned char *req;
+    size_t hlen;
+
+    if (len > FRAME_MAXIMUM) {
+	errno = EINVAL;
+	error("message string too long (max %d chars)", FRAME_MAXIMUM - 1);
+    }
+    if (!(req = malloc(FRAME_HEADER + len)))
+	error("memory allocation failed");
+    if (len <= UCHAR_MAX) {
+	req[0] = magic;
+	req[1] = FRAME_LEGACY;
+	req[2] = (unsigned char)len;
+	hlen = 3;
+    } else {
+	frame_t frame = { magic, FRAME_EXTENDED, 0, FRAME_VERSION, htole32((uint32_t)len) };
+
+	memcpy(req, &frame, sizeof(frame));
+	hlen = FRAME_HEADER;
+    }
+    memcpy(&req[hlen], data, len);
+    safeout(fd, req, hlen + len, SSIZE_MAX);
+    free(req);
+}
+
+static void sendreq(int fd, char magic, const char *text)
+{
+    sendframe(fd, magic, text, strlen(text) + 1);
+}
+
+/*
+ * Milli seconds of the monotonic clock
+ */
+static long long monotonic_ms(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+	error("can not read monotonic clock");
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int connection(void)
+{
+    const char req[2] = { MAGIC_SESSION, '\0' };
+    char ans[2] = {};
+    int fd;
+
+    if (session >= 0)
+	return session;
+    if ((fd = getsocket()) < 0)
+	error("no blogd active");
+    if (!batched)
+	return fd;
+    safeout(fd, req, sizeof(req), SSIZE_MAX);
+    if (recvall(fd, ans, sizeof(ans)) < 0 || ans[0] != '\x6') {
+	errno = EPROTO;
+	error("blogd does not keep connections");
+    }
+    return session = fd;
+}
+
+static void drain(void)
+{
+    unsigned int n;
+
+    for (n = 0; n < pending; n++) {
+	char ans[2] = {};
+
+	if (recvall(session, ans, sizeof(ans)) < 0 || (ans[0] != '\x6' && ans[0] != '\x5')) {
+	    warnx("line %u: request not acknowledged by blogd", pline[n]);
+	    failed = 1;
+	}
+    }
+    pending = 0;
+}
+
+static void queue(void)
+{
+    if (pending == PIPELINE)
+	drain();
+    pline[pending++] = lineno;
+}
+
 #define MAGIC_HELP	0x19
+#define MAGIC_LATENCY	0x1a	/* Local only, read from shared memory */
 static char getcmd(int argc, char *argv[])
 {
     static const struct {
@@ -62,6 +171,13 @@ static char getcmd(int argc, char *argv[])
 	{ "close",		MAGIC_CLOSE,		0, NULL	},	/* Close logging only */
 	{ "deactivate",		MAGIC_DEACTIVATE,	0, NULL	},	/* Deactivate logging */
 	{ "reactivate",		MAGIC_REACTIVATE,	0, NULL	},	/* Reactivate logging */
+	{ "stats",		MAGIC_STATS,		0, NULL	},	/* Counters */
+	{ "trace",		MAGIC_TRACE,		0, NULL	},	/* Trace ring */
+	{ "latency",		MAGIC_LATENCY,		0, NULL	},	/* Event loop latencies */
+	{ "log",		MAGIC_LOG,		0, NULL	},	/* Lines for the log only */
+	{ "follow",		MAGIC_FOLLOW,		0, NULL	},	/* Stream the input */
+	{ "dump",		MAGIC_DUMP,		0, NULL	},	/* Log ring not yet written */
+	{ "sync",		MAGIC_SYNC,		0, NULL	},	/* Wait on the log on disk */
 	{ "help",		MAGIC_HELP,		0, NULL	},	/* End Of Medium aka Help */
 	{}
     }, *cmd = cmds;
@@ -73,7 +189,7 @@ static char getcmd(int argc, char *argv[])
     optarg = NULL;
     if (argv[optind] && *argv[optind]) {
 	int n = optind++;
-	for (; cmd->cmd; cmd++)
+	for (cmd = cmds; cmd->cmd; cmd++)
 	    if (cmd->arg) {
 		if (strncmp(cmd->cmd, argv[n], strlen(cmd->cmd)) == 0) {
 		    optarg = strchr(argv[n], '=');
@@ -118,35 +234,424 @@ static int wait_for_blogd_close(int fd)
      }
 }
 
-int main(int argc, char *argv[])
+/*
+ * Read exactly len bytes, the answer may arrive in several parts
+ */
+static int recvall(int fd, void *ptr, size_t len)
+{
+    char *p = ptr;
+
+    while (len > 0) {
+	ssize_t r;
+
+	if (!can_read(fd, WAIT_ANSWER))
+	    return -1;
+	if ((r = safein(fd, p, len)) <= 0)
+	    return -1;
+	p += r;
+	len -= (size_t)r;
+    }
+    return 0;
+}
+
+/*
+ * Requests for counters or the trace ring, the answer is framed like a password
+ */
+static char *request(char magic, uint32_t *size)
+{
+    const char req[3] = { magic, '\0', '\0' };
+    uint32_t len;
+    char ans, *buf;
+    int fd;
+
+    fd = connection();
+    safeout(fd, req, sizeof(req)-1, SSIZE_MAX);
+    if (recvall(fd, &ans, 1) < 0 || ans != '\t') {
+	errno = EPROTO;
+	error("no answer from blogd");
+    }
+    if (recvall(fd, &len, sizeof(len)) < 0)
+	error("can not read answer");
+    len = le32toh(len);
+    if (!(buf = calloc(1, (size_t)len + 1)))
+	error("memory allocation failed");
+    if (recvall(fd, buf, len) < 0)
+	error("can not read answer");
+    if (fd != session)
+	close(fd);
+    if (size)
+	*size = len;
+    return buf;
+}
+
+typedef struct counter_s {
+    char key[64];
+    unsigned long long val;
+} counter_t;
+
+static size_t parse_stats(char *text, counter_t *cnt, size_t max)
+{
+    char *line, *save = NULL;
+    size_t n = 0;
+
+    for (line = strtok_r(text, "\n", &save); line && n < max; line = strtok_r(NULL, "\n", &save)) {
+	char *eq = strchr(line, '=');
+	if (!eq || (size_t)(eq - line) >= sizeof(cnt->key))
+	    continue;
+	*eq = '\0';
+	strcpy(cnt[n].key, line);
+	cnt[n].val = strtoull(eq+1, NULL, 10);
+	n++;
+    }
+    return n;
+}
+
+/*
+ * Print the counters as table or as JSON object, in watch
+ * mode the table shows the change per second as well
+ */
+#define MAX_COUNTER	256
+static void show_stats(int json, unsigned int watch)
+{
+    static counter_t cnt[2][MAX_COUNTER];
+    size_t num[2] = { 0, 0 };
+    int cur = 0;
+
+    do {
+	char *text = request(MAGIC_STATS, NULL);
+	size_t n, o;
+
+	num[cur] = parse_stats(text, cnt[cur], MAX_COUNTER);
+	free(text);
+
+	if (json) {
+	    fputc('{', stdout);
+	    for (n = 0; n < num[cur]; n++)
+		printf("%s\"%s\":%llu", n ? "," : "", cnt[cur][n].key, cnt[cur][n].val);
+	    fputs("}\n", stdout);
+	} else {
+	    for (n = 0; n < num[cur]; n++) {
+		printf("%-32s %16llu", cnt[cur][n].key, cnt[cur][n].val);
+		for (o = 0; watch && o < num[!cur]; o++) {
+		    if (strcmp(cnt[!cur][o].key, cnt[cur][n].key) == 0) {
+			printf(" %14.1f/s", (double)(cnt[cur][n].val - cnt[!cur][o].val) / watch);
+			break;
+		    }
+		}
+		putchar('\n');
+	    }
+	    if (watch)
+		putchar('\n');
+	}
+	fflush(stdout);
+
+	if (watch)
+	    sleep(watch);
+	cur = !cur;
+    } while (watch);
+}
+
+/*
+ * Dump the trace ring of blogd as text or in the JSON format of
+ * the Chrome trace viewer, which is also read by Perfetto
+ */
+static void show_trace(int json)
+{
+    const trace_head_t *head;
+    const trace_event_t *ev;
+    uint32_t size, n;
+    char *buf;
+
+    buf = request(MAGIC_TRACE, &size);
+    head = (const trace_head_t*)buf;
+    if (size < sizeof(trace_head_t) || head->magic != TRACE_MAGIC || head->version != TRACE_VERSION ||
+	size < sizeof(trace_head_t) + (uint64_t)head->count * sizeof(trace_event_t)) {
+	errno = EPROTO;
+	error("unknown trace format of blogd");
+    }
+    ev = (const trace_event_t*)(buf + sizeof(trace_head_t));
+
+    if (json) {
+	printf("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+	for (n = 0; n < head->count; n++) {
+	    const int tid = ev[n].fd < 0 ? 0 : ev[n].fd;
+	    printf("%s\n{\"name\":\"%s\",\"cat\":\"blogd\",\"pid\":1,\"tid\":%d,",
+		   n ? "," : "", trace_name(ev[n].type), tid);
+	    if (ev[n].dur)
+		printf("\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,",
+		       (double)(ev[n].ns - ev[n].dur) / 1000.0, (double)ev[n].dur / 1000.0);
+	    else
+		printf("\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,", (double)ev[n].ns / 1000.0);
+	    printf("\"args\":{\"fd\":%d,\"arg\":%llu}}", ev[n].fd, (unsigned long long)ev[n].arg);
+	}
+	printf("\n]}\n");
+    } else {
+	printf("# %u events, %u overwritten\n", head->count, head->lost);
+	printf("# %14s %-10s %5s %12s %12s\n", "time(s)", "event", "fd", "arg", "dur(us)");
+	for (n = 0; n < head->count; n++) {
+	    printf("%16.9f %-10s %5d %12llu", (double)ev[n].ns / 1e9, trace_name(ev[n].type),
+		   ev[n].fd, (unsigned long long)ev[n].arg);
+	    if (ev[n].dur)
+		printf(" %12.3f", (double)ev[n].dur / 1000.0);
+	    putchar('\n');
+	}
+    }
+    free(buf);
+}
+
+/*
+ * Show the latencies of the handlers of the event loop of blogd
+ * as found in its shared memory page, blogd is not disturbed.
+ */
+static const char *nsec2str(uint64_t nsec, char *buf, size_t size)
+{
+    if (nsec < 1000ULL)
+	snprintf(buf, size, "%lluns", (unsigned long long)nsec);
+    else if (nsec < 1000000ULL)
+	snprintf(buf, size, "%lluus", (unsigned long long)(nsec/1000ULL));
+    else if (nsec < 1000000000ULL)
+	snprintf(buf, size, "%llums", (unsigned long long)(nsec/1000000ULL));
+    else
+	snprintf(buf, size, "%llus", (unsigned long long)(nsec/1000000000ULL));
+    return buf;
+}
+
+static int show_latency(void)
+{
+    const latency_page_t *p;
+    unsigned int n, slots;
+
+    p = shm_attach(LATENCY_SHM, sizeof(latency_page_t));
+    if (!p)
+	error("no latencies of blogd available");
+    if (p->magic != LATENCY_MAGIC || p->version != LATENCY_VERSION) {
+	errno = EPROTO;
+	error("unknown latency page of blogd");
+    }
+
+    slots = __atomic_load_n(&p->slots, __ATOMIC_ACQUIRE);
+    if (slots > LATENCY_SLOTS)
+	slots = LATENCY_SLOTS;
+
+    printf("%-16s %10s %12s %10s %10s\n", "handler", "calls", "total(us)", "avg(ns)", "max(ns)");
+    for (n = 0; n < slots; n++) {
+	latency_t l;
+	int b;
+
+	if (latency_read(p, n, &l) < 0 || !l.calls)
+	    continue;
+	l.name[sizeof(l.name)-1] = '\0';
+	printf("%-16s %10llu %12llu %10llu %10llu\n", l.name,
+	       (unsigned long long)l.calls, (unsigned long long)(l.nsec/1000ULL),
+	       (unsigned long long)(l.nsec/l.calls), (unsigned long long)l.max);
+	printf("%16s", "");
+	for (b = 0; b < LATENCY_BUCKETS; b++) {
+	    char lim[16];
+	    if (!l.hist[b])
+		continue;
+	    printf(" <%s:%llu", nsec2str((uint64_t)1 << b, lim, sizeof(lim)),
+		   (unsigned long long)l.hist[b]);
+	}
+	putchar('\n');
+    }
+    return 0;
+}
+
+/*
+ * Copy what blogd streams for MAGIC_FOLLOW to stdout, that is
+ * the ring of its input and then all new input until one side
+ * goes away.  A slow reader gets a marker of the bytes skipped.
+ */
+static int follow_output(void)
+{
+    const char req[2] = { MAGIC_FOLLOW, '\0' };
+    char ans[2] = {}, buf[4096];
+    int fd;
+
+    if (batched) {
+	warnx("line %u: follow is not possible in batch mode", lineno);
+	return 1;
+    }
+    if ((fd = getsocket()) < 0)
+	error("no blogd active");
+    safeout(fd, req, sizeof(req), SSIZE_MAX);
+    if (recvall(fd, ans, sizeof(ans)) < 0 || ans[0] != '\x6') {
+	errno = EPROTO;
+	error("blogd does not stream its input");
+    }
+    while (can_read(fd, -1)) {
+	ssize_t got = safein(fd, buf, sizeof(buf));
+	char *p = buf;
+
+	if (got <= 0)
+	    break;
+	while (got > 0) {
+	    ssize_t ret = write(1, p, (size_t)got);
+
+	    if (ret < 0) {
+		if (errno == EINTR)
+		    continue;
+		close(fd);
+		return errno == EPIPE ? 0 : 1;
+	    }
+	    p += ret;
+	    got -= ret;
+	}
+    }
+    close(fd);
+    return 0;
+}
+
+/*
+ * Lines for the boot log only, see MAGIC_LOG.  The words of the command
+ * line are one line, otherwise the lines of stdin are sent in batches
+ * over a session without waiting on each answer.
+ */
+#define LOG_BATCH	65536
+
+static int log_prio(const char *name)
+{
+    static const char *const names[] = {
+	"emerg", "alert", "crit", "err", "warning", "notice", "info", "debug"
+    };
+    int n;
+
+    if (name[0] >= '0' && name[0] <= '7' && !name[1])
+	return name[0] - '0';
+    for (n = 0; n < 8; n++)
+	if (strcmp(name, names[n]) == 0)
+	    return n;
+    return -1;
+}
+
+static size_t log_record(char *buf, const char *tag, int prio, const char *text, size_t len)
+{
+    logrec_t rec = { (unsigned char)prio, (unsigned char)strlen(tag), htole32((uint32_t)len) };
+
+    memcpy(buf, &rec, sizeof(rec));
+    memcpy(buf + sizeof(rec), tag, rec.tlen);
+    memcpy(buf + sizeof(rec) + rec.tlen, text, len);
+    return sizeof(rec) + rec.tlen + len;
+}
+
+static int log_lines(int argc, char *argv[], const char *tag, int prio)
+{
+    const size_t head = sizeof(logrec_t) + UCHAR_MAX;
+    size_t fill = 0, len = 0;
+    char *text, *buf;
+    int n, fd;
+
+    if (strlen(tag) > UCHAR_MAX) {
+	errno = EINVAL;
+	error("tag too long (max %d chars)", UCHAR_MAX);
+    }
+
+    if (optind < argc) {			/* The words are the line */
+	char ans[2] = {};
+
+	for (n = optind; n < argc; n++)
+	    len += strlen(argv[n]) + 1;
+	if (!(text = calloc(1, len)) || !(buf = malloc(head + len)))
+	    error("memory allocation failed");
+	for (n = optind; n < argc; n++) {
+	    if (n > optind)
+		strcat(text, " ");
+	    strcat(text, argv[n]);
+	}
+	fd = connection();
+	sendframe(fd, MAGIC_LOG, buf, log_record(buf, tag, prio, text, strlen(text)));
+	free(text);
+	free(buf);
+	if (fd == session) {
+	    queue();
+	    return 0;
+	}
+	n = recvall(fd, ans, sizeof(ans));
+	close(fd);
+	return (n < 0 || (ans[0] != '\x6' && ans[0] != '\x5'));
+    }
+
+    if (batched) {
+	warnx("line %u: log in batch mode needs the text as argument", lineno);
+	return 1;
+    }
+    batched = 1;
+    fd = connection();
+
+    if (!(text = malloc(LOG_BATCH)) || !(buf = malloc(head + LOG_BATCH)))
+	error("memory allocation failed");
+    while (1) {
+	ssize_t got = read(0, text + fill, LOG_BATCH - fill);
+	size_t cut;
+	char *eol;
+
+	if (got < 0) {
+	    if (errno == EINTR)
+		continue;
+	    error("can not read stdin");
+	}
+	if (!(fill += (size_t)got))
+	    break;
+	cut = fill;
+	if (got) {				/* Complete lines only, unless the buffer is full */
+	    if ((eol = memrchr(text, '\n', fill)))
+		cut = (size_t)(eol - text) + 1;
+	    else if (fill < LOG_BATCH)
+		continue;
+	}
+	for (eol = text; (eol = memchr(eol, '\n', text + cut - eol)); eol++)
+	    lineno++;
+	sendframe(fd, MAGIC_LOG, buf, log_record(buf, tag, prio, text, cut));
+	queue();
+	fill -= cut;
+	memmove(text, text + cut, fill);
+    }
+    free(text);
+    free(buf);
+    drain();
+    close(session);
+    session = -1;
+
+    return failed;
+}
+
+static int execute(int argc, char *argv[])
 {
     char *root = NULL;
-    char *message, answer[2], cmd[2];
-    int fdsock = -1, ret, len, do_wait = 0;
+    char answer[2], cmd[2];
+    int fdsock = -1, do_wait = 0;
 
     cmd[1] = '\0';
     answer[0] = '\x15';
 
     while ((cmd[0] = getcmd(argc, argv)) != (char)-1) {
-	if (cmd[0] != MAGIC_HELP && fdsock < 0) {
-	    fdsock = getsocket();
-	    if (fdsock < 0)
-		error("no blogd active");
+	switch (cmd[0]) {
+	case MAGIC_PING:
+	case MAGIC_SYS_INIT:
+	case MAGIC_FINAL:
+	case MAGIC_CLOSE:
+	case MAGIC_DEACTIVATE:
+	case MAGIC_REACTIVATE:
+	case MAGIC_SHOW_MSG:
+	case MAGIC_HIDE_MSG:
+	case MAGIC_LOG:
+	    break;
+	default:				/* Wait on the answers so far */
+	    if (session >= 0)
+		drain();
+	    break;
 	}
+	if (cmd[0] != MAGIC_HELP && cmd[0] != MAGIC_LATENCY && cmd[0] != MAGIC_STATS && cmd[0] != MAGIC_TRACE &&
+	    cmd[0] != MAGIC_LOG && cmd[0] != MAGIC_FOLLOW && cmd[0] != MAGIC_DUMP && fdsock < 0)
+	    fdsock = connection();
 	switch (cmd[0]) {
 	case MAGIC_CHROOT:
 	    root = optarg;
-	    len = (int)strlen(root);
-	    if (len > UCHAR_MAX || len < 1) {
+	    if (!*root) {
 		errno = EINVAL;
 		error("can not send message");
 	    }
-	    message = NULL;
-	    ret = asprintf(&message, "%c\002%c%s%n", cmd[0], (int)(strlen(root) + 1), root, &len);
-	    if (ret < 0)
-		error("can not allocate message");
-	    safeout(fdsock, message, len+1, SSIZE_MAX);
-	    free(message);
+	    sendreq(fdsock, cmd[0], root);
 	    break;
 	case MAGIC_PING:
 	case MAGIC_SYS_INIT:
@@ -204,20 +709,8 @@ int main(int argc, char *argv[])
 	    if (!prompt)
 		prompt = (cmd[0] == MAGIC_ASK_PWD) ? "Password" : "Question";
 
-	    len = (int)strlen(prompt);
-	    if (len >= UCHAR_MAX) {
-		errno = EINVAL;
-		error("prompt string too long (max 254 chars)");
-	    }
-
 	    do {
-		message = NULL;
-		ret = asprintf(&message, "%c\002%c%s%n", cmd[0], len + 1, prompt, &len);
-		if (ret < 0)
-		    error("can not allocate message");
-		
-		safeout(fdsock, message, len + 1, SSIZE_MAX);
-		free(message);
+		sendreq(fdsock, cmd[0], prompt);
 
 		/* Wait for the users answer */
 		if (can_read(fdsock, -1)) {
@@ -279,24 +772,162 @@ int main(int argc, char *argv[])
 		    text = optarg;
 	    }
 
-	    len = (int)strlen(text);
-	    if (len >= UCHAR_MAX) {
-		errno = EINVAL;
-		error("message string too long (max 254 chars)");
+	    sendreq(fdsock, cmd[0], text);
+	    break;
+	}
+	case MAGIC_STATS: {
+	    unsigned int watch = 0;
+	    int c, json = 0;
+
+	    static struct option long_options[] = {
+		{"json",	no_argument,	   0, 'j'},
+		{"watch",	optional_argument, 0, 'w'},
+		{0, 0, 0, 0}
+	    };
+
+	    while ((c = getopt_long_only(argc, argv, "", long_options, NULL)) != -1) {
+		switch (c) {
+		    case 'j':
+			json = 1;
+			break;
+		    case 'w':
+			watch = optarg ? (unsigned int)atoi(optarg) : 1;
+			if (!watch)
+			    watch = 1;
+			break;
+		    default:
+			break;
+		}
 	    }
+	    show_stats(json, watch);
+	    answer[0] = '\x6';
+	    goto fail;
+	}
+	case MAGIC_TRACE: {
+	    int c, json = 0;
 
-	    message = NULL;
-	    ret = asprintf(&message, "%c\002%c%s%n", cmd[0], len + 1, text, &len);
-	    if (ret < 0)
-		error("can not allocate message");
-	    
-	    safeout(fdsock, message, len + 1, SSIZE_MAX);
-	    free(message);
-	    
-	    break;
+	    static struct option long_options[] = {
+		{"json",	no_argument,	   0, 'j'},
+		{0, 0, 0, 0}
+	    };
+
+	    if (!argv[optind] || strcmp(argv[optind], "dump") != 0) {
+		printf("Usage: /sbin/blogctl help\n");
+		goto fail;
+	    }
+	    optind++;
+	    while ((c = getopt_long_only(argc, argv, "", long_options, NULL)) != -1) {
+		if (c == 'j')
+		    json = 1;
+	    }
+	    show_trace(json);
+	    answer[0] = '\x6';
+	    goto fail;
 	}
+	case MAGIC_LOG: {
+	    const char *tag = "blogctl";
+	    int c, prio = 5;
+
+	    static struct option long_options[] = {
+		{"tag",		required_argument, 0, 't'},
+		{"priority",	required_argument, 0, 'p'},
+		{0, 0, 0, 0}
+	    };
+
+	    while ((c = getopt_long_only(argc, argv, "", long_options, NULL)) != -1) {
+		switch (c) {
+		    case 't':
+			tag = optarg;
+			break;
+		    case 'p':
+			if ((prio = log_prio(optarg)) < 0) {
+			    errno = EINVAL;
+			    error("unknown priority %s", optarg);
+			}
+			break;
+		    default:
+			break;
+		}
+	    }
+	    answer[0] = log_lines(argc, argv, tag, prio) ? '\x15' : '\x6';
+	    optind = argc;
+	    goto fail;
+	}
+	case MAGIC_FOLLOW:
+	    answer[0] = follow_output() ? '\x15' : '\x6';
+	    goto fail;
+	case MAGIC_SYNC: {
+	    int c, timeout = 20;
+	    long long deadline;
+
+	    static struct option long_options[] = {
+		{"timeout",	required_argument, 0, 't'},
+		{0, 0, 0, 0}
+	    };
+
+	    while ((c = getopt_long_only(argc, argv, "", long_options, NULL)) != -1) {
+		if (c == 't')
+		    timeout = atoi(optarg);
+	    }
+
+	    /*
+	     * Early in the boot blogd may not have opened the log file
+	     * even after ready, then it answers with ENQ at once and the
+	     * sync is asked again until the timeout
+	     */
+	    deadline = monotonic_ms() + (long long)timeout * 1000;
+	    do {
+		long long left = timeout > 0 ? deadline - monotonic_ms() : -1;
+
+		if (timeout > 0 && left < 0)
+		    left = 0;
+		safeout(fdsock, cmd, strlen(cmd)+1, SSIZE_MAX);
+		if (!can_read(fdsock, (time_t)left)) {
+		    warnx("boot log not on the disk within %d seconds", timeout);
+		    if (fdsock == session) {		/* The late answer would be out of order */
+			close(session);
+			session = fdsock = -1;
+		    }
+		    break;
+		}
+		answer[0] = '\0';
+		safein(fdsock, &answer[0], sizeof(answer));
+		if (answer[0] != '\x5')
+		    break;
+		if (timeout > 0 && deadline - monotonic_ms() < SYNC_RETRY)
+		    break;
+		if (fdsock != session) {
+		    close(fdsock);			/* blogd has closed its side */
+		    fdsock = -1;
+		}
+		usleep(SYNC_RETRY * 1000);
+		if (fdsock < 0)
+		    fdsock = connection();
+	    } while (1);
+	    if (answer[0] == '\x5')
+		warnx("boot log not yet writable");
+	    goto end_cmd;
+	}
+	case MAGIC_DUMP: {
+	    uint32_t size;
+	    char *buf;
+
+	    buf = request(MAGIC_DUMP, &size);
+	    answer[0] = (fwrite(buf, 1, size, stdout) == size && fflush(stdout) == 0) ? '\x6' : '\x15';
+	    free(buf);
+	    if (session >= 0) {			/* blogd closes it after a large dump */
+		close(session);
+		session = -1;
+	    }
+	    goto fail;
+	}
+	case MAGIC_LATENCY:
+	    show_latency();
+	    answer[0] = '\x6';
+	    goto fail;
 	case MAGIC_HELP:
-	    printf("Usage: /sbin/blogctl [COMMAND] [OPTIONS]\n\n"
+	    printf("Usage: /sbin/blogctl [COMMAND] [OPTIONS]\n"
+		   "       /sbin/blogctl - < FILE\n\n"
 		   "Commands:\n"
 		   "  ping                  Check if blogd is active\n"
 		   "  quit [--wait]         Gracefully terminate blogd\n"
@@ -316,7 +947,22 @@ int main(int argc, char *argv[])
 		   "  deactivate            Disconnect blogd from system console\n"
 		   "  reactivate            Reconnect blogd to system console\n"
 		   "  final                 Rotate boot.log to boot.old\n"
-		   "  help                  Show this help text\n");
+		   "  stats                 Show the counters of blogd\n"
+		   "    --json                One JSON object per sample\n"
+		   "    --watch[=SECS]        Repeat every SECS seconds, default 1\n"
+		   "  trace dump            Dump the trace ring of blogd as text\n"
+		   "    --json                In the Chrome trace or Perfetto JSON format\n"
+		   "  latency               Show the latencies of the blogd event loop\n"
+		   "  log [TEXT...]         Write TEXT or the lines of stdin to the boot log only\n"
+		   "    --tag=STRING          The tag of the lines, default blogctl\n"
+		   "    --priority=LEVEL      Number or name of the level, default notice\n"
+		   "  follow                Stream the console output of blogd to stdout\n"
+		   "  dump                  Show the log of blogd not yet written to disk\n"
+		   "  sync                  Wait until all captured so far is on the disk\n"
+		   "    --timeout=SECS        Give up after SECS seconds, default 20, 0 never\n"
+		   "  help                  Show this help text\n\n"
+		   "With - the commands are read line by line from stdin and sent\n"
+		   "over one connection, lines starting with # are ignored.\n");
 	    answer[0] = '\x6';
 	    goto fail;
 	case '?':
@@ -324,7 +970,10 @@ int main(int argc, char *argv[])
 	    goto fail;
 	}
 
-	if (can_read(fdsock, 1000)) {
+	if (fdsock == session && !do_wait && cmd[0] != MAGIC_CHROOT) {
+	    queue();				/* Answer is read later */
+	    answer[0] = '\x6';
+	} else if (can_read(fdsock, 1000)) {
 	    answer[0] = '\0';
 	    safein(fdsock, &answer[0], sizeof(answer));
 	}
@@ -341,8 +990,88 @@ end_cmd:
     if (argc != 0)
 	printf("Usage: /sbin/blogctl help\n");
 fail:
+    if (fdsock >= 0 && fdsock == session) {
+	switch (cmd[0]) {
+	case MAGIC_CHROOT:			/* blogd may answer later */
+	case MAGIC_ASK_PWD:			/* blogd takes the connection */
+	case MAGIC_QUESTION:
+	    session = -1;
+	    break;
+	default:
+	    fdsock = -1;
+	    break;
+	}
+    }
     if (fdsock >= 0)
 	close(fdsock);
 
     return answer[0] == '\x6' ? 0 : 1;
 }
+
+/*
+ * Split a line of the batch into words, quotes are removed
+ * and the words from a word starting with '#' on are ignored.
+ */
+static int split(char *line, char *av[], int max)
+{
+    char *p = line, *q;
+    int ac = 1;
+
+    while (ac < max) {
+	while (*p == ' ' || *p == '\t' || *p == '\n')
+	    p++;
+	if (!*p || *p == '#')
+	    break;
+	av[ac++] = q = p;
+	while (*p && *p != ' ' && *p != '\t' && *p != '\n') {
+	    if (*p == '"' || *p == '\'') {
+		const char quote = *p++;
+		while (*p && *p != quote)
+		    *q++ = *p++;
+		if (*p)
+		    p++;
+	    } else
+		*q++ = *p++;
+	}
+	if (*p)
+	    p++;
+	*q = '\0';
+    }
+    av[ac] = NULL;
+    return ac;
+}
+
+static int batch(void)
+{
+    char *line = NULL, *av[MAX_ARGS+1];
+    size_t size = 0;
+    int ac;
+
+    batched = 1;
+    av[0] = "blogctl";
+    while (getline(&line, &size, stdin) > 0) {
+	lineno++;
+	if ((ac = split(line, av, MAX_ARGS)) <= 1)
+	    continue;
+	optind = 0;				/* Reset getopt for the new vector */
+	(void)getopt(1, av, "");
+	if (execute(ac, av)) {
+	    warnx("line %u: %s failed", lineno, av[1]);
+	    failed = 1;
+	}
+    }
+    if (session >= 0) {
+	drain();
+	close(session);
+    }
+    free(line);
+
+    return failed;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc == 2 && strcmp(argv[1], "-") == 0)
+	return batch();
+    return execute(argc, argv);
+}
@@ -47,13 +47,15 @@ extern int console_silent;
 extern int coldboot;
 
 static int show_status;
-static const char console[] = "/dev/console";
+static const char *console = "/dev/console";
 static const char *varrun = _PATH_VARRUN;
 
 static void _initialize(void) __attribute__((__constructor__));
 static void _initialize(void)
 {
     char *run;
+    console = sandbox_path(console);
+    varrun = sandbox_path(varrun);
     run = realpath(varrun, NULL);
     if (run && *run)
 	varrun = run;
@@ -77,7 +79,7 @@ __attribute__((noreturn)) void error (const char *fmt, ...)
  */
 static const char *myname;
 static char *pidfile;
-static char *plymouth;
+static const char *plymouth;
 static void rmfpid()
 {
     if (!pidfile || *pidfile == 0)
@@ -106,15 +108,15 @@ static void attribute((noinline)) dopidfile()
     fprintf(fpid, "%d\n", getpid());
     fclose(fpid);
 
-    ret = mkdir("/run/plymouth", 0755);
+    ret = mkdir(sandbox_path("/run/plymouth"), 0755);
     if (ret < 0) {
 	if (errno != EEXIST)
-	    warn("can not make directory /run/plymouth");
+	    warn("can not make directory %s", sandbox_path("/run/plymouth"));
 	else
 	    ret = 0;
     }
     if (ret == 0) {
-	plymouth = "/run/plymouth/pid";
+	plymouth = sandbox_path("/run/plymouth/pid");
 	ret = symlink(pidfile, plymouth);
 	do {
 	    int serr = errno;
@@ -177,6 +179,7 @@ static struct sigaction saved_sigint;
 static struct sigaction saved_sigquit;
 static struct sigaction saved_sigterm;
 static struct sigaction saved_sigsys;
+static struct sigaction saved_sigusr1;
 
 static void sighandle(int sig)
 {
@@ -192,20 +195,86 @@ static void sigsys(int sig)
 {
     nsigsys = (volatile sig_atomic_t)sig;
 }
+
+/*
+ * Report the occupancy of the object pools
+ */
+static void sigusr1(int sig)
+{
+    nsigusr1 = (volatile sig_atomic_t)sig;
+}
 #endif
 
 /*
- * To be able to reconnect to real tty on EIO
+ * To be able to reconnect to real tty on EIO.  The event loop does
+ * not wait on the tty: if it can not be opened yet, the console is
+ * put aside and the open is retried every RECONNECT_RETRY milli
+ * seconds, the output for the console is held meanwhile.
+ */
+#define RECONNECT_RETRY	50
+#define RECONNECT_TRIES	20
+static timeout_t reconnect_timer;
+static fd_set reconnecting;
+static unsigned int reconnect_tries;
+
+static int reopen(struct console *c)
+{
+    int newfd, tflags;
+
+    if ((newfd = open_tty_once(c->tty, O_WRONLY|O_NONBLOCK|O_NOCTTY|O_CLOEXEC)) < 0) {
+	if (errno != EIO || reconnect_tries++ >= RECONNECT_TRIES)
+	    error("can not open %s: %m", c->tty);
+	return -1;
+    }
+    epoll_delete(c->fd);
+    dup2(newfd, c->fd);
+    if (newfd != c->fd)
+	close(newfd);
+    epoll_addwrite(c->fd, &epoll_write_watchdog);
+#if defined(__s390__) || defined(__s390x__)
+    if (major(c->dev) == 4 && minor(c->dev) == 64)
+	return 1;
+#endif
+    if (c->budget)
+	return 1;	/* Budgeted serial lines stay non-blocking */
+    if ((tflags = fcntl(c->fd, F_GETFL)) < 0)
+	warn("can not get terminal flags of %s", c->tty);
+    tflags &= ~(O_NONBLOCK);
+    if (fcntl(c->fd, F_SETFL, tflags) < 0)
+	warn("can not set terminal flags of %s", c->tty);
+    return 1;
+}
+
+static void reconnect_timeout(timeout_t *t)
+{
+    struct console * c;
+    int again = 0;
+
+    list_for_each_entry(c, &lcons, node) {
+	if (c->fd <= 0 || !FD_ISSET(c->fd, &reconnecting))
+	    continue;
+	if (reopen(c) < 0) {
+	    again++;
+	    continue;
+	}
+	FD_CLR(c->fd, &reconnecting);
+    }
+    if (again)
+	timeout_add(t, RECONNECT_RETRY);
+    else
+	reconnect_tries = 0;
+}
+
+/*
+ * Returns 1 if reconnected, -1 if the console waits on the retry
  */
 static int reconnect(int fd)
 {
     struct console * c;
-    int ret = 0, tflags;
+    int ret = 0;
     int olderr = errno;
 
     list_for_each_entry(c, &lcons, node) {
-	int newfd;
-
 	if (!c->tty) continue;
 
 	if (c->fd != fd) continue;
@@ -215,23 +284,15 @@ static int reconnect(int fd)
 	case -1:	/* Weired */
 	    break;
 	default:	/* IO of system consoles */
-	    if ((newfd = open_tty(c->tty, O_WRONLY|O_NONBLOCK|O_NOCTTY|O_CLOEXEC)) < 0)
-		error("can not open %s: %m", c->tty);
-	    epoll_delete(c->fd);
-	    dup2(newfd, c->fd);
-	    if (newfd != c->fd)
-		close(newfd);
-	    epoll_addwrite(c->fd, &epoll_write_watchdog);
-	    ret = 1;
-#if defined(__s390__) || defined(__s390x__)
-	    if (major(c->dev) == 4 && minor(c->dev) == 64)
+	    if (FD_ISSET(c->fd, &reconnecting)) {
+		ret = -1;
 		break;
-#endif
-	    if ((tflags = fcntl(c->fd, F_GETFL)) < 0)
-		warn("can not get terminal flags of %s", c->tty);
-	    tflags &= ~(O_NONBLOCK);
-	    if (fcntl(c->fd, F_SETFL, tflags) < 0)
-		warn("can not set terminal flags of %s", c->tty);
+	    }
+	    if ((ret = reopen(c)) < 0) {
+		epoll_delete(c->fd);		/* No events of the hung up tty */
+		FD_SET(c->fd, &reconnecting);
+		timeout_add(&reconnect_timer, RECONNECT_RETRY);
+	    }
 	    break;
 	}
     }
@@ -269,9 +330,9 @@ int main(int argc, char *argv[])
     if (listen < -1)
 	_exit(EXIT_SUCCESS);
 
-    if (stat("/run/systemd/show-status", &st) == 0)
+    if (stat(sandbox_path("/run/systemd/show-status"), &st) == 0)
 	show_status = 1;
-    if (kill (1, SIGRTMIN+20) < 0)
+    if (sandbox_kill(1, SIGRTMIN+20) < 0)
 	warn("could not tell system to show its status");
 
     arg0 = (volatile char*)argv[0];
@@ -301,6 +362,9 @@ int main(int argc, char *argv[])
 	if (strcmp(val, "1") == 0 || strcasecmp(val, "on") == 0 || strcasecmp(val, "yes") == 0 || strcasecmp(val, "true") == 0)
 	    coldboot = 1;
     }
+    val = value_cmdline("record");
+    if (val)
+	record_open(val);
 
     myname = program_invocation_short_name;
     getconsoles(1);
@@ -323,7 +387,7 @@ int main(int argc, char *argv[])
     dup2(0, 2);
     tty = console;
 
-    (void)ioctl(0, TIOCCONS, NULL);  /* Undo any current map if any */
+    (void)sandbox_tioccons(0);  /* Undo any current map if any */
 
     list_for_each_entry(c, &lcons, node) {
 	speed_t ospeed;
@@ -340,6 +404,7 @@ int main(int argc, char *argv[])
 	}
 	cfsetispeed(&c->otio, ispeed);
 	cfsetospeed(&c->otio, ospeed);
+	console_options(c);
 
 	if (c->flags & CON_CONSDEV) {
 
@@ -401,7 +466,7 @@ int main(int argc, char *argv[])
 	(void)ioctl(pts, TIOCSLCKTRMIOS, &lock);
     }
 
-    if (ioctl(pts, TIOCCONS, NULL) < 0)
+    if (sandbox_tioccons(pts) < 0)
 	error("can not set console device to %s", ptsname);
 
     /*
@@ -416,6 +481,13 @@ int main(int argc, char *argv[])
     } else
 #endif
     {
+	/*
+	 * In the sandbox blogd is the reader of its own pty, a message
+	 * to stderr while the benchmark holds the pty must not block
+	 * blogd.  On a real boot stdout and stderr stay blocking.
+	 */
+	if (sandbox())
+	    (void)fcntl(pts, F_SETFL, fcntl(pts, F_GETFL) | O_NONBLOCK);
 	dup2(pts,  1);
 	dup2(pts,  2);	/* Now we are blind upto safeIO() loop */
     }
@@ -433,10 +505,12 @@ int main(int argc, char *argv[])
     set_signal(SIGQUIT, &saved_sigquit, sighandle);
     set_signal(SIGTERM, &saved_sigterm, sighandle);
     set_signal(SIGSYS,  &saved_sigsys,  sigsys);
+    set_signal(SIGUSR1, &saved_sigusr1, sigusr1);
     (void)restart_sig(SIGINT,  1);
     (void)restart_sig(SIGQUIT, 1);
     (void)restart_sig(SIGTERM, 1);
     (void)restart_sig(SIGSYS,  1);
+    (void)restart_sig(SIGUSR1, 1);
 #endif
 
     list_for_each_entry(c, &lcons, node) {
@@ -601,6 +675,7 @@ int main(int argc, char *argv[])
 
     atexit(flush_handler);	/* Register flush exit handler */
 
+    timeout_init(&reconnect_timer, &reconnect_timeout);
     prepareIO(reconnect, listen, 0);
 
     if (pipefd[1] >= 0)
@@ -624,7 +699,7 @@ static void exit_handler (void)
     struct console *c;
     int fd;
 
-    if (show_status == 0 && kill (1, SIGRTMIN+20) < 0)
+    if (show_status == 0 && sandbox_kill(1, SIGRTMIN+20) < 0)
 	warn("could not tell system to hode its status");
 
     list_for_each_entry(c, &lcons, node) {
@@ -648,7 +723,7 @@ static void exit_handler (void)
 	flags &= ~O_NONBLOCK;
 	fcntl(fd, F_SETFL, flags);
 
-	(void)ioctl(fd, TIOCCONS, NULL);	/* Restore old console mapping */
+	(void)sandbox_tioccons(fd);	/* Restore old console mapping */
 	if (fd > 0)
 	    close(fd);
     }
@@ -668,6 +743,7 @@ static void exit_handler (void)
     reset_signal(SIGQUIT, &saved_sigquit);
     reset_signal(SIGTERM, &saved_sigterm);
     reset_signal(SIGSYS,  &saved_sigsys);
+    reset_signal(SIGUSR1, &saved_sigusr1);
 #endif
 }
 
@@ -12,24 +12,25 @@
 #include <unistd.h>
 #include "libconsole.h"
 
-void new_root(const char *root)
+/*
+ * Change root, if the new root is not yet available return -1 with
+ * errno set to ENOENT or EIO, the caller may retry later.
+ */
+int new_root(const char *root)
 {
-    int ret, c = 0;
-    do {
-	if (c++ > 20) {
-	    error("can change to working directory %s", root);
-	    return;
-	}
-	ret = chdir(root);
-	if (ret < 0 && errno != ENOENT && errno != EIO)
-	    error("can change to working directory %s", root);
-	usleep(50000);
+    int ret;
 
-    } while (errno == ENOENT || errno == EIO);
+    ret = chdir(root);
+    if (ret < 0) {
+	if (errno == ENOENT || errno == EIO)
+	    return -1;
+	error("can change to working directory %s", root);
+    }
     ret = chroot(".");
     if (ret < 0)
 	error("can change root directory");
     ret = chdir("/");
     if (ret < 0)
 	error("can change to working directory /");
+    return 0;
 }
@@ -35,8 +35,10 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/syscall.h>
 #include <sys/sysmacros.h>
+#include <sys/timerfd.h>
 #include <sys/vfs.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -95,11 +97,6 @@ static inline int pidfd_open(pid_t pid, unsigned int flags)
 volatile sig_atomic_t asking;
 static int ask_mode = 1;	/* 1 = Password, 2 = Question */
 
-/*
- * Ths is the socket fd for the answer.
- */
-static int pwd_client_fd = -1;
-
 /*
  * One of the device for console are blocked if true.
  */
@@ -223,7 +220,44 @@ static char *password;
 static int32_t *pwsize;
 
 /*
- * Arg used: safe out
+ * Counters of blogd answered on MAGIC_STATS, the per console
+ * counters are part of struct console, those of the log in log.c
+ */
+static struct {
+    uint64_t pty, fifo;		/* Bytes read */
+    uint64_t waits;		/* Rounds of epoll_pwait(2) */
+    uint64_t held, lost;	/* Bytes held back for blocked consoles or password prompts */
+    uint64_t prompts, answered, canceled;
+    uint64_t merged, cached;	/* Password requests without an own prompt */
+    uint64_t pwstart, pwlast, pwmax, pwtotal;	/* Nano seconds of password prompts */
+    uint64_t sessions, requests;	/* Control connections kept open and their requests */
+    uint64_t dumps;			/* Snapshots of the log ring */
+} stats;
+
+/*
+ * Wait on epoll for a blocked console and remember since when,
+ * other file descriptors are not held
+ */
+static void console_block(int fd)
+{
+    struct console *c;
+
+    list_for_each_entry(c, &lcons, node) {
+	if (c->fd != fd)
+	    continue;
+	if (!FD_ISSET(fd, &blocked))
+	    trace(TRACE_BLOCKED, fd, 0, 0);
+	FD_SET(fd, &blocked);
+	epoll_reenable(fd);
+	if (!c->since)
+	    c->since = latency_now();
+	break;
+    }
+}
+
+/*
+ * Arg used: safe out.  The reconnect on EIO returns 1 if the tty is
+ * open again, -1 if it is retried later, and 0 on failure.
  */
 static int (*vc_reconnect)(int fd);
 void safeout (int fd, const void *ptr, size_t s, ssize_t max)
@@ -248,20 +282,18 @@ void safeout (int fd, const void *ptr, size_t s, ssize_t max)
 		continue;
 	    }
 	    if (errno == EAGAIN || errno == EWOULDBLOCK) {
-
-		/* Avoid high load: wait upto 100 milli seconds if system is not ready */
-		if (can_write(fd, 100))
-		    continue;
-
-		FD_SET(fd, &blocked);
-		epoll_reenable(fd);
+		console_block(fd);	/* Never wait within the event loop */
 		break;			/* Drop the rest of the message */
 	    }
 	    if (errno == EIO) {
-		if (!vc_reconnect)
-		    lerror("can not write to fd %d", fd);
-		if (!(*vc_reconnect)(fd))
+		const int ret = vc_reconnect ? (*vc_reconnect)(fd) : 0;
+
+		if (!ret)
 		    lerror("can not write to fd %d", fd);
+		if (ret < 0) {
+		    console_block(fd);
+		    break;		/* Drop the rest of the message */
+		}
 		errno = 0;
 		continue;
 	    }
@@ -289,27 +321,32 @@ static ssize_t copyout (int fd, const void *ptr, size_t s, ssize_t max)
 		continue;
 	    }
 	    if (errno == EAGAIN || errno == EWOULDBLOCK) {
-		FD_SET(fd, &blocked);
-		epoll_reenable(fd);
+		trace(TRACE_EAGAIN, fd, s, 0);
+		console_block(fd);
 		if (r == 0)
 		    r = -1;
 		break;
 	    }
 	    if (errno == EIO) {
-		if (!vc_reconnect) {
-		    warn("can not write to fd %d", fd);
-		    break;
+		const int ret = vc_reconnect ? (*vc_reconnect)(fd) : 0;
+
+		if (ret > 0) {
+		    errno = 0;
+		    continue;
 		}
-		if (!(*vc_reconnect)(fd)) {
-		    warn("can not write to fd %d", fd);
+		if (ret < 0) {			/* Held until the tty is open again */
+		    console_block(fd);
+		    if (r == 0)
+			r = -1;
 		    break;
 		}
-		errno = 0;
-		continue;
+		warn("can not write to fd %d", fd);
+		break;
 	    }
 	    warn("can not write to fd %d", fd);
 	    break;
 	}
+	trace(TRACE_WRITE, fd, p, 0);
 	ptr += p;
 	s -= p;
 	r += p;
@@ -319,134 +356,393 @@ static ssize_t copyout (int fd, const void *ptr, size_t s, ssize_t max)
     return r;
 }
 
-#if defined(__s390__) || defined(__s390x__)
-static ssize_t copyout3215 (int fd, const void *ptr, size_t cnt, ssize_t max)
+/*
+ * Gather write out, used by the line wrap filter.  Like copyout()
+ * a single write(2) takes at most max bytes.
+ */
+static ssize_t copyoutv (int fd, struct iovec *iov, int cnt, ssize_t max)
 {
-    /*
-     * Workaround for s390x console mode 3215:
-     * 1. 3215 can not handle carriage return (\r). Instead of just dropping it,
-     * we translate it to a newline (\n) if the line is not empty, to simulate
-     * overwriting without concatenating strings indefinitely.
-     * 2. Be sure that there is a \n after 130 chars to flush the device 3215 driver.
-     */
-    const char *conbuf = (const char *)ptr;
-    /*
-     * Missing: detect lines across chunks
-     */
-    size_t line_start = 0;
-    size_t i = 0;
-    ssize_t ret, total_written = 0;
-    static int skip_next_lf = 0;	/* It remembers \r\n across chunk boundaries. */
-
-    while (i < cnt) {
-	size_t current_line_len;
-	char linebuf[132];		/* For atomar write: 130 char max + \n + rest */
-
-	/* 0. Catch CRLF across chunks */
-	if (skip_next_lf && conbuf[i] == '\n') {
-	    skip_next_lf = 0;
-	    line_start = i+1;
-	    i++;
-	    continue;
-	}
-	skip_next_lf = 0;
-
-	current_line_len = i - line_start;
-
-	/* 1. Search for end of line (could be \n, \r or 130 char limit reached) */
-	if (conbuf[i] == '\n' || conbuf[i] == '\r') {
-	    if (current_line_len > 0) {
-		memcpy(linebuf, &conbuf[line_start], current_line_len);
-		linebuf[current_line_len] = '\n';
+    int saveerr = errno;
+    ssize_t r = 0, p;
 
-		ret = copyout(fd, linebuf, current_line_len + 1, max);
-		if (ret < 0)
-		    goto error;
-		total_written += ret;
-	    } else if (conbuf[i] == '\n') {
-		/*
-		 * Only create a blank line with a true \n!
-		 * An isolated \r at the beginning of a line will be silently ignored.
-		 */
-		ret = copyout(fd, "\n", 1, max);
-		if (ret < 0)
-		    goto error;
-		total_written += ret;
+    if (max < 1)
+	max = 1;
+    while (cnt > 0) {
+	size_t sum = 0, full = iov->iov_len;
+	int n;
+
+	for (n = 0; n < cnt && sum + iov[n].iov_len <= (size_t)max; n++)
+	    sum += iov[n].iov_len;
+	if (n == 0) {			/* The first one alone is too long */
+	    iov->iov_len = (size_t)max;
+	    n = 1;
+	}
+	p = writev (fd, iov, n);
+	iov->iov_len = full;
+	if (p < 0) {
+	    if (errno == EINTR) {
+		errno = 0;
+		continue;
 	    }
+	    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+		trace(TRACE_EAGAIN, fd, iov->iov_len, 0);
+		console_block(fd);
+		if (r == 0)
+		    r = -1;
+		break;
+	    }
+	    if (errno == EIO) {
+		const int ret = vc_reconnect ? (*vc_reconnect)(fd) : 0;
 
-	    if (conbuf[i] == '\r') {
-		if ((i+1 < cnt) && conbuf[i+1] == '\n') {
-		    i++;		/* Ignore CRLF in the same chunk */
-		} else if (i+1 == cnt) {
-		    skip_next_lf = 1;	/* Set marker for the next chunk at 0. */
+		if (ret > 0) {
+		    errno = 0;
+		    continue;
+		}
+		if (ret < 0) {			/* Held until the tty is open again */
+		    console_block(fd);
+		    if (r == 0)
+			r = -1;
+		    break;
 		}
 	    }
-
-	    line_start = i+1;
-	    i = line_start;
-	    continue;
+	    warn("can not write to fd %d", fd);
+	    break;
+	}
+	trace(TRACE_WRITE, fd, p, 0);
+	r += p;
+	while (cnt > 0 && (size_t)p >= iov->iov_len) {
+	    p -= iov->iov_len;
+	    iov++;
+	    cnt--;
 	}
+	if (cnt > 0) {
+	    iov->iov_base += p;
+	    iov->iov_len -= p;
+	}
+    }
+
+    errno = saveerr;
+    return r;
+}
+
+/*
+ * Serial lines are slow, at 9600 baud a flood of messages is shown
+ * minutes late or blocks us.  Therefore a serial line gets a budget
+ * of SERIAL_BUDGET_MS of line time.  What does not fit into the output
+ * queue of the line is held back, and if the output queue and backlog
+ * together exceed the budget the oldest whole lines of the backlog are
+ * dropped and replaced by a marker.  The log file is not affected.
+ */
+#ifndef SERIAL_BUDGET_MS
+# define SERIAL_BUDGET_MS	1000
+#endif
+#define SERIAL_MARKER		"[... %u lines skipped on this console ...]\n"
 
-	/* 2. Ouch: Reached 130 without any newline */
-	if (current_line_len >= 130) {
-	    /* Are there any spaces in the last 130 characters? */
-	    size_t last_space = i;
-	    int found_space = 0;
+static void serial_budget(struct console *c)
+{
+    unsigned int baud = c->baud ? c->baud : tty_baudrate(cfgetospeed(&c->otio));
+    int tflags;
+
+    if (!baud)
+	return;
+    c->budget = (size_t)baud / 10 * SERIAL_BUDGET_MS / 1000;	/* 8N1: 10 bits per byte */
+    if (c->budget < _POSIX_MAX_CANON)
+	c->budget = _POSIX_MAX_CANON;
+    if (!(c->back = malloc(c->budget)))
+	error("can not allocate backlog for %s", c->tty);
+    c->blen = 0;
+
+    if ((tflags = fcntl(c->fd, F_GETFL)) < 0 || fcntl(c->fd, F_SETFL, tflags|O_NONBLOCK) < 0)
+	warn("can not set terminal flags of %s", c->tty);
+}
 
-	    for (size_t s = i; s > line_start; s--) {
-		if (conbuf[s] == ' ') {
-		    last_space = s;
-		    found_space = 1;
+/*
+ * Append to the backlog, if the budget is exceeded drop whole lines
+ * from the head of backlog and input until the remainder fits.
+ */
+static void backlog_add(struct console *c, const char *ptr, size_t len)
+{
+    size_t limit = 0, excess, drop;
+    int queued;
+
+    if (ioctl(c->fd, TIOCOUTQ, &queued) < 0 || queued < 0)
+	queued = 0;
+    if ((size_t)queued < c->budget)
+	limit = c->budget - (size_t)queued;
+
+    if (c->blen + len > limit) {
+	const char *nl;
+
+	excess = c->blen + len - limit;
+	drop = 0;
+	while (drop < c->blen) {
+	    nl = memchr(&c->back[drop], '\n', c->blen - drop);
+	    drop = nl ? (size_t)(nl - c->back) + 1 : c->blen;
+	    c->skipped++;
+	    if (drop >= excess)
+		break;
+	}
+	if (drop < excess) {
+	    int partial = (c->blen && c->back[c->blen-1] != '\n');
+	    size_t off = 0;
+
+	    excess -= c->blen;
+	    while (off < len) {
+		nl = memchr(&ptr[off], '\n', len - off);
+		off = nl ? (size_t)(nl - ptr) + 1 : len;
+		if (!partial)
+		    c->skipped++;		/* Not the rest of the last line of the backlog */
+		partial = 0;
+		if (off >= excess)
 		    break;
-		}
 	    }
+	    ptr += off;
+	    len -= off;
+	    c->dropped += off;
+	    drop = c->blen;
+	}
+	c->dropped += drop;
+	c->blen -= drop;
+	if (c->blen)
+	    memmove(c->back, &c->back[drop], c->blen);
+    }
 
-	    if (found_space) {
-		/* Copy up to the spaces */
-		size_t write_len = last_space - line_start;
-		memcpy(linebuf, &conbuf[line_start], write_len);
-		linebuf[write_len] = '\n';
+    if (len) {
+	memcpy(&c->back[c->blen], ptr, len);
+	c->blen += len;
+    }
+}
 
-		ret = copyout(fd, &conbuf[line_start], write_len + 1, max);
-		if (ret < 0)
-		    goto error;
-		total_written += ret;
+/*
+ * Write out the marker and the backlog as far as the line accepts it,
+ * the rest of a marker is kept like the backlog
+ */
+static void backlog_flush(struct console *c)
+{
+    ssize_t p;
 
-		line_start = last_space + 1; /* continue after the space */
-	    } else {
-		/* No space found -> hard newline at 130 chars */
-		memcpy(linebuf, &conbuf[line_start], 130);
-		linebuf[130] = '\n';
+    if (c->skipped && !c->mlen) {
+	char *m = c->mark;
+
+	if (c->midline)
+	    *m++ = '\n';
+	snprintf(m, sizeof(c->mark) - (m - c->mark), SERIAL_MARKER, c->skipped);
+	c->mlen = strlen(c->mark);
+	c->skipped = 0;
+	c->midline = 0;
+    }
 
-		ret = copyout(fd, &conbuf[line_start], 130 + 1, max);
+    while (c->mlen > 0) {
+	p = write(c->fd, c->mark, c->mlen);
+	if (p < 0) {
+	    if (errno == EINTR)
+		continue;
+	    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+		trace(TRACE_EAGAIN, c->fd, c->mlen, 0);
+		epoll_reenable(c->fd);
+		return;
+	    }
+	    if (errno == EIO) {
+		const int ret = vc_reconnect ? (*vc_reconnect)(c->fd) : 0;
+
+		if (ret > 0)
+		    continue;
 		if (ret < 0)
-		    goto error;
-		total_written += ret;
+		    return;		/* Kept until the tty is open again */
+	    }
+	    warn("can not write to fd %d", c->fd);
+	    c->mlen = c->blen = 0;
+	    return;
+	}
+	trace(TRACE_WRITE, c->fd, p, 0);
+	c->mlen -= p;
+	if (c->mlen)
+	    memmove(c->mark, &c->mark[p], c->mlen);
+    }
+
+    while (c->blen > 0) {
+	p = write(c->fd, c->back, c->blen);
+	if (p < 0) {
+	    if (errno == EINTR)
+		continue;
+	    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+		trace(TRACE_EAGAIN, c->fd, c->blen, 0);
+		epoll_reenable(c->fd);
+		break;
+	    }
+	    if (errno == EIO) {
+		const int ret = vc_reconnect ? (*vc_reconnect)(c->fd) : 0;
 
-		line_start = line_start + 130;
+		if (ret > 0)
+		    continue;
+		if (ret < 0)
+		    break;		/* Kept until the tty is open again */
 	    }
-	    i = line_start;
-	    continue;
+	    warn("can not write to fd %d", c->fd);
+	    c->blen = 0;
+	    break;
 	}
-	i++;
+	trace(TRACE_WRITE, c->fd, p, 0);
+	c->midline = (c->back[p-1] != '\n');
+	c->written += p;
+	c->blen -= p;
+	if (c->blen)
+	    memmove(c->back, &c->back[p], c->blen);
     }
+}
 
-    /* 3. final write out the rest */
-    if (line_start < cnt) {
-	ret = copyout(fd, &conbuf[line_start], cnt - line_start, max);
-	if (ret < 0)
-	    goto error;
-	total_written += ret;
+/*
+ * At the end the lines get together the time of two budgets to take
+ * their backlog, what is left at the given end is counted as dropped
+ */
+static void backlog_close(struct console *c, const uint64_t end)
+{
+    while (c->blen || c->skipped || c->mlen) {
+	uint64_t now;
+	time_t wait;
+
+	backlog_flush(c);
+	if (!c->blen && !c->skipped && !c->mlen)
+	    break;
+	if ((now = latency_now()) >= end)
+	    break;
+	wait = (time_t)((end - now + 999999ULL) / 1000000ULL);
+	if (!can_write(c->fd, wait))
+	    break;
     }
+    c->dropped += c->blen;
+    c->blen = c->mlen = 0;
+}
+
+/*
+ * The start of a line held back by the priority filter is decided
+ * and written if no more input has completed it within PRIO_HOLD
+ */
+#define PRIO_HOLD		250
+static timeout_t prio_timer;
+static ssize_t consput(struct console *c, const void *ptr, size_t len, const size_t olen);
 
-    if (total_written != cnt)	/* We might not return more or less then we got from the outer ringbuffer */
-	total_written = cnt;
+static void prio_flush(struct console *c)
+{
+    char *out = filter_buffer(c, sizeof(c->head));
+    filter_state_t st;
+    size_t len;
 
-    return total_written;
-error:
-    return -1;
+    filter_save(c, &st);
+    len = filter_prio_flush(c, out);
+    if (len && consput(c, out, len, len) < 1) {
+	filter_restore(c, &st);		/* Tried again on the next timeout */
+	if (!prio_timer.pending)
+	    timeout_add(&prio_timer, PRIO_HOLD);
+    }
+}
+
+static void prio_timeout(timeout_t *t)
+{
+    struct console *c;
+
+    list_for_each_entry(c, &lcons, node) {
+	if (c->fd < 0 || !c->hlen)
+	    continue;
+	if (asking || FD_ISSET(c->fd, &blocked)) {
+	    timeout_add(t, PRIO_HOLD);	/* Output is held back anyway */
+	    continue;
+	}
+	prio_flush(c);
+    }
+}
+
+/*
+ * Write to a console through its output filter,
+ * on a budgeted serial line we never block
+ */
+static ssize_t consout(struct console *c, const void *ptr, size_t len)
+{
+    const size_t olen = len;
+
+    if (c->filter != FILTER_RAW || c->prio < PRIO_ALL) {
+	char *out = filter_buffer(c, len + sizeof(c->seq) + sizeof(c->head));
+	filter_state_t st;
+	ssize_t ret;
+
+	filter_save(c, &st);
+	if (c->filter != FILTER_RAW)
+	    len = filter_ansi(c, ptr, len, out);
+	else
+	    memcpy(out, ptr, len);
+	if (c->prio < PRIO_ALL) {
+	    len = filter_prio(c, out, len);
+	    if (c->hlen && !prio_timer.pending)
+		timeout_add(&prio_timer, PRIO_HOLD);
+	}
+	if ((ret = consput(c, out, len, olen)) < 1)
+	    filter_restore(c, &st);	/* The input is held and comes again */
+	return ret;
+    }
+    return consput(c, ptr, len, olen);
+}
+
+/*
+ * Write the filtered output of olen bytes of input to a console
+ */
+static ssize_t consput(struct console *c, const void *ptr, size_t len, const size_t olen)
+{
+    if (c->wrap) {
+	struct iovec iov[WRAP_IOV];
+	int first = 1;
+
+	while (len > 0) {
+	    const size_t col = c->col;
+	    const int skiplf = c->skiplf;
+	    int n = filter_wrap(c, (const char**)&ptr, &len, iov, WRAP_IOV);
+
+	    if (c->budget) {
+		int i;
+		for (i = 0; i < n; i++)
+		    backlog_add(c, iov[i].iov_base, iov[i].iov_len);
+	    } else {
+		ssize_t ret, want = 0;
+		int i;
+		for (i = 0; i < n; i++)
+		    want += iov[i].iov_len;
+		ret = copyoutv(c->fd, iov, n, c->max_canon);
+		if (ret <= 0 && want && first) {
+		    c->col = col;		/* Nothing written, the caller holds all */
+		    c->skiplf = skiplf;
+		    return -1;
+		}
+		if (ret < 0)
+		    ret = 0;
+		c->written += ret;
+		c->dropped += want - ret;
+		if (ret < want) {		/* Blocked, the rest is consumed as dropped */
+		    c->dropped += len;
+		    len = 0;
+		}
+	    }
+	    first = 0;
+	}
+	if (c->budget)
+	    backlog_flush(c);
+	return olen;
+    }
+    if (!c->budget) {
+	ssize_t ret;
+	if (!len)
+	    return olen;
+	ret = c->out(c->fd, ptr, len, c->max_canon);
+	if (PROBE_ENABLED(console_write))
+	    PROBE3(console_write, c->fd, len, ret);
+	if (ret > 0) {
+	    c->written += ret;
+	    c->dropped += len - ret;
+	}
+	return (ret < 1 || len == olen) ? ret : (ssize_t)olen;
+    }
+    backlog_add(c, ptr, len);
+    backlog_flush(c);
+    return olen;
 }
-#endif
 
 /*
  * Twice used: safe in
@@ -523,6 +819,16 @@ out:
 volatile sig_atomic_t nsigsys;
 volatile sig_atomic_t nsigio = -1;
 
+/*
+ * Window size of the system console has to be checked
+ */
+volatile sig_atomic_t nsigwinch;
+
+/*
+ * Report the occupancy of the object pools
+ */
+volatile sig_atomic_t nsigusr1;
+
 #ifdef NO_SIGNALFD
 /* One shot signal handler */
 static void sigio(int sig)
@@ -535,9 +841,47 @@ static void sigio(int sig)
 #endif
 
 /*
- * Our transfer buffer from system console to the devices
+ * Our transfer buffer from system console to the devices, this
+ * one grows with the bytes read from the fifo in one round up to
+ * TRANS_BUFFER_MAX and shrinks back if the rounds become small
+ * again.  A read of the pty master never returns more than the
+ * tty layer holds, that is less than 4 kB, hence a larger buffer
+ * does not help there and the pty rounds are not taken account.
  */
-static char trans[TRANS_BUFFER_SIZE];
+#ifndef  TRANS_BUFFER_MAX
+# define TRANS_BUFFER_MAX	(64*TRANS_BUFFER_SIZE)
+#endif
+#define TRANS_SHRINK		16	/* Small rounds in a row before shrinking */
+static char  *trans;
+static size_t trans_size;
+
+static void trans_adapt(const size_t total)
+{
+    static int small;
+    size_t size = trans_size;
+    char *tmp;
+
+    if (total > trans_size) {		/* More than one full read */
+	small = 0;
+	if (trans_size < TRANS_BUFFER_MAX)
+	    size = trans_size << 1;
+    } else if (total < (trans_size >> 2) && trans_size > TRANS_BUFFER_SIZE) {
+	if (++small >= TRANS_SHRINK) {
+	    small = 0;
+	    size = trans_size >> 1;
+	}
+    } else
+	small = 0;
+
+    if (size == trans_size)
+	return;
+
+    tmp = realloc(trans, size);
+    if (!tmp)
+	return;				/* Keep the old one */
+    trans = tmp;
+    trans_size = size;
+}
 
 /*
  * Our temporary buffer during asking a password/passphrase
@@ -556,34 +900,215 @@ static void ask_for_password(void) attribute((noinline));
 
 static int coldstart_active;
 static int coldstart_triggered;
-static char *coldstart_socket_path = NULL;
 
-static void coldstart_next(void)
-{
-    char *msg = NULL;
-    char *sock = NULL;
+/*
+ * The queue of the password and question requests of the clients on
+ * the control socket and of the ask files of systemd found at cold
+ * start.  Requests with the same prompt and mode are merged, the answer
+ * of the user is sent to all requesters of the prompt.  Only the head
+ * of the queue is prompted on the consoles, the next one follows as
+ * soon as the head is answered or canceled.
+ */
+struct session_s;
+typedef struct pwwaiter_s {
+    list_t node;
+    int fd;			/* Connection on the control socket or -1 */
+    struct session_s *session;	/* The session resumed after the answer or NULL */
+    char *socket;		/* Socket of an ask file of systemd or NULL */
+} pwwaiter_t;
+typedef struct pwreq_s {
+    list_t node;
+    list_t waiters;
+    int mode;			/* 1 = Password, 2 = Question */
+    char *prompt;
+} pwreq_t;
+static list_t pwqueue = { &pwqueue, &pwqueue };
 
-    if (!coldstart_pop_request(&msg, &sock)) {
-	coldstart_active = 0;
-	return;
-    }
+/*
+ * A requester on the control socket gets the password already entered
+ * once before it is prompted, e.g. for several disks with the same
+ * passphrase.  This is done once per prompt, if the same prompt is
+ * asked again the password was the wrong one, even if a new process
+ * asks, as a keyscript does for each try.
+ */
+#define PWTRIED		64
+static char *pwtried[PWTRIED];
+static unsigned int npwtried;
+static int pwvalid;			/* The buffer holds a password */
 
-    coldstart_socket_path = sock;
-    
-    if (pwprompt)
-	free(pwprompt);
-    pwprompt = msg;
-    
+static void epoll_pwd_waiter(int fd);
+static void pwreq_next(void);
+static void session_resume(struct session_s *s);
+static void session_close(struct session_s *s);
+
+static void password_buffer(void)
+{
     if (!password) {
 	void *tmp = shm_malloc(MAX_PASSLEN + sizeof(int32_t));
 	if (!tmp)
 	    error("can not allocate string for password");
 	password = (char *)tmp;
 	pwsize = (int32_t *)(tmp + MAX_PASSLEN);
+	*pwsize = 0;
     }
-    password[0] = '\0';
+}
 
-    ask_for_password();
+static size_t pwd_prompt(const char **prompt, int mode)
+{
+    size_t len;
+
+    if (!*prompt || !**prompt)
+	*prompt = (mode == 2) ? "Question" : "Password";
+    len = strlen(*prompt);
+    while (len > 1 && ((*prompt)[len-1] == ' ' || (*prompt)[len-1] == ':'))
+	len--;				/* Trimmed as on the consoles */
+    return len;
+}
+
+static void pwd_forget(void)
+{
+    unsigned int n;
+
+    for (n = 0; n < PWTRIED && n < npwtried; n++) {
+	free(pwtried[n]);
+	pwtried[n] = NULL;
+    }
+    npwtried = 0;
+}
+
+static void pwd_tried(const char *prompt, size_t len)
+{
+    char **slot = &pwtried[npwtried++ % PWTRIED];
+
+    if (*slot)
+	free(*slot);
+    if (!(*slot = strndup(prompt, len)))
+	error("can not allocate password request");
+}
+
+/*
+ * Returns 1 if the password entered before is the answer for the
+ * prompt, which is then marked as tried
+ */
+static int pwd_cached(const char *prompt)
+{
+    unsigned int n;
+    size_t len;
+
+    if (!pwvalid || !pwsize || *pwsize <= 0)
+	return 0;
+    len = pwd_prompt(&prompt, 1);
+    for (n = 0; n < PWTRIED && n < npwtried; n++) {
+	if (strlen(pwtried[n]) == len && strncmp(pwtried[n], prompt, len) == 0)
+	    return 0;
+    }
+    pwd_tried(prompt, len);
+    return 1;
+}
+
+static void pwreq_add(int mode, const char *prompt, int fd, char *socket)
+{
+    pwwaiter_t *w;
+    pwreq_t *r;
+    size_t len;
+
+    len = pwd_prompt(&prompt, mode);
+
+    list_for_each_entry(r, &pwqueue, node) {
+	if (r->mode == mode && strlen(r->prompt) == len && strncmp(r->prompt, prompt, len) == 0)
+	    break;
+    }
+    if (&r->node == &pwqueue) {
+	if (!(r = calloc(1, sizeof(pwreq_t))) || !(r->prompt = strndup(prompt, len)))
+	    error("can not allocate password request");
+	r->mode = mode;
+	initial(&r->waiters);
+	insert(&r->node, pwqueue.prev);
+    } else
+	stats.merged++;
+
+    if (!(w = calloc(1, sizeof(pwwaiter_t))))
+	error("can not allocate password request");
+    w->fd = fd;
+    w->socket = socket;
+    insert(&w->node, r->waiters.prev);
+    if (fd >= 0)
+	epoll_addhangup(fd, &epoll_pwd_waiter);
+}
+
+/*
+ * The password request came within a session, the requests following
+ * it are answered after the password
+ */
+static void pwwaiter_session(int fd, struct session_s *s)
+{
+    pwwaiter_t *w;
+    pwreq_t *r;
+
+    list_for_each_entry(r, &pwqueue, node) {
+	list_for_each_entry(w, &r->waiters, node) {
+	    if (w->fd == fd) {
+		w->session = s;
+		return;
+	    }
+	}
+    }
+}
+
+static void pwwaiter_free(pwwaiter_t *w)
+{
+    if (w->session)
+	session_resume(w->session);
+    else if (w->fd >= 0) {
+	epoll_delete(w->fd);
+	close(w->fd);
+    }
+    if (w->socket)
+	free(w->socket);
+    delete(&w->node);
+    free(w);
+}
+
+static void pwreq_free(pwreq_t *r)
+{
+    pwwaiter_t *w, *n;
+
+    list_for_each_entry_safe(w, n, &r->waiters, node)
+	pwwaiter_free(w);
+    delete(&r->node);
+    free(r->prompt);
+    free(r);
+}
+
+/*
+ * The client of a queued request has hung up, a request without
+ * requesters is dropped unless it is prompted already.  Only the
+ * hangup is watched, data sent after the request is left in the
+ * socket for the session.
+ */
+static void epoll_pwd_waiter(int fd)
+{
+    pwreq_t *r, *rn;
+
+    list_for_each_entry_safe(r, rn, &pwqueue, node) {
+	pwwaiter_t *w, *wn;
+
+	list_for_each_entry_safe(w, wn, &r->waiters, node) {
+	    if (w->fd != fd)
+		continue;
+	    if (w->session) {
+		session_close(w->session);
+		w->session = NULL;
+		w->fd = -1;
+	    }
+	    pwwaiter_free(w);
+	    if (list_empty(&r->waiters) && !(asking && r->node.prev == &pwqueue))
+		pwreq_free(r);
+	    return;
+	}
+    }
+    epoll_delete(fd);
+    close(fd);
 }
 
 /*
@@ -593,7 +1118,83 @@ static const char *fifo_name = _PATH_BLOG_FIFO;
 static void epoll_console_in(int) attribute((noinline));
 static void epoll_fifo_in(int) attribute((noinline));
 static void epoll_socket_accept(int) attribute((noinline));
+static void winsize_sync(void);
+static void winsize_timeout(timeout_t *t);
+static void housekeeping_timeout(timeout_t *t);
+static void logsync_timeout(timeout_t *t);
+static void pause_timeout(timeout_t *t);
 void epoll_write_watchdog(int) attribute((noinline));
+static int more_input(int timeout, const int noerr);
+static void socket_handler(int fd) attribute((noinline));
+static void epoll_session_in(int fd) attribute((noinline));
+static void epoll_log_synced(int fd);
+static void epoll_dump_out(int fd);
+static void epoll_socket_answer(int fd);
+static void epoll_pwd_done(int fd) attribute((noinline));
+
+/*
+ * Low frequency check of the window size of the system console,
+ * as we are not the session leader of any real console device
+ * we are not signaled by the kernel on changes.
+ */
+#define WINSIZE_INTERVAL	2000
+static timeout_t winsize_timer;
+
+/*
+ * Even without any event the main loop is woken up from time to time
+ */
+#define HOUSEKEEPING		5000
+static timeout_t housekeeping;
+
+/*
+ * The pty is not read for a while if the input would be lost otherwise,
+ * its writers are then throttled by the kernel.  Tried again after
+ * PAUSE_RETRY milli seconds, see input_paused()
+ */
+#define PAUSE_RETRY		5
+static timeout_t pause_timer;
+
+/*
+ * Pool for the messages of the control connections, a message
+ * has at most 255 bytes as its length is sent as unsigned char.
+ * Only the payload of an extended frame may be larger.
+ */
+#ifndef SLAB_MESSAGES
+# define SLAB_MESSAGES	16
+#endif
+#define MESSAGE_SIZE	(UCHAR_MAX+1)
+static slab_t message_slab;
+
+/*
+ * Pool of the control connections kept open by MAGIC_SESSION
+ */
+#ifndef SLAB_SESSIONS
+# define SLAB_SESSIONS	8
+#endif
+#define SESSION_SIZE	(4*(3+UCHAR_MAX))
+#define SESSION_IDLE	60000
+#define FRAME_TIMEOUT	1000
+typedef struct session_s {
+    list_t node;
+    timeout_t idle;
+    int fd;
+    pid_t pid;
+    size_t fill, size;
+    uint64_t pos, errors;	/* Log position to be on the disk before the answer */
+    int once;			/* The connection ends with the answer of its request */
+    unsigned char *buf;		/* The base or a large frame on the heap */
+    unsigned char base[SESSION_SIZE];
+} session_t;
+
+/*
+ * Retry of the check on sessions waiting on their log lines, in
+ * case the sync of the log thread has missed the wake up
+ */
+#define LOGSYNC_RETRY	200
+static timeout_t logsync_timer;
+static int logsync_fd = -1;
+static list_t sessions = { &sessions, &sessions };
+static slab_t session_slab;
 
 void prepareIO(int (*rfunc)(int), const int listen, const int input)
 {
@@ -608,6 +1209,8 @@ void prepareIO(int (*rfunc)(int), const int listen, const int input)
     sigaddset(&sfd_mask, SIGSYS);
     sigaddset(&sfd_mask, SIGIO);
     sigaddset(&sfd_mask, SIGCHLD);
+    sigaddset(&sfd_mask, SIGWINCH);
+    sigaddset(&sfd_mask, SIGUSR1);
 #endif
 
     epfd = epoll_create1(EPOLL_CLOEXEC);
@@ -625,14 +1228,24 @@ void prepareIO(int (*rfunc)(int), const int listen, const int input)
     (void)sigdelset(&omask, SIGTERM);
     (void)sigdelset(&omask, SIGSYS);
     (void)sigdelset(&omask, SIGIO);
+    (void)sigdelset(&omask, SIGUSR1);
 #endif
     vc_reconnect = rfunc;
     fdsock  = listen;			/* We use only ONE socket ... see also safeout() */
     fdread  = input;
 
+    slab_init(&message_slab, "message", MESSAGE_SIZE, SLAB_MESSAGES);
+    slab_init(&session_slab, "session", sizeof(session_t), SLAB_SESSIONS);
+    timeout_init(&logsync_timer, &logsync_timeout);
+
+    trans_size = TRANS_BUFFER_SIZE;
+    trans = malloc(trans_size);
+    if (!trans)
+	error("can not allocate transfer buffer");
+
 #if !defined(__s390__) && !defined(__s390x__)
     if (vt_supported()) {
-	active_vt_fd = open("/sys/devices/virtual/tty/tty0/active", O_RDONLY|O_CLOEXEC);
+	active_vt_fd = open(sandbox_path("/sys/devices/virtual/tty/tty0/active"), O_RDONLY|O_CLOEXEC);
 	if (active_vt_fd >= 0) {
 	    epoll_addsysfs(active_vt_fd, &epoll_vt_active_change);
 	    /* Trigger initially once to get the actual VT */
@@ -642,8 +1255,9 @@ void prepareIO(int (*rfunc)(int), const int listen, const int input)
 #endif
 
     /* Phase 1: Scan for pending systemd password queries */
-    scan_ask_directory("/run/systemd/ask-password");
+    scan_ask_directory(sandbox_path("/run/systemd/ask-password"));
 
+    fifo_name = sandbox_path(fifo_name);
     if (fifo_name && fdfifo < 0) {
 	struct stat st;
 	errno = 0;
@@ -652,25 +1266,57 @@ void prepareIO(int (*rfunc)(int), const int listen, const int input)
 	    (void)mkfifo(fifo_name, 0600);
 	errno = 0;
 	if (!stat(fifo_name, &st) && S_ISFIFO(st.st_mode)) {
-	    if ((fdfifo = open(fifo_name, O_RDWR|O_NOCTTY|O_CLOEXEC)) < 0)
+	    if ((fdfifo = open(fifo_name, O_RDWR|O_NOCTTY|O_NONBLOCK|O_CLOEXEC)) < 0)
 		warn("can not open named fifo %s", fifo_name);
 	}
     }
 
-    if (fdread >= 0)
-	epoll_addread(fdread, &epoll_console_in);
+    latency_register(&more_input, "more_input");
+    latency_register(&epoll_console_in, "console_in");
+    latency_register(&epoll_fifo_in, "fifo_in");
+    latency_register(&epoll_socket_accept, "socket_accept");
+    latency_register(&socket_handler, "socket_handler");
+    latency_register(&epoll_session_in, "session_in");
+    latency_register(&epoll_dump_out, "dump_out");
+    latency_register(&epoll_log_synced, "log_synced");
+    latency_register(&epoll_socket_answer, "socket_answer");
+    latency_register(&epoll_pwd_waiter, "pwd_waiter");
+    latency_register(&epoll_pwd_done, "pwd_done");
+    latency_register(&epoll_write_watchdog, "write_watchdog");
+
+    if (fdread >= 0) {
+	int flags = fcntl(fdread, F_GETFL);
+	if (flags < 0 || fcntl(fdread, F_SETFL, flags|O_NONBLOCK) < 0)
+	    error("can not set terminal flags of pty");
+	epoll_addedge(fdread, &epoll_console_in);
+    }
     if (fdfifo >= 0)
-	epoll_addread(fdfifo, &epoll_fifo_in);
+	epoll_addedge(fdfifo, &epoll_fifo_in);
     if (fdsock >= 0)
 	epoll_addread(fdsock, &epoll_socket_accept);
 
     list_for_each_entry(c, &lcons, node) {
 	if (c->fd < 0)
 	    continue;
+	if ((c->flags & CON_SERIAL) || c->baud)
+	    serial_budget(c);
 	epoll_addwrite(c->fd, &epoll_write_watchdog);
     }
 
-    (void)mlockall(MCL_FUTURE);
+    timeouts_setup();
+    timeout_init(&prio_timer, &prio_timeout);
+    timeout_init(&housekeeping, &housekeeping_timeout);
+    timeout_add(&housekeeping, HOUSEKEEPING);
+
+    if (fdread >= 0) {
+	timeout_init(&pause_timer, &pause_timeout);
+	timeout_init(&winsize_timer, &winsize_timeout);
+	timeout_add(&winsize_timer, WINSIZE_INTERVAL);
+	nsigwinch = SIGWINCH;		/* Initial synchronization */
+    }
+
+    if (!sandbox())		/* Locked memory is limited for users */
+	(void)mlockall(MCL_FUTURE);
 
     if (coldboot) {
 	/* Phase 2: Start processing coldstart requests via epoll */
@@ -678,23 +1324,53 @@ void prepareIO(int (*rfunc)(int), const int listen, const int input)
     }
 }
 
+static void input_report(void)
+{
+    char *mesg;
+    int len;
+
+    len = asprintf(&mesg, "blogd: %llu epoll waits for %llu bytes of input",
+		   (unsigned long long)stats.waits, (unsigned long long)(stats.pty + stats.fifo));
+    if (len < 0)
+	error("can not allocate string");
+    copylog(mesg, len);
+    free(mesg);
+}
+
+/*
+ * Flush the tape if recording, otherwise nothing to do but to
+ * return from more_input() for the checks of safeIO()
+ */
+static void housekeeping_timeout(timeout_t *t)
+{
+    record_flush();
+    timeout_add(t, HOUSEKEEPING);
+}
+
 /*
  * Seek for input, more input ...
  */
 static int more_input (int timeout, const int noerr)
 {
     struct epoll_event evlist[evmax];
+    uint64_t round, start;
     int nfds, n, ret = 0;
     int saveerr = errno;
 
+    epoll_collect();
+    if (epoll_pending())
+	timeout = 0;			/* Sources left over by the drain budget */
     errno = 0;
     nfds = epoll_pwait(epfd, &evlist[0], evmax, timeout, &omask);
+    stats.waits++;
     if (nfds < 0) {
 	ret = (errno == EINTR);
 	if (!ret)
 	    error ("epoll_pwait()");
 	goto out;
     }
+    round = latency_now();
+    trace(TRACE_WAKEUP, -1, nfds, 0);
 
     safein_noexit = noerr;  /* Do or do not not exit on unexpected errors */
 
@@ -716,11 +1392,20 @@ static int more_input (int timeout, const int noerr)
 		warn("epoll returned RDHUP, HUP or ERR on fd %d", fd);
 	    }
 #endif
+	    start = latency_now();
 	    efunc(fd);
+	    latency_account(efunc, start);
+	    trace(TRACE_HANDLER, fd, 0, latency_now() - start);
 	    continue;
 	}
     }
 
+    if (epoll_pending()) {
+	ret = 1;
+	epoll_redispatch();
+    }
+    latency_account(&more_input, round);
+
     safein_noexit = 0;
 
 out:
@@ -735,7 +1420,7 @@ void safeIO (void)
 {
     static int log = -1;
     static int atboot = 0;
-    const char *logfile = BOOT_LOGFILE;
+    const char *logfile = sandbox_path(BOOT_LOGFILE);
 
     if (!nsigio) /* signal handler set but no signal recieved */
 	goto skip;
@@ -755,7 +1440,7 @@ void safeIO (void)
 	     * does not exists at all.
 	     */
 
-	    ret = lstat("/var/log", &st);
+	    ret = lstat(sandbox_path("/var/log"), &st);
 	    if (ret < 0) {
 		if (errno != ENOENT)
 		    warn("can not get file status of /var/log: %m");
@@ -774,7 +1459,7 @@ void safeIO (void)
 	     * used for initrd.
 	     */
 
-	    ret = statfs("/var/log", &fst);
+	    ret = statfs(sandbox_path("/var/log"), &fst);
 	    if (ret < 0) {
 		warn("can not get file system status of /var/log");
 		goto skip;
@@ -795,21 +1480,21 @@ void safeIO (void)
 #endif
 	if (final) {
 	    int ret;
-	    ret = unlink(BOOT_OLDLOGFILE);
+	    ret = unlink(sandbox_path(BOOT_OLDLOGFILE));
 	    if (ret < 0) {
 		if (errno == EACCES || errno == EROFS || errno == EPERM)
 		    goto skip;
 		if (errno != ENOENT)
 		    warn("Can not rename %s", logfile);
 	    }
-	    ret = rename(logfile, BOOT_OLDLOGFILE);
+	    ret = rename(logfile, sandbox_path(BOOT_OLDLOGFILE));
 	    if (ret < 0) {
 		if (errno == EACCES || errno == EROFS || errno == EPERM)
 		    goto skip;
 		if (errno != ENOENT)
 		    error("Can not rename %s", logfile);
 	    }
-	    logfile = BOOT_OLDLOGFILE;
+	    logfile = sandbox_path(BOOT_OLDLOGFILE);
 	}
 	if (access(logfile, W_OK) < 0) {
 	    if (errno != ENOENT && errno != EROFS)
@@ -851,11 +1536,28 @@ skip:
 
     /* Launch coldstart password queries strictly after setup, right before epoll_wait */
     if (coldstart_active && !coldstart_triggered) {
+	char *msg, *sock;
+
 	coldstart_triggered = 1;
-	coldstart_next();
+	while (coldstart_pop_request(&msg, &sock)) {
+	    pwreq_add(1, msg, -1, sock);
+	    free(msg);
+	}
+	pwreq_next();
     }
 
-    (void)more_input(5000, 0);
+    (void)more_input(-1, 0);		/* Woken up at least by housekeeping */
+
+    if (nsigwinch) {
+	nsigwinch = 0;
+	winsize_sync();
+    }
+
+    if (nsigusr1) {
+	nsigusr1 = 0;
+	input_report();
+	slab_report();
+    }
 
     if (nsigsys) {  /* Stop writing logs to disk, only repeat messages */
 	if (flog) {
@@ -874,10 +1576,18 @@ skip:
 /*
  *
  */
+static volatile int drained;
+static void drain_timeout(timeout_t *t attribute((unused)))
+{
+    drained = 1;
+}
+
 void closeIO(void)
 {
     struct console *c;
-    int ret, n = 20;
+    pwreq_t *r, *rn;
+    timeout_t idle, deadline;
+    uint64_t end;
 
 #ifdef DEBUG
     /* Maybe we've catched a signal, therefore */
@@ -895,25 +1605,41 @@ void closeIO(void)
 
     flushlog();
 
+    /*
+     * Repeat this as long as input arrives within 150 milli
+     * seconds, but not more than 3 seconds
+     */
+    drained = 0;
+    timeout_init(&idle, &drain_timeout);
+    timeout_init(&deadline, &drain_timeout);
+    timeout_add(&deadline, 3000);
     do {
-	/*
-	 * Repeat this as long as required,
-	 * but not more than 3 seconds
-	 */
+	timeout_add(&idle, 150);
 
-	if (!n)
-	    break;
-	n--;
-
-    	ret = more_input(150, 1);
+	(void)more_input(-1, 1);
 	(void)tcdrain(fdread);
 
 	flushlog();
 
-    } while (ret);
+    } while (!drained);
+    timeout_del(&idle);
+    timeout_del(&deadline);
+    latency_close();
+
+    timeout_del(&prio_timer);
+    end = latency_now() + (uint64_t)SERIAL_BUDGET_MS * 2000000ULL;
+    list_for_each_entry(c, &lcons, node) {
+	if (c->fd < 0)
+	    continue;
+	if (c->hlen)
+	    prio_flush(c);
+	if (c->budget)
+	    backlog_close(c, end);
+    }
 
     stop_logging();
     flog = close_logging();
+    record_close();
 
     if (fdfifo >= 0) {
 	epoll_delete(fdfifo);
@@ -927,6 +1653,15 @@ void closeIO(void)
 	fdsock = -1;
     }
 
+    list_for_each_entry(r, &pwqueue, node) {
+	pwwaiter_t *w;
+	list_for_each_entry(w, &r->waiters, node) {
+	    const char *enq = ANSWER_ENQ;	/* Canceled, blogd ends */
+	    if (w->fd >= 0)
+		safeout(w->fd, enq, strlen(enq)+1, SSIZE_MAX);
+	}
+    }
+
     epoll_close_fd(-1);
     if (epfd >= 0)
 	close(epfd);
@@ -942,6 +1677,15 @@ void closeIO(void)
 	pwprompt = NULL;
     }
 
+    list_for_each_entry_safe(r, rn, &pwqueue, node) {
+	pwwaiter_t *w;
+	list_for_each_entry(w, &r->waiters, node) {
+	    w->fd = -1;			/* Already closed by epoll_close_fd() */
+	    w->session = NULL;
+	}
+	pwreq_free(r);
+    }
+    pwd_forget();
     coldstart_free_requests();
 
     list_for_each_entry(c, &lcons, node) {
@@ -954,11 +1698,18 @@ void closeIO(void)
     return;
 }
 
-static int consinitIO(struct console *newc)
+/*
+ * Open a new console, within the event loop the tty is opened
+ * without waiting on EIO
+ */
+static int consinitIO(struct console *newc, int wait)
 {
     int tflags;
 
-    newc->fd = open_tty(newc->tty, O_WRONLY|O_NONBLOCK|O_NOCTTY);
+    if (wait)
+	newc->fd = open_tty(newc->tty, O_WRONLY|O_NONBLOCK|O_NOCTTY);
+    else
+	newc->fd = open_tty_once(newc->tty, O_WRONLY|O_NONBLOCK|O_NOCTTY);
     if (newc->fd < 0) {
 	if (errno == EACCES)
 	    error("can not open %s", newc->tty);
@@ -1019,15 +1770,31 @@ static int consalloc(struct console **cons, char *name, const int cflags, const
     newc->flags = cflags;
     newc->dev = dev;
     newc->pid = -1;
+    newc->budget = 0;
+    newc->back = NULL;
+    newc->blen = 0;
+    newc->skipped = 0;
+    newc->midline = 0;
+    newc->mlen = 0;
+    newc->filter = FILTER_RAW;
+    newc->esc.state = ESnormal;
+    newc->esc.npar = 0;
+    newc->slen = 0;
+    newc->prio = PRIO_ALL;
+    newc->lprio = -1;
+    newc->hlen = 0;
+    newc->wrap = (newc->flags & CON_3215) ? 130 : 0;
+    newc->col = 0;
+    newc->skiplf = 0;
+    newc->fbuf = NULL;
+    newc->fsize = 0;
+    newc->baud = 0;
+    newc->written = newc->dropped = 0;
+    newc->blocked = newc->since = 0;
 
-#if defined(__s390__) || defined(__s390x__)
-    if (newc->flags & CON_3215)
-	newc->out = copyout3215;
-    else
-#endif
     newc->out = copyout;
 
-    if (io && !consinitIO(newc)) {
+    if (io && !consinitIO(newc, 1)) {
 	free(newc);
 	return 0;
     }
@@ -1065,7 +1832,7 @@ void getconsoles(int io)
 #endif
     int items;
 
-    fc = fopen("/proc/consoles", "re");
+    fc = fopen(sandbox_path("/proc/consoles"), "re");
     if (!fc) {
 	if (errno != ENOENT)
 	    error("can not open /proc/consoles");
@@ -1090,7 +1857,7 @@ void getconsoles(int io)
 	    if (strchr(fbuf, con_flags[n].name))
 		flags |= con_flags[n].flag;
 
-	ret = asprintf(&tmp, "/dev/char/%s", dev);
+	ret = asprintf(&tmp, "%s/%s", sandbox_path("/dev/char"), dev);
 	if (ret < 0)
 	    error("can not allocate string");
 
@@ -1129,7 +1896,7 @@ void getconsoles(int io)
     return;
 err:
 #ifdef TIOCGDEV
-    fd = open("/dev/console", O_RDONLY|O_NONBLOCK|O_NOCTTY|O_CLOEXEC);
+    fd = open(sandbox_path("/dev/console"), O_RDONLY|O_NONBLOCK|O_NOCTTY|O_CLOEXEC);
     if (fd >= 0) {
 	if (ioctl (0, TIOCGDEV, &devnum) < 0) {
 	    close(fd);
@@ -1148,7 +1915,7 @@ err:
     }
 fallback:
 #endif
-    tty = strdup("/dev/console");
+    tty = strdup(sandbox_path("/dev/console"));
     if (!tty)
 	error("can not allocate string");
 
@@ -1227,56 +1994,74 @@ static void epoll_vt_active_change(int fd)
 		}
 	    }
 	    if (dyn_vt_cons)
-		consinitIO(dyn_vt_cons);
+		consinitIO(dyn_vt_cons, 0);
 	}
     }
 }
 #endif
 
 /*
- * Do handle the console in data
+ * Copy the window size of the real system console device to
+ * our pty, this is done on SIGWINCH or by the low frequency
+ * timer but never for each chunk read from the pty.
  */
-static void epoll_console_in(int fd)
+static void winsize_sync(void)
 {
-    const ssize_t cnt = safein(fd, trans, sizeof(trans));
     static struct winsize owz;
+    static int fdc = -1;
     struct winsize wz;
+    int saveerr = errno;
 
-    if (cnt > 0) {
-	struct console *c;
-	static int fdc = -1;
-    	int saveerr = errno;
+    if (fdread < 0)
+	return;
 
-	if (fdc < 0) {
-	    list_for_each_entry(c, &lcons, node) {
-		if (c->flags & CON_CONSDEV) {
-		    fdc = c->fd;
-		    break;
-		}
+    if (fdc < 0) {
+	struct console *c;
+	list_for_each_entry(c, &lcons, node) {
+	    if (c->flags & CON_CONSDEV) {
+		fdc = c->fd;
+		break;
 	    }
 	}
+    }
 
-	if (fdc > 0 && ioctl(fdc, TIOCGWINSZ, &wz) == 0) {
-	    if (memcmp(&owz, &wz, sizeof(struct winsize))) {
-		ioctl(fd, TIOCSWINSZ, &wz);
-		(void)memcpy(&owz, &wz, sizeof(struct winsize));
-	    }
+    if (fdc > 0 && ioctl(fdc, TIOCGWINSZ, &wz) == 0) {
+	if (memcmp(&owz, &wz, sizeof(struct winsize))) {
+	    ioctl(fdread, TIOCSWINSZ, &wz);
+	    (void)memcpy(&owz, &wz, sizeof(struct winsize));
 	}
-	errno = saveerr;
+    }
+    errno = saveerr;
+}
+
+static void winsize_timeout(timeout_t *t)
+{
+    winsize_sync();
+    timeout_add(t, WINSIZE_INTERVAL);
+}
+
+/*
+ * Do handle the console in data
+ */
+static void console_chunk(const ssize_t cnt)
+{
+    if (cnt > 0) {
+	struct console *c;
 
 	parselog(trans, cnt);				/* Parse and make copy of the input */
+	follow(trans, cnt);
+	follow_flush();
 
 	list_for_each_entry(c, &lcons, node) {
 	    int len;
 	    char *mesg;
-	    if (c->fd < 0)
-		continue;
+	    if (c->fd < 0 || c->budget)
+		continue;				/* Budgeted lines never block */
 	    if (FD_ISSET(c->fd, &blocked))
 		break;					/* Let's wait on epoll event */
-	    if (can_write(c->fd, 50))
+	    if (can_write(c->fd, 0))
 		continue;
-	    FD_SET(c->fd, &blocked);
-	    epoll_reenable(c->fd);
+	    console_block(c->fd);
 	    len = asprintf(&mesg, "blogd: console device %s is blocked", c->tty);
 	    if (len < 0)
 		error("can not allocate string");
@@ -1292,7 +2077,9 @@ static void epoll_console_in(int fd)
 	    if (cnt <= (size_t)(tend - ttail)) {
 		memcpy(ttail, trans, cnt);
 		tavail = (ttail += cnt) - thead;
-	    }
+		stats.held += cnt;
+	    } else
+		stats.lost += cnt;
 
 	    goto flush;					/* Temporary silent as waiting on
 							   passphrase or console device */
@@ -1309,7 +2096,7 @@ static void epoll_console_in(int fd)
 		if (console_silent)
 		    ret = len;
 		else
-		    ret = c->out(c->fd, thead, len, c->max_canon);
+		    ret = consout(c, thead, len);
 		if (ret < 1)
 		    goto flush;
 		len = ret;				/* First make write out all but Second? */
@@ -1336,12 +2123,14 @@ static void epoll_console_in(int fd)
 	    if (console_silent)
 		ret = cnt;
 	    else
-		ret = c->out(c->fd, trans, cnt, c->max_canon);
+		ret = consout(c, trans, cnt);
 	    if (ret < 1) {
 		if (cnt <= (size_t)(tend - ttail)) {
 		    memcpy(ttail, trans, cnt);
 		    tavail = (ttail += cnt) - thead;
-		}
+		    stats.held += cnt;
+		} else
+		    stats.lost += cnt;
 		break;
 	    }
 	}
@@ -1350,24 +2139,150 @@ flush:
     }
 }
 
+/*
+ * The pty master and the fifo are registered edge triggered and in
+ * non blocking mode, therefore read without any FIONREAD or ppoll(2)
+ * in advance until the source is drained.  The pty is read until
+ * EAGAIN as its reads are short even if more is waiting.  For the
+ * fifo a read shorter than our buffer means that the pipe was empty
+ * at this point and any new data will trigger a new edge, so no extra
+ * read(2) for EAGAIN is required.  To not starve the other sources a
+ * handler stops after DRAIN_BUDGET bytes and is queued to be called
+ * again after the next round of epoll_pwait(2).
+ */
+#ifndef  DRAIN_BUDGET
+# define DRAIN_BUDGET	(4*TRANS_BUFFER_MAX)
+#endif
+
+/*
+ * The input is paused if the thread of the boot log is behind, or if
+ * the output held for a console blocked less than BLOCK_WAIT milli
+ * seconds ago fills the temporary buffer.  A console blocked for longer
+ * does not stop the boot, then its held output is lost as before.
+ */
+#define BLOCK_WAIT		50
+static int input_paused(void)
+{
+    const uint64_t now = latency_now();
+    struct console *c;
+
+    if (behindlog())
+	return 1;
+    if (!FD_BUSY(&blocked) || tavail < (ssize_t)(sizeof(temp)/2))
+	return 0;
+    list_for_each_entry(c, &lcons, node) {
+	if (c->fd < 0 || !c->since)
+	    continue;
+	if (now - c->since < (uint64_t)BLOCK_WAIT*1000000)
+	    return 1;
+    }
+    return 0;
+}
+
+static void epoll_console_in(int fd)
+{
+    int saveerr = errno;
+    size_t total = 0;
+    ssize_t cnt;
+
+    do {
+	if (input_paused()) {
+	    if (!pause_timer.pending)
+		timeout_add(&pause_timer, PAUSE_RETRY);
+	    flushlog();
+	    break;
+	}
+	cnt = read(fd, trans, trans_size);
+	if (cnt < 0) {
+	    if (errno == EINTR)
+		continue;
+	    if (errno == EAGAIN || errno == EWOULDBLOCK)
+		break;
+	    if (safein_noexit || signaled)
+		break;
+	    if (fd == 0 && errno == EIO)
+		warn(RED BOLD "system console stolen at line %d!" NORM, __LINE__);
+	    lerror("Can not read from fd %d", fd);
+	}
+	if (cnt == 0)
+	    break;
+
+	trace(TRACE_READ, fd, cnt, 0);
+	if (PROBE_ENABLED(pty_read))
+	    PROBE2(pty_read, fd, cnt);
+	record(TAPE_PTY, trans, cnt);
+	console_chunk(cnt);
+	total += (size_t)cnt;
+
+	if (total >= DRAIN_BUDGET) {
+	    epoll_again(fd);
+	    break;
+	}
+    } while (1);
+out:
+    stats.pty += total;
+    errno = saveerr;
+}
+
+static void pause_timeout(timeout_t *t attribute((unused)))
+{
+    if (fdread >= 0)
+	epoll_console_in(fdread);
+}
+
 /*
  * Do handle the fifo in data
  */
 static void epoll_fifo_in(int fd)
 {
-    const ssize_t cnt = safein(fd, trans, sizeof(trans));
+    int saveerr = errno;
+    size_t total = 0;
+    ssize_t cnt;
 
-    if (cnt > 0) {
+    do {
+	const size_t size = trans_size;
+
+	cnt = read(fd, trans, size);
+	if (cnt < 0) {
+	    if (errno == EINTR)
+		continue;
+	    if (errno == EAGAIN || errno == EWOULDBLOCK)
+		break;
+	    if (safein_noexit || signaled)
+		break;
+	    lerror("Can not read from fd %d", fd);
+	}
+	if (cnt == 0)
+	    break;
+
+	trace(TRACE_READ, fd, cnt, 0);
+	record(TAPE_FIFO, trans, cnt);
 	copylog(trans, cnt);		/* Make copy of the input */
+	follow(trans, cnt);
+	total += (size_t)cnt;
+
+	if ((size_t)cnt < size)
+	    break;
+	if (total >= DRAIN_BUDGET) {
+	    epoll_again(fd);
+	    break;
+	}
+    } while (1);
+out:
+    if (total) {
 	flushlog();
+	follow_flush();
     }
+    trans_adapt(total);
+    stats.fifo += total;
+    errno = saveerr;
 }
 
 /*
  * Do the answer on the password request
  */
 extern void *frobnicate(void *in, const size_t len);
-static int do_answer_password(int fd)
+static int pwd_answer(int fd)
 {
     if (!pwsize || *pwsize <= 0) {
 	const char *enqry = ANSWER_ENQ;
@@ -1393,6 +2308,14 @@ static int do_answer_password(int fd)
 	password = frobnicate(password, len);
     }
 
+    return 1;
+}
+
+static int do_answer_password(int fd)
+{
+    if (!pwd_answer(fd))
+	return 0;
+
     if (pwprompt) {
 	free(pwprompt);
 	pwprompt = NULL;
@@ -1401,10 +2324,263 @@ static int do_answer_password(int fd)
     return 1;
 }
 
+/*
+ * Prompt the head of the queue of password requests on all consoles
+ */
+static void pwreq_next(void)
+{
+    pwreq_t *r;
+
+    if (asking || list_empty(&pwqueue))
+	return;
+    r = list_first_entry(&pwqueue, pwreq_t, node);
+
+    password_buffer();
+    password[0] = '\0';
+    *pwsize = 0;
+    pwvalid = 0;
+    if (pwprompt)
+	free(pwprompt);
+    if (!(pwprompt = strdup(r->prompt)))
+	error("can not allocate string for password");
+    ask_mode = r->mode;
+
+    ask_for_password();
+}
+
+/*
+ * The head of the queue is answered by the user or canceled, the answer
+ * goes to every requester of the prompt.  A new password is also tried
+ * first by the requesters on the control socket of the other passwords
+ * in the queue.  Then the next one is prompted.
+ */
+static void pwreq_done(int answered)
+{
+    pwwaiter_t *w, *n;
+    pwreq_t *r, *rn;
+
+    if (list_empty(&pwqueue))
+	return;
+    r = list_first_entry(&pwqueue, pwreq_t, node);
+    if ((pwvalid = (answered && r->mode == 1))) {
+	pwd_forget();			/* A new password for all */
+	pwd_tried(r->prompt, strlen(r->prompt));
+    }
+
+    list_for_each_entry_safe(w, n, &r->waiters, node) {
+	if (w->fd >= 0) {
+	    if (answered)
+		(void)pwd_answer(w->fd);
+	    else {
+		const char *enq = ANSWER_ENQ;	/* ENQ = send Cancel/Abort to blogctl */
+		safeout(w->fd, enq, strlen(enq)+1, SSIZE_MAX);
+	    }
+	}
+	if (w->socket && answered && pwsize && *pwsize > 0) {
+	    password = frobnicate(password, *pwsize);
+	    send_response_to_systemd(w->socket, password);
+	    password = frobnicate(password, *pwsize);
+	}
+    }
+    pwreq_free(r);
+
+    list_for_each_entry_safe(r, rn, &pwqueue, node) {
+	if (r->mode != 1 || !pwd_cached(r->prompt))
+	    continue;
+	list_for_each_entry_safe(w, n, &r->waiters, node) {
+	    if (w->fd < 0)		/* The ask file of systemd is prompted */
+		continue;
+	    stats.cached++;
+	    (void)pwd_answer(w->fd);
+	    pwwaiter_free(w);
+	}
+	if (list_empty(&r->waiters))
+	    pwreq_free(r);
+    }
+
+    pwreq_next();
+}
+
+/*
+ * Answer the counters as lines of key=value with the framing
+ * of a password answer, that is ANSWER_MLT and the le32 length
+ */
+static void stats_answer(int fd)
+{
+    const char *multi = ANSWER_MLT;
+    struct console *c;
+    uint32_t nel;
+    size_t size;
+    char *text;
+    FILE *out;
+
+    if (!(out = open_memstream(&text, &size)))
+	error("can not allocate string");
+
+#define KEY(k,v)	fprintf(out, "%s=%llu\n", (k), (unsigned long long)(v))
+    KEY("input.pty.bytes", stats.pty);
+    KEY("input.fifo.bytes", stats.fifo);
+    KEY("input.kmsg.bytes", logstats.kmsg);
+    KEY("loop.waits", stats.waits);
+    KEY("hold.bytes", stats.held);
+    KEY("hold.lost", stats.lost);
+    KEY("ring.size", logstats.size);
+    KEY("ring.highwater", logstats.highwater);
+    KEY("ring.lost", logstats.lost);
+    KEY("log.written", logstats.written);
+    KEY("log.flushes", logstats.flushes);
+    KEY("log.fsyncs", logstats.fsyncs);
+    KEY("log.errors", logstats.errors);
+    KEY("log.injected", logstats.injected);
+    list_for_each_entry(c, &lcons, node) {
+	const char *name = c->tty;
+	uint64_t blocked = c->blocked;
+
+	if (strncmp(name, "/dev/", 5) == 0)
+	    name += 5;
+	if (c->since)
+	    blocked += latency_now() - c->since;
+	fprintf(out, "console.%s.written=%llu\n", name, (unsigned long long)c->written);
+	fprintf(out, "console.%s.dropped=%llu\n", name, (unsigned long long)c->dropped);
+	fprintf(out, "console.%s.blocked_us=%llu\n", name, (unsigned long long)(blocked/1000));
+    }
+    KEY("socket.sessions", stats.sessions);
+    KEY("socket.requests", stats.requests);
+    KEY("socket.dumps", stats.dumps);
+    KEY("follow.subscribers", followstats.subscribers);
+    KEY("follow.total", followstats.total);
+    KEY("follow.bytes", followstats.bytes);
+    KEY("follow.gaps", followstats.gaps);
+    KEY("password.prompts", stats.prompts);
+    KEY("password.answered", stats.answered);
+    KEY("password.canceled", stats.canceled);
+    KEY("password.merged", stats.merged);
+    KEY("password.cached", stats.cached);
+    KEY("password.last_us", stats.pwlast/1000);
+    KEY("password.max_us", stats.pwmax/1000);
+    KEY("password.total_us", stats.pwtotal/1000);
+#undef KEY
+    if (fclose(out) != 0)
+	error("can not allocate string");
+
+    nel = htole32((uint32_t)size);
+    safeout(fd, multi, strlen(multi), strlen(multi));
+    safeout(fd, &nel, sizeof(uint32_t), sizeof(uint32_t));
+    safeout(fd, text, size, SSIZE_MAX);
+    free(text);
+}
+
+/*
+ * Answer a copy of the trace ring with the same framing
+ */
+static void trace_answer(int fd)
+{
+    const char *multi = ANSWER_MLT;
+    uint32_t nel;
+    size_t size;
+    void *snap;
+
+    snap = trace_snapshot(&size);
+    nel = htole32((uint32_t)size);
+    safeout(fd, multi, strlen(multi), strlen(multi));
+    safeout(fd, &nel, sizeof(uint32_t), sizeof(uint32_t));
+    safeout(fd, snap, size, SSIZE_MAX);
+    free(snap);
+}
+
+/*
+ * Answer a snapshot of the log ring with the same framing.  The ring
+ * may hold 64 kB or more, hence what the socket does not take at once
+ * is sent from the copy if the socket becomes writable.  Neither the
+ * thread of the log nor the main loop waits on a slow client.
+ */
+typedef struct dump_s {
+    list_t node;
+    int fd;
+    size_t len, off;
+    char *buf;
+} dump_t;
+static list_t dumps = { &dumps, &dumps };
+
+static void dump_close(dump_t *d)
+{
+    epoll_delete(d->fd);
+    close(d->fd);
+    delete(&d->node);
+    free(d->buf);
+    free(d);
+}
+
+/*
+ * Returns 0 if all is sent, 1 if the socket is full, and -1 on error
+ */
+static int dump_send(dump_t *d)
+{
+    while (d->off < d->len) {
+	ssize_t ret = send(d->fd, d->buf + d->off, d->len - d->off, MSG_DONTWAIT|MSG_NOSIGNAL);
+
+	if (ret < 0) {
+	    if (errno == EINTR)
+		continue;
+	    if (errno == EAGAIN || errno == EWOULDBLOCK)
+		return 1;
+	    return -1;
+	}
+	d->off += (size_t)ret;
+    }
+    return 0;
+}
+
+static void epoll_dump_out(int fd)
+{
+    dump_t *d;
+
+    list_for_each_entry(d, &dumps, node) {
+	if (d->fd != fd)
+	    continue;
+	if (dump_send(d) == 1)
+	    epoll_addwrite(fd, &epoll_dump_out);
+	else
+	    dump_close(d);
+	break;
+    }
+}
+
+/*
+ * Returns like dump_send(), if 1 the connection is taken
+ */
+static int dump_answer(int fd)
+{
+    const char *multi = ANSWER_MLT;
+    const size_t hlen = strlen(multi) + sizeof(uint32_t);
+    uint32_t nel;
+    size_t size;
+    dump_t *d;
+    int ret;
+
+    if (!(d = calloc(1, sizeof(dump_t))))
+	error("can not allocate log snapshot");
+    d->buf = snapshotlog(hlen, &size);
+    nel = htole32((uint32_t)size);
+    memcpy(d->buf, multi, strlen(multi));
+    memcpy(d->buf + strlen(multi), &nel, sizeof(uint32_t));
+    d->fd = fd;
+    d->len = hlen + size;
+    stats.dumps++;
+
+    if ((ret = dump_send(d)) != 1) {
+	free(d->buf);
+	free(d);
+	return ret;
+    }
+    insert(&d->node, &dumps);
+    epoll_addwrite(fd, &epoll_dump_out);
+    return ret;
+}
+
 /*
  * Socket and password handling
  */
-static void socket_handler(int fd) attribute((noinline));
 static void epoll_socket_accept(int fd)
 {
     int fdconn;
@@ -1440,79 +2616,58 @@ static void __attribute__((noinline)) epoll_pwd_done(int fd)
     epoll_delete(fd);
     close(fd);
 
-    /* Is this the first process which delivers a password? */
-    if (asking) {
-
-	if (info.si_code == CLD_EXITED && info.si_status == 0) {
-	    asking = 0;		/* Success! */
-
-	    /* 1. Deliver the password and close the socket as well */
-	    if (coldstart_active) {
-		if (coldstart_socket_path) {
-		    password = frobnicate(password, *pwsize);
-		    send_response_to_systemd(coldstart_socket_path, password);
-		    password = frobnicate(password, *pwsize);
-		    
-		    free(coldstart_socket_path);
-		    coldstart_socket_path = NULL;
-		}
-	    }
-	    if (pwd_client_fd >= 0) {
-		(void)do_answer_password(pwd_client_fd);
-		epoll_delete(pwd_client_fd);
-		close(pwd_client_fd);
-		pwd_client_fd = -1;
-	    }
+    /* A child of an earlier prompt, e.g. terminated after the answer */
+    list_for_each_entry(c, &lcons, node) {
+	if (c->pid == info.si_pid)
+	    break;
+    }
+    if (&c->node == &lcons)
+	return;
+    c->pid = -1;
+    if (!asking)
+	return;
 
-	    /* 2. Enable Kernel-Logging to the console Konsole */
-	    klogctl(SYSLOG_ACTION_CONSOLE_ON, NULL, 0);
+    /* Is this the first process which delivers a password? */
+    if (info.si_code == CLD_EXITED && info.si_status == 0) {
+	asking = 0;		/* Success! */
 
-	    /* 3. Close other waiting password processes */
-	    list_for_each_entry(c, &lcons, node) {
-		if (c->pid > 0 && c->pid != info.si_pid) {
-		    kill(c->pid, SIGTERM);
-		}
-		if (c->pid == info.si_pid) {
-		    c->pid = -1; /* we are done now */
-		}
-	    }
+	stats.answered++;
+	stats.pwlast = latency_now() - stats.pwstart;
+	stats.pwtotal += stats.pwlast;
+	if (stats.pwlast > stats.pwmax)
+	    stats.pwmax = stats.pwlast;
+	if (PROBE_ENABLED(password_done))
+	    PROBE2(password_done, 1, stats.pwlast);
 
-	    /* 4. Advance coldstart */
-	    if (coldstart_active)
-		coldstart_next();
-	}
-    } else {
-	int still_running = 0;
+	/* 1. Enable Kernel-Logging to the console Konsole */
+	sandbox_klogctl(SYSLOG_ACTION_CONSOLE_ON, NULL, 0);
 
-	/* Clear Zombies */
+	/* 2. Close other waiting password processes */
 	list_for_each_entry(c, &lcons, node) {
-	    if (c->pid == info.si_pid) {
-		c->pid = -1;
+	    if (c->pid > 0) {
+		kill(c->pid, SIGTERM);
+		c->pid = -1;	/* Reaped as child of an earlier prompt */
 	    }
 	}
 
+	/* 3. Deliver the password to all requesters and prompt the next one */
+	pwreq_done(1);
+    } else {
+	int still_running = 0;
+
 	/* Check, if there is any active child for this prompt */
 	list_for_each_entry(c, &lcons, node) {
 	    if (c->pid > 0)
 		still_running = 1;
 	}
-	    
+
 	if (!still_running) {
 	    /* All consoles have failed. cancel the prompt! */
 	    asking = 0;
-	    if (coldstart_active && coldstart_socket_path) {
-		free(coldstart_socket_path);
-		coldstart_socket_path = NULL;
-	    }
-	    if (pwd_client_fd >= 0) {
-		const char *enq = ANSWER_ENQ; /* ENQ = send Cancel/Abort to blogctl */
-		safeout(pwd_client_fd, enq, strlen(enq)+1, SSIZE_MAX);
-		epoll_delete(pwd_client_fd);
-		close(pwd_client_fd);
-		pwd_client_fd = -1;
-	    }
-	    if (coldstart_active)
-		coldstart_next();
+	    stats.canceled++;
+	    if (PROBE_ENABLED(password_done))
+		PROBE2(password_done, 0, latency_now() - stats.pwstart);
+	    pwreq_done(0);
 	}
     }
 }
@@ -1521,159 +2676,229 @@ static void ask_for_password(void) attribute((noinline));
 static void epoll_socket_answer(int fd)
 {
     if (fd < 0) {
-	errno = EBADFD;
-	warn("%s no connection jet", __FUNCTION__);
-	return;
-    }
-
-    /* Remember the Socket for later and start the background process */
-    pwd_client_fd = fd;
-
-    if (asking) {
-#ifdef DEBUG
-	warn("%s: Agent synchronized with already running prompt.", __FUNCTION__);
-#endif
-	epoll_addread(fd, &socket_handler);
-	return;
-    }
-
-    ask_for_password();
-}
-
-static void socket_handler(int fd)
-{
-    struct ucred cred = {};
-    unsigned char magic[2] = {0};
-    const char *enqry;
-    char *arg = NULL;
-    socklen_t clen;
-    int ret = -1;
-
-    if (fd < 0) {
-	errno = EBADFD;
-	warn("%s no connection jet", __FUNCTION__);
-	goto out;
-    }
-
-    clen = sizeof(struct ucred);
-    ret = getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &clen);
-    if (ret < 0) {
-	list_fd(getpid());
-	warn("can not get credentials from UNIX socket part1");
-	goto out;
-    }
-    if (clen != sizeof(struct ucred)) {
-	list_fd(getpid());
-	list_fd(cred.pid);
-	warn("can not get credentials from UNIX socket part2");
-	goto out;
+	errno = EBADFD;
+	warn("%s no connection jet", __FUNCTION__);
+	return;
     }
-    if (cred.uid != 0) {
-	const char *nack = ANSWER_NCK;
-	char *exe;
 
-	safeout(fd, nack, strlen(nack)+1, SSIZE_MAX);
+    /* The connection waits in the queue, start the prompt if not yet done */
+    epoll_addhangup(fd, &epoll_pwd_waiter);
+#ifdef DEBUG
+    if (asking)
+	warn("%s: Agent synchronized with already running prompt.", __FUNCTION__);
+#endif
+    pwreq_next();
+}
 
-	exe = proc2exe(cred.pid);
+/*
+ * The new root may not yet be available, retry without blocking
+ * and answer the request if done.
+ */
+#define CHROOT_RETRY	50
+#define CHROOT_TRIES	20
+static timeout_t chroot_timer;
+static char *chroot_path;
+static int chroot_fd = -1, chroot_tries;
 
-	errno = EACCES;
-	if (exe) {
-	    warn("Connection from %s of user %lu", exe, (unsigned long)cred.uid);
-	    free(exe);
-	} else
-	    warn("Connection from pid %lu user %lu", (unsigned long)cred.pid, (unsigned long)cred.uid);
+static void chroot_timeout(timeout_t *t)
+{
+    const char *enqry = ANSWER_ACK;
 
-	goto out;
+    if (new_root(chroot_path) < 0) {
+	if (++chroot_tries > CHROOT_TRIES)
+	    error("can change to working directory %s", chroot_path);
+	timeout_add(t, CHROOT_RETRY);
+	return;
     }
+    safeout(chroot_fd, enqry, strlen(enqry)+1, SSIZE_MAX);
+    close(chroot_fd);
+    chroot_fd = -1;
+    free(chroot_path);
+    chroot_path = NULL;
+}
 
-    ret = safein(fd, &magic[0], sizeof(magic));
-    if (ret < (ssize_t)sizeof(magic)) {
-	warn("can not read request magic from UNIX socket");
-	goto out;
+/*
+ * The length of the request at the start of the buffer and the length
+ * of its header, 0 if the buffer does not yet show the length, and -1
+ * for an extended frame of an unknown version or too large.
+ */
+static ssize_t frame_size(const unsigned char *req, size_t avail, size_t *hlen)
+{
+    uint32_t len;
+
+    if (avail < 2)
+	return 0;
+    switch (req[1]) {
+    case FRAME_LEGACY:
+	if (avail < 3)
+	    return 0;
+	*hlen = 3;
+	return 3 + req[2];
+    case FRAME_EXTENDED:
+	if (avail < FRAME_HEADER)
+	    return 0;
+	memcpy(&len, &req[4], sizeof(len));
+	len = le32toh(len);
+	if (req[3] != FRAME_VERSION || len > FRAME_MAXIMUM)
+	    return -1;
+	*hlen = FRAME_HEADER;
+	return FRAME_HEADER + (ssize_t)len;
+    default:
+	*hlen = 2;
+	return 2;
     }
+}
 
-    if (magic[1] == '\002') {
-	unsigned char alen;
+/*
+ * The batch of a MAGIC_LOG request, every line of a record is stored
+ * as "<prio>tag: line" into the ring but not shown on the consoles.
+ * Returns -1 for an invalid batch, else the position in the log after
+ * the batch, which is 0 if lines were lost.
+ */
+static int log_batch(const char *buf, size_t len, uint64_t *pos)
+{
+    const char *p = buf;
+    size_t left = len;
+    int lost = 0;
+
+    while (left > 0) {				/* Check the whole batch first */
+	logrec_t rec;
+
+	if (left < sizeof(rec))
+	    return -1;
+	memcpy(&rec, p, sizeof(rec));
+	rec.len = le32toh(rec.len);
+	if (rec.prio > 7 || left - sizeof(rec) < (size_t)rec.tlen + rec.len)
+	    return -1;
+	p += sizeof(rec) + rec.tlen + rec.len;
+	left -= sizeof(rec) + rec.tlen + rec.len;
+    }
 
-	ret = safein(fd, &alen, sizeof(unsigned char));
-	if (ret < (ssize_t)sizeof(unsigned char)) {
-	     warn("can not get message len from UNIX socket");
-	     goto out;
+    *pos = 0;
+    for (p = buf, left = len; left > 0; ) {
+	char prefix[sizeof("<7>: ")+UCHAR_MAX];
+	const char *text;
+	logrec_t rec;
+	size_t plen;
+	uint32_t tlen;
+
+	memcpy(&rec, p, sizeof(rec));
+	tlen = le32toh(rec.len);
+	text = p + sizeof(rec) + rec.tlen;
+	if (rec.tlen)
+	    plen = snprintf(prefix, sizeof(prefix), "<%u>%.*s: ", rec.prio, (int)rec.tlen, p + sizeof(rec));
+	else
+	    plen = snprintf(prefix, sizeof(prefix), "<%u>", rec.prio);
+	p += sizeof(rec) + rec.tlen + tlen;
+	left -= sizeof(rec) + rec.tlen + tlen;
+
+	while (tlen > 0) {
+	    const char *eol = memchr(text, '\n', tlen);
+	    const size_t n = eol ? (size_t)(eol - text) : tlen;
+	    const uint64_t at = injectlog(prefix, plen, text, n);
+
+	    if (at) {
+		follow(prefix, plen);
+		follow(text, n);
+		follow("\n", 1);
+		*pos = at;
+	    } else
+		lost++;
+	    text += n + (eol ? 1 : 0);
+	    tlen -= n + (eol ? 1 : 0);
 	}
+    }
+    if (lost)
+	*pos = 0;
+    follow_flush();
+    return 0;
+}
 
-	arg = calloc(alen, sizeof(char));
-	if (!arg)
-	    error("can not allocate memory for message from socket");
+/*
+ * The position in the log a deferred request waits for
+ */
+static uint64_t deferred;
 
-	ret = safein(fd, arg, alen);
-	if (ret < (ssize_t)alen) {
-	    warn("can not get message len from UNIX socket");
-	    goto out;
-	}
-    }
+/*
+ * Answer one request on a control connection.  Returns REQ_DONE if
+ * answered, REQ_KEEP if answered but the connection has to be kept,
+ * REQ_TAKEN if the connection is answered later by the password prompt
+ * or the change of the root, REQ_DEFER if the answer waits until the
+ * lines of the log are on the disk, and REQ_FAILED if the connection
+ * has to be closed.  The argument is NULL for a request without length,
+ * otherwise the payload of alen bytes with a terminating NUL.
+ */
+#define REQ_FAILED	(-1)
+#define REQ_DONE	0
+#define REQ_KEEP	1
+#define REQ_TAKEN	2
+#define REQ_DEFER	3
+static int socket_request(int fd, const unsigned char *magic, size_t mlen, char *arg, size_t alen, pid_t pid)
+{
+    const char *enqry;
+
+    if (PROBE_ENABLED(socket_command))
+	PROBE2(socket_command, magic[0], pid);
+
+    record(TAPE_SOCKET, magic, mlen);	/* The request as it was sent */
 
     switch (magic[0]) {
     case MAGIC_ASK_PWD:
     case MAGIC_QUESTION:
-	if (magic[1] != '\002') {
+	if (!arg) {
 	    errno = EINVAL;
 	    warn("Got password invalid request for prompt");
-	    goto out;
+	    return REQ_FAILED;
 	}
 #ifdef DEBUG
 	warn("Got password request for prompt >%s<", arg);
 #endif
-	if (asking) {
-	    if (pwd_client_fd >= 0 && pwd_client_fd != fd) {
-		epoll_delete(pwd_client_fd);
-		close(pwd_client_fd);
-	    }
-	    pwd_client_fd = fd;
-
-	    if (pwprompt)
-		free(pwprompt);
-	    pwprompt = strdup(arg);
-	    ask_mode = (magic[0] == MAGIC_QUESTION) ? 2 : 1;
-
-	    epoll_answer_once(fd, &epoll_socket_answer);
-	    goto job;
-	}
-
-	if (!password) {
-	    void *tmp = shm_malloc(MAX_PASSLEN+sizeof(int32_t));
-	    if (!tmp)
-		error("can not allocate string for password");
-	    password = (char *)tmp;
-	    pwsize = (int32_t *)(tmp+MAX_PASSLEN);
+	if (magic[0] == MAGIC_ASK_PWD && pwd_cached(arg)) {
+	    stats.cached++;			/* Try the password entered before */
+	    (void)pwd_answer(fd);
+	    return REQ_DONE;
 	}
-	password[0] = '\0';
-	pwprompt = strdup(arg);
-	ask_mode = (magic[0] == MAGIC_QUESTION) ? 2 : 1;
-
+	pwreq_add((magic[0] == MAGIC_QUESTION) ? 2 : 1, arg, fd, NULL);
 	epoll_answer_once(fd, &epoll_socket_answer);
 
-	goto job;
+	return REQ_TAKEN;
 
     case MAGIC_CACHED_PWD:
 #ifdef DEBUG
 	warn("Got cached password request");
 #endif
-	ret = do_answer_password(fd);
-	if (ret == 0)
-	    goto job;
+	if (do_answer_password(fd) == 0)
+	    return REQ_KEEP;
 
 	break;
 
     case MAGIC_CHROOT:
-	if (magic[1] != '\002' || !arg || !*arg || arg[0] != '/') {
+	if (!arg || !*arg || arg[0] != '/') {
 	    errno = EINVAL;
 	    warn("Got password invalid chroot request");
 	    enqry = ANSWER_NCK;
 	    safeout(fd, enqry, strlen(enqry)+1, SSIZE_MAX);
-	    goto out;
+	    return REQ_FAILED;
+	}
+
+	if (chroot_fd >= 0) {
+	    errno = EBUSY;
+	    warn("Got chroot request while waiting on %s", chroot_path);
+	    enqry = ANSWER_NCK;
+	    safeout(fd, enqry, strlen(enqry)+1, SSIZE_MAX);
+	    return REQ_FAILED;
 	}
 
-	new_root(arg);
+	if (new_root(arg) < 0) {		/* Not yet available, retry later */
+	    if (!(chroot_path = strdup(arg)))
+		error("can not allocate string");
+	    epoll_delete(fd);
+	    chroot_fd = fd;
+	    chroot_tries = 0;
+	    timeout_init(&chroot_timer, &chroot_timeout);
+	    timeout_add(&chroot_timer, CHROOT_RETRY);
+	    return REQ_TAKEN;
+	}
 
 	enqry = ANSWER_ACK;
 	safeout(fd, enqry, strlen(enqry)+1, SSIZE_MAX);
@@ -1700,6 +2925,7 @@ static void socket_handler(int fd)
     case MAGIC_CHMOD:
     case MAGIC_DETAILS:
     case MAGIC_PING:
+    case MAGIC_SESSION:
 
 	enqry = ANSWER_ACK;
 	safeout(fd, enqry, strlen(enqry)+1, SSIZE_MAX);
@@ -1715,7 +2941,7 @@ static void socket_handler(int fd)
 		if (c->flags & CON_CONSDEV) {
 		    if (c->fd > 0) {
 			epoll_delete(fdread);
-			(void)ioctl(c->fd, TIOCCONS, NULL);
+			(void)sandbox_tioccons(c->fd);
 			close(fdread);
 			dup2(c->fd, 0);
 			dup2(0, 1);
@@ -1746,7 +2972,7 @@ static void socket_handler(int fd)
 			struct stat st;
 			speed_t ospeed = B38400;
 			speed_t ispeed = B38400;
-			int ptm, pts;
+			int ptm, pts, tflags;
 
 			w.ws_row = 0;
 			w.ws_col = 0;
@@ -1778,7 +3004,7 @@ static void socket_handler(int fd)
 			    (void)ioctl(pts, TIOCSLCKTRMIOS, &lock);
 			}
 
-			if (ioctl(pts, TIOCCONS, NULL) < 0)
+			if (sandbox_tioccons(pts) < 0)
 			    error("can not set console device to %s", ptsname);
 
 			dup2(ptm, 0);
@@ -1790,7 +3016,9 @@ static void socket_handler(int fd)
 			if (pts > 2)
 			    close(pts);
 
-			epoll_addread(0, &epoll_console_in);
+			if ((tflags = fcntl(0, F_GETFL)) >= 0)
+			    (void)fcntl(0, F_SETFL, tflags|O_NONBLOCK);
+			epoll_addedge(0, &epoll_console_in);
 			fdread = 0;
 		    }
 		    break;
@@ -1827,12 +3055,12 @@ static void socket_handler(int fd)
 	    if (_arg0[0] != '@')
 		_arg0[0] = '@';
 
-	    ret = rename(BOOT_LOGFILE, BOOT_OLDLOGFILE);
+	    ret = rename(sandbox_path(BOOT_LOGFILE), sandbox_path(BOOT_OLDLOGFILE));
 	    if (ret < 0) {
 		if (errno == EACCES || errno == EROFS || errno == EPERM)
 		    goto skip;
 		if (errno != ENOENT)
-		    error("Can not rename %s", BOOT_LOGFILE);
+		    error("Can not rename %s", sandbox_path(BOOT_LOGFILE));
 	    }
 	}
     skip:
@@ -1851,11 +3079,11 @@ static void socket_handler(int fd)
 	break;
 
     case MAGIC_SHOW_MSG:
-	if (magic[1] != '\002' || !arg) {
+	if (!arg) {
 	    errno = EINVAL;
 	    enqry = ANSWER_NCK;
 	    safeout(fd, enqry, strlen(enqry)+1, SSIZE_MAX);
-	    goto out;
+	    return REQ_FAILED;
 	}
 	if (*arg) {
 	    char *logmsg;
@@ -1866,13 +3094,15 @@ static void socket_handler(int fd)
 		/* 1. Write to /var/log/boot.log */
 		copylog(logmsg, l);
 		flushlog();
+		follow(logmsg, l);
+		follow_flush();
 
 		/* 2. Write to all active physical screens */
 		list_for_each_entry(c, &lcons, node) {
 		    if (c->fd < 0 || FD_ISSET(c->fd, &blocked))
 			continue;
 		    if (!console_silent)
-			c->out(c->fd, logmsg, l, c->max_canon);
+			consout(c, logmsg, l);
 		}
 		free(logmsg);
 	    }
@@ -1881,6 +3111,67 @@ static void socket_handler(int fd)
 	safeout(fd, enqry, strlen(enqry)+1, SSIZE_MAX);
 	break;
 
+    case MAGIC_STATS:
+	stats_answer(fd);
+	break;
+
+    case MAGIC_LOG: {
+	uint64_t pos;
+
+	if (!arg || log_batch(arg, alen, &pos) < 0) {
+	    errno = EINVAL;
+	    warn("Got invalid log request");
+	    enqry = ANSWER_NCK;
+	    safeout(fd, enqry, strlen(enqry)+1, SSIZE_MAX);
+	    return REQ_FAILED;
+	}
+	if (!pos)				/* Ring is full */
+	    enqry = ANSWER_NCK;
+	else if (!flog || nsigsys)		/* Kept until the log file is writable */
+	    enqry = ANSWER_ENQ;
+	else {
+	    deferred = pos;
+	    return REQ_DEFER;
+	}
+	safeout(fd, enqry, strlen(enqry)+1, SSIZE_MAX);
+	break;
+    }
+
+    case MAGIC_TRACE:
+	trace_answer(fd);
+	break;
+
+    case MAGIC_SYNC:				/* Barrier for all captured so far */
+	if (fdread >= 0)
+	    epoll_console_in(fdread);		/* Written before the request */
+	if (fdfifo >= 0)
+	    epoll_fifo_in(fdfifo);
+	if (!flog || nsigsys)
+	    enqry = ANSWER_ENQ;			/* Kept until the log file is writable */
+	else if ((deferred = storedlog()) > syncedlog())
+	    return REQ_DEFER;
+	else
+	    enqry = ANSWER_ACK;
+	safeout(fd, enqry, strlen(enqry)+1, SSIZE_MAX);
+	break;
+
+    case MAGIC_DUMP:
+	switch (dump_answer(fd)) {
+	case 1:					/* Sent by epoll_dump_out */
+	    return REQ_TAKEN;
+	case -1:
+	    return REQ_FAILED;
+	default:
+	    break;
+	}
+	break;
+
+    case MAGIC_FOLLOW:				/* The connection is handed to follow.c */
+	enqry = ANSWER_ACK;
+	safeout(fd, enqry, strlen(enqry)+1, SSIZE_MAX);
+	follow_add(fd);
+	return REQ_TAKEN;
+
     case MAGIC_HIDE_MSG:
 	/* * No-Op for the screen. We intentionally ignore the text payload 
 	 * because line-based consoles (like s390x 3215) cannot clear lines.
@@ -1897,6 +3188,389 @@ static void socket_handler(int fd)
 
 	break;
     }
+
+    return REQ_DONE;
+}
+
+/*
+ * A control connection starting with MAGIC_SESSION is kept open for
+ * more requests.  The requests may follow without waiting on the
+ * answers, they are collected in the buffer of the session and answered
+ * in order.  A session ends if the client closes it, on an invalid
+ * request, after SESSION_IDLE milli seconds without a request, or if a
+ * password prompt or a change of the root takes the connection.  The
+ * same buffer collects a single request arriving in pieces on a plain
+ * connection, which then has FRAME_TIMEOUT milli seconds per piece.
+ */
+static void session_release(session_t *s)
+{
+    timeout_del(&s->idle);
+    delete(&s->node);
+    if (s->buf != s->base)
+	free(s->buf);
+    slab_free(&session_slab, s);
+}
+
+static void session_close(session_t *s)
+{
+    epoll_delete(s->fd);
+    close(s->fd);
+    session_release(s);
+}
+
+static void session_timeout(timeout_t *t)
+{
+    session_close(list_entry(t, session_t, idle));
+}
+
+/*
+ * The answer waits on the sync of the log, the session does not take
+ * further requests until then to keep the order of the answers
+ */
+static void session_defer(session_t *s)
+{
+    int fd;
+
+    s->pos = deferred;
+    s->errors = logstats.errors;
+    timeout_del(&s->idle);
+    epoll_delete(s->fd);
+    if ((fd = waitlog(s->pos)) >= 0 && logsync_fd < 0) {
+	logsync_fd = fd;
+	epoll_addread(fd, &epoll_log_synced);
+    }
+    timeout_add(&logsync_timer, LOGSYNC_RETRY);
+}
+
+static int session_parse(session_t *s);
+
+/*
+ * Answer the sessions waiting on their lines of the log
+ */
+static void session_durable(void)
+{
+    const uint64_t pos = syncedlog();
+    session_t *s, *n;
+    int waiting = 0;
+
+    list_for_each_entry_safe(s, n, &sessions, node) {
+	const char *answer;
+
+	if (!s->pos)
+	    continue;
+	if (!flog || nsigsys)
+	    answer = ANSWER_ENQ;		/* Only in the ring */
+	else if (s->pos <= pos)
+	    answer = (s->errors == logstats.errors) ? ANSWER_ACK : ANSWER_NCK;
+	else {
+	    (void)waitlog(s->pos);
+	    waiting++;
+	    continue;
+	}
+	safeout(s->fd, answer, strlen(answer)+1, SSIZE_MAX);
+	s->pos = 0;
+	if (s->once) {
+	    session_close(s);
+	    continue;
+	}
+	timeout_add(&s->idle, SESSION_IDLE);
+	epoll_addread(s->fd, &epoll_session_in);
+	(void)session_parse(s);
+    }
+    if (waiting)
+	timeout_add(&logsync_timer, LOGSYNC_RETRY);
+}
+
+static void epoll_log_synced(int fd)
+{
+    uint64_t cnt;
+
+    while (read(fd, &cnt, sizeof(cnt)) < 0 && errno == EINTR)
+	;
+    session_durable();
+}
+
+static void logsync_timeout(timeout_t *t)
+{
+    (void)t;
+    session_durable();
+}
+
+/*
+ * Answer the complete requests in the buffer of the session, a large
+ * extended frame is collected on the heap.  Returns -1 if the session
+ * is gone.
+ */
+static int session_parse(session_t *s)
+{
+    size_t off = 0, want = 0;
+
+    while (s->fill > off) {
+	const unsigned char *req = &s->buf[off];
+	size_t hlen = 0, alen = 0;
+	char *arg = NULL;
+	ssize_t need;
+	int ret;
+
+	if ((need = frame_size(req, s->fill - off, &hlen)) < 0) {
+	    const char *nack = ANSWER_NCK;
+
+	    safeout(s->fd, nack, strlen(nack)+1, SSIZE_MAX);
+	    errno = EMSGSIZE;
+	    warn("Got invalid request on control session");
+	    session_close(s);
+	    return -1;
+	}
+	if (need == 0 || (size_t)need > s->fill - off) {
+	    want = (size_t)need;		/* Not yet complete */
+	    break;
+	}
+
+	if (hlen > 2) {				/* Always terminated */
+	    alen = (size_t)need - hlen;
+	    arg = (alen < message_slab.size) ? slab_alloc(&message_slab) : malloc(alen + 1);
+	    if (!arg)
+		error("can not allocate request");
+	    memcpy(arg, &req[hlen], alen);
+	    arg[alen] = '\0';
+	}
+	off += (size_t)need;
+	if (!s->once)
+	    stats.requests++;
+
+	ret = socket_request(s->fd, req, (size_t)need, arg, alen, s->pid);
+	if (arg) {
+	    if (alen < message_slab.size)
+		slab_free(&message_slab, arg);
+	    else
+		free(arg);
+	}
+	if (ret == REQ_TAKEN && (req[0] == MAGIC_ASK_PWD || req[0] == MAGIC_QUESTION)) {
+	    timeout_del(&s->idle);		/* Resumed after the answer */
+	    pwwaiter_session(s->fd, s);
+	    break;
+	}
+	if (ret == REQ_TAKEN) {			/* The connection is not ours anymore */
+	    session_release(s);
+	    return -1;
+	}
+	if (ret == REQ_DEFER) {
+	    session_defer(s);
+	    break;
+	}
+	if (ret == REQ_FAILED) {
+	    session_close(s);
+	    return -1;
+	}
+	if (s->once) {				/* The first request of a plain connection */
+	    if (req[0] == MAGIC_SESSION) {
+		stats.sessions++;
+		timeout_add(&s->idle, SESSION_IDLE);
+	    } else if (ret == REQ_DONE) {
+		session_close(s);
+		return -1;
+	    }
+	    s->once = 0;
+	}
+    }
+
+    if (off) {
+	s->fill -= off;
+	memmove(&s->buf[0], &s->buf[off], s->fill);
+    }
+    if (want > s->size) {
+	unsigned char *buf = (s->buf == s->base) ? malloc(want) : realloc(s->buf, want);
+
+	if (!buf)
+	    error("can not allocate request");
+	if (s->buf == s->base)
+	    memcpy(buf, s->base, s->fill);
+	s->buf = buf;
+	s->size = want;
+    } else if (s->buf != s->base && s->fill <= sizeof(s->base) && want <= sizeof(s->base)) {
+	memcpy(s->base, s->buf, s->fill);
+	free(s->buf);
+	s->buf = s->base;
+	s->size = sizeof(s->base);
+    }
+    return 0;
+}
+
+/*
+ * The answer of a password request is sent, the requests which have
+ * followed it are answered on the next round
+ */
+static void session_resume(session_t *s)
+{
+    if (s->once) {
+	session_close(s);
+	return;
+    }
+    timeout_add(&s->idle, SESSION_IDLE);
+    epoll_addread(s->fd, &epoll_session_in);
+    if (s->fill)
+	epoll_again(s->fd);
+}
+
+static session_t *session_open(int fd, pid_t pid, const unsigned char *rest, size_t len)
+{
+    session_t *s = slab_alloc(&session_slab);
+
+    s->fd = fd;
+    s->pid = pid;
+    s->buf = s->base;
+    s->size = sizeof(s->base);
+    s->pos = 0;
+    s->once = 0;
+    s->fill = len;
+    if (len)				/* Requests sent along with MAGIC_SESSION */
+	memcpy(s->base, rest, len);
+    timeout_init(&s->idle, &session_timeout);
+    timeout_add(&s->idle, SESSION_IDLE);
+    insert(&s->node, &sessions);
+    epoll_delete(fd);
+    epoll_addread(fd, &epoll_session_in);
+    if (len)
+	(void)session_parse(s);
+    return s;
+}
+
+static void epoll_session_in(int fd)
+{
+    session_t *s = NULL, *p;
+    ssize_t cnt;
+
+    list_for_each_entry(p, &sessions, node) {
+	if (p->fd == fd) {
+	    s = p;
+	    break;
+	}
+    }
+    if (!s) {
+	epoll_delete(fd);
+	close(fd);
+	return;
+    }
+
+    do {
+	cnt = read(fd, &s->buf[s->fill], s->size - s->fill);
+    } while (cnt < 0 && errno == EINTR);
+    if (cnt < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+	if (s->fill)				/* Left by a resumed session */
+	    (void)session_parse(s);
+	return;
+    }
+    if (cnt <= 0) {				/* Closed by the client */
+	session_close(s);
+	return;
+    }
+    s->fill += (size_t)cnt;
+    timeout_add(&s->idle, s->once ? FRAME_TIMEOUT : SESSION_IDLE);
+
+    (void)session_parse(s);
+}
+
+static void socket_handler(int fd)
+{
+    struct ucred cred = {};
+    unsigned char buf[FRAME_HEADER+MESSAGE_SIZE], *req = buf;
+    size_t got = 0, hlen = 0;
+    session_t *s;
+    char *arg = NULL;
+    socklen_t clen;
+    ssize_t need;
+    int ret = -1;
+
+    if (fd < 0) {
+	errno = EBADFD;
+	warn("%s no connection jet", __FUNCTION__);
+	goto out;
+    }
+
+    clen = sizeof(struct ucred);
+    ret = getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &clen);
+    if (ret < 0) {
+	list_fd(getpid());
+	warn("can not get credentials from UNIX socket part1");
+	goto out;
+    }
+    if (clen != sizeof(struct ucred)) {
+	list_fd(getpid());
+	list_fd(cred.pid);
+	warn("can not get credentials from UNIX socket part2");
+	goto out;
+    }
+    if (cred.uid != 0 && !(sandbox() && cred.uid == geteuid())) {
+	const char *nack = ANSWER_NCK;
+	char *exe;
+
+	safeout(fd, nack, strlen(nack)+1, SSIZE_MAX);
+
+	exe = proc2exe(cred.pid);
+
+	errno = EACCES;
+	if (exe) {
+	    warn("Connection from %s of user %lu", exe, (unsigned long)cred.uid);
+	    free(exe);
+	} else
+	    warn("Connection from pid %lu user %lu", (unsigned long)cred.pid, (unsigned long)cred.uid);
+
+	goto out;
+    }
+
+    /*
+     * Mostly the whole request is read at once, the rest of a larger
+     * frame or of a slow client is collected by a session which answers
+     * the request and then ends the connection.  The socket is non
+     * blocking, nothing here does wait on the client.
+     */
+    do {
+	ret = recv(fd, buf, sizeof(buf) - 1, 0);
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	goto job;
+    if (ret <= 0) {
+	warn("can not read request from UNIX socket");
+	goto out;
+    }
+    got = (size_t)ret;
+    if ((need = frame_size(req, got, &hlen)) >= 0 && (need == 0 || (size_t)need > got)) {
+	s = session_open(fd, cred.pid, req, got);
+	s->once = 1;
+	timeout_add(&s->idle, FRAME_TIMEOUT);
+	goto job;
+    }
+    if (need < 0) {
+	const char *nack = ANSWER_NCK;
+
+	safeout(fd, nack, strlen(nack)+1, SSIZE_MAX);
+	errno = EMSGSIZE;
+	warn("Got invalid request on UNIX socket");
+	goto out;
+    }
+    if (hlen > 2) {
+	arg = (char*)&req[hlen];
+	req[need] = '\0';			/* Always terminated */
+    }
+
+    switch (socket_request(fd, req, (size_t)need, arg, arg ? (size_t)need - hlen : 0, cred.pid)) {
+    case REQ_DONE:
+	if (req[0] != MAGIC_SESSION)
+	    break;
+	stats.sessions++;
+	(void)session_open(fd, cred.pid, &req[need], got - (size_t)need);
+	goto job;
+    case REQ_DEFER:				/* A session for the deferred answer only */
+	s = session_open(fd, cred.pid, NULL, 0);
+	s->once = 1;
+	session_defer(s);
+	goto job;
+    case REQ_KEEP:
+    case REQ_TAKEN:
+	goto job;
+    default:
+	break;
+    }
 out:			/* We are done */
     if (fd >= 0) {
 	epoll_delete(fd);
@@ -1904,8 +3578,6 @@ out:			/* We are done */
     	fd = -1;
     }
 job:			/* Do not close connection for reply */
-    if (arg)
-	free(arg);
     return;
 }
 
@@ -1914,7 +3586,22 @@ job:			/* Do not close connection for reply */
  */
 void epoll_write_watchdog(int fd)
 {
+    struct console *c;
+
     FD_CLR(fd, &blocked);
+    list_for_each_entry(c, &lcons, node) {
+	if (c->fd != fd)
+	    continue;
+	if (c->since) {
+	    const uint64_t blocked = latency_now() - c->since;
+	    trace(TRACE_UNBLOCKED, fd, 0, blocked);
+	    c->blocked += blocked;
+	    c->since = 0;
+	}
+	if (c->budget)
+	    backlog_flush(c);
+	break;
+    }
 }
 
 /*
@@ -1925,7 +3612,7 @@ static void ask_for_password(void)
 {
     struct console *c;
     size_t len;
-    int any_running = 0;
+    int any_running = 0, done = 0;
 
     if (!pwprompt || !*pwprompt)
 	return;
@@ -1944,10 +3631,16 @@ static void ask_for_password(void)
     set_signal(SIGCHLD, NULL, chld_handler);
 #endif
     asking = ask_mode;			/* Show only our question about password/passphrase */
+    stats.prompts++;
+    stats.pwstart = latency_now();
+    if (PROBE_ENABLED(password_start))
+	PROBE2(password_start, pwprompt, asking);
 
     /* pwprompt */
     list_for_each_entry(c, &lcons, node) {
 	int pfd;
+	if (done)
+	    break;
 	if (c->fd < 0 || !c->tty)
 	    continue;
 	(void)tcdrain(c->fd);
@@ -1982,8 +3675,6 @@ static void ask_for_password(void)
 		close(fdsock);
 	    if (flog)
 		(void)fclose(flog);
-	    if (pwd_client_fd >= 0)
-		close(pwd_client_fd);
 	    if (epfd) {
 		epoll_close_fd(c->fd);	/* We keep c->fd */
 		close(epfd);
@@ -2101,11 +3792,11 @@ static void ask_for_password(void)
 
 	    if (c->flags & CON_CONSDEV) {
 		int wait = 200;
-		while (wait > 0 && (len = klogctl(SYSLOG_ACTION_SIZE_UNREAD, NULL, 0)) > 0) {
+		while (wait > 0 && (len = sandbox_klogctl(SYSLOG_ACTION_SIZE_UNREAD, NULL, 0)) > 0) {
 		    usleep(1000);
 		    wait--;
 		}
-		klogctl(SYSLOG_ACTION_CONSOLE_OFF, NULL, 0);
+		sandbox_klogctl(SYSLOG_ACTION_CONSOLE_OFF, NULL, 0);
 	    }
 	again:
 	    clear_input(0);
@@ -2267,13 +3958,8 @@ static void ask_for_password(void)
 			struct console *d;
 			
 			asking = 0;
-			if (pwd_client_fd >= 0) {
-			    (void)do_answer_password(pwd_client_fd);
-			    epoll_delete(pwd_client_fd);
-			    close(pwd_client_fd);
-			    pwd_client_fd = -1;
-			}
-			klogctl(SYSLOG_ACTION_CONSOLE_ON, NULL, 0);
+			done = 1;
+			sandbox_klogctl(SYSLOG_ACTION_CONSOLE_ON, NULL, 0);
 			c->pid = -1;
 			
 			/* Terminate all other password asking children for syncronious mode */
@@ -2299,20 +3985,10 @@ static void ask_for_password(void)
 	if (c->pid > 0)
 	    any_running = 1;
     }
-    if (asking && !any_running) {
+    if (done)
+	pwreq_done(1);
+    else if (asking && !any_running) {
 	asking = 0;
-	if (coldstart_active && coldstart_socket_path) {
-	    free(coldstart_socket_path);
-	    coldstart_socket_path = NULL;
-	}
-	if (pwd_client_fd >= 0) {
-	    const char *enq = ANSWER_ENQ;
-	    safeout(pwd_client_fd, enq, strlen(enq)+1, SSIZE_MAX);
-	    epoll_delete(pwd_client_fd);
-	    close(pwd_client_fd);
-	    pwd_client_fd = -1;
-	}
-	if (coldstart_active)
-	    coldstart_next();
+	pwreq_done(0);
     }
 }
@@ -62,7 +62,7 @@ char *charname(const char *str)
 	error("can not scan %s: %m", str);
     dev = makedev(maj, min);
 
-    if (nftw("/dev", find_chardevice, 10, FTW_PHYS) < 0)
+    if (nftw(sandbox_path("/dev"), find_chardevice, 10, FTW_PHYS) < 0)
 	error("can not follow tree below /dev: %m");
 
     return name;
@@ -72,7 +72,7 @@ char *chardev(const dev_t cons)
 {
     dev = cons;
 
-    if (nftw("/dev", find_chardevice, 10, FTW_PHYS) < 0)
+    if (nftw(sandbox_path("/dev"), find_chardevice, 10, FTW_PHYS) < 0)
 	error("can not follow tree below /dev: %m");
 
     return name;
@@ -15,7 +15,6 @@
 #include <sys/epoll.h>
 #include <unistd.h>
 #include <errno.h>
-#include "listing.h"
 #include "libconsole.h"
 
 /*
@@ -24,50 +23,90 @@
 extern int epfd;
 extern int evmax;
 
-static list_t lpolls = { &(lpolls), &(lpolls) };
+/*
+ * The registrations are indexed by their file descriptor, the
+ * epoll data points directly to the registration, therefore no
+ * list walk is required on dispatching events.  A deleted registration
+ * may still be referenced by events of the current epoll_pwait(2)
+ * round, hence it is only marked as dead and put on the graveyard
+ * which is released by epoll_collect() before the next round.
+ */
 static struct epolls {
-    list_t watch;
     void (*handle)(int);
     int fd;
-} *epolls;
+    struct epolls *next;		/* Graveyard */
+    struct epolls *again;		/* Re-dispatch queue */
+    int queued;
+} **epolls, *graveyard, *again;
+static int nepolls;
+static slab_t epoll_slab;
+
+#ifndef SLAB_EPOLLS
+# define SLAB_EPOLLS	64
+#endif
+
+static struct epolls *epoll_slot(int fd)
+{
+    if (fd < 0)
+	return NULL;
+    if (fd >= nepolls) {
+	int size = nepolls ? nepolls : 64;
+	struct epolls **table;
+
+	while (size <= fd)
+	    size <<= 1;
+	table = realloc(epolls, size * sizeof(struct epolls*));
+	if (!table)
+	    error("memory allocation");
+	memset(&table[nepolls], 0, (size - nepolls) * sizeof(struct epolls*));
+	epolls = table;
+	nepolls = size;
+    }
+    return epolls[fd];
+}
+
+static struct epolls *epoll_new(int fd, void *fptr)
+{
+    struct epolls *ep;
+
+    slab_init(&epoll_slab, "epoll", sizeof(struct epolls), SLAB_EPOLLS);
+    ep = slab_alloc(&epoll_slab);
+
+    ep->handle = (typeof(ep->handle))fptr;
+    ep->fd = fd;
+    ep->next = NULL;
+    ep->again = NULL;
+    ep->queued = 0;
+    epolls[fd] = ep;
+    evmax++;
+
+    return ep;
+}
 
 static inline void epoll_addition(int fd, void *fptr, uint32_t flags)
 {
     struct epoll_event ev = {};
     struct epolls *ep;
-    list_t *head;
     int ret;
 
     ev.events = flags;
 
     /* Prevent EEXIST crash: If fd is already registered, just modify it */
-    list_for_each_entry(ep, &lpolls, watch) {
-	if (ep->fd == fd) {
-	    ep->handle = (typeof(ep->handle))fptr;
-	    ev.data.ptr = (void*)ep;
-	    ret = epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
-	    if (ret < 0)
-		error("can not modify %d file descriptor on epoll file descriptor", fd);
-	    return;
-	}
+    if ((ep = epoll_slot(fd))) {
+	ep->handle = (typeof(ep->handle))fptr;
+	ev.data.ptr = (void*)ep;
+	ret = epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+	if (ret < 0)
+	    error("can not modify %d file descriptor on epoll file descriptor", fd);
+	return;
     }
 
-    if (posix_memalign((void**)&ep, sizeof(void*), align_up(struct epolls, void*)) != 0 || !ep)
-	error("memory allocation");
-
-    ep->handle = (typeof(ep->handle))fptr;
-    ep->fd = fd;
+    if (fd < 0)
+	error("can not add %d file descriptor on epoll file descriptor", fd);
+    ep = epoll_new(fd, fptr);
 
     ev.data.ptr = (void*)ep;
 
-    if (!epolls) {
-	head = &lpolls;
-	epolls = (struct epolls*)head;
-    } else
-	head = &epolls->watch;
-    insert(&ep->watch, head);
-    evmax++;
-
     ret = epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
     if (ret < 0)
 	error("can not add %d file descriptor on epoll file descriptor", fd);
@@ -78,6 +117,18 @@ void epoll_addread(int fd, void *fptr)
     epoll_addition(fd, fptr, EPOLLIN|EPOLLPRI|EPOLLRDHUP);
 }
 
+void epoll_addedge(int fd, void *fptr)
+{
+    /* Edge triggered, the handler has to drain the file descriptor */
+    epoll_addition(fd, fptr, EPOLLIN|EPOLLPRI|EPOLLRDHUP|EPOLLET);
+}
+
+void epoll_addhangup(int fd, void *fptr)
+{
+    /* Data is left to whom the connection is given back later */
+    epoll_addition(fd, fptr, EPOLLRDHUP);
+}
+
 void epoll_addsysfs(int fd, void *fptr)
 {
     /* ONLY wait for exceptions (EPOLLPRI|EPOLLERR), never for EPOLLIN! */
@@ -92,33 +143,13 @@ void epoll_addwrite(int fd, void *fptr)
 void epoll_answer_once(int fd, void *fptr)
 {
     struct epoll_event ev = {};
-    struct epolls *ep, *target = NULL;
+    struct epolls *target;
     int ret;
 
-    list_for_each_entry(ep, &lpolls, watch) {
-	if (ep->fd == fd) {
-	    target = ep;
-	    break;
-	}
-    }
-
-    if (!target) {
-	list_t *head;
-
-	if (posix_memalign((void**)&ep, sizeof(void*), align_up(struct epolls, void*)) != 0 || !ep)
-	    error("memory allocation");
-
-	ep->fd = fd;
-    
-	if (!epolls) {
-	    head = &lpolls;
-	    epolls = (struct epolls*)head;
-	} else
-	    head = &epolls->watch;
-	insert(&ep->watch, head);
-	evmax++;
-
-	target = ep;
+    if (!(target = epoll_slot(fd))) {
+	if (fd < 0)
+	    error("can not modify %d file descriptor on epoll file descriptor", fd);
+	target = epoll_new(fd, fptr);
     }
 
     ev.events = EPOLLOUT|EPOLLONESHOT;
@@ -137,29 +168,36 @@ void epoll_reenable(int fd)
 
     ev.events = EPOLLOUT|EPOLLONESHOT;
 
-    list_for_each_entry(ep, &lpolls, watch) {
-	if (ep->fd == fd) {
-	    int ret;
-	    ev.data.ptr = (void*)ep;
-	    ret = epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
-	    if (ret < 0)
-		error("can not add %d file descriptor on epoll file descriptor", fd);
-	    break;
-	}
+    if ((ep = epoll_slot(fd))) {
+	int ret;
+	ev.data.ptr = (void*)ep;
+	ret = epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+	if (ret < 0)
+	    error("can not add %d file descriptor on epoll file descriptor", fd);
     }
 }
 
 void epoll_delete(int fd)
 {
-    struct epolls *ep, *n;
+    struct epolls *ep;
     int ret;
 
-    list_for_each_entry_safe(ep, n, &lpolls, watch) {
-	if (ep->fd == fd) {
-	    delete(&ep->watch);
-	    free(ep);
-	    evmax--;
+    if ((ep = epoll_slot(fd))) {
+	if (ep->queued) {
+	    struct epolls **prev = &again;
+	    while (*prev && *prev != ep)
+		prev = &(*prev)->again;
+	    if (*prev) {		/* Otherwise within epoll_redispatch() */
+		*prev = ep->again;
+		ep->queued = 0;
+	    }
 	}
+	epolls[fd] = NULL;
+	ep->handle = NULL;		/* Events of this round are dropped */
+	ep->fd = -1;
+	ep->next = graveyard;
+	graveyard = ep;
+	evmax--;
     }
 
     ret = epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
@@ -169,29 +207,78 @@ void epoll_delete(int fd)
     }
 }
 
-void (*epoll_handle(void *ptr, int *fd))(int)
+/* Release deleted registrations, call this before epoll_pwait(2) */
+void epoll_collect(void)
 {
-    struct epolls *ep;
-    void (*handle)(int) = NULL;
+    while (graveyard) {
+	struct epolls *ep = graveyard;
+	graveyard = ep->next;
+	slab_free(&epoll_slab, ep);
+    }
+}
+
+/*
+ * An edge triggered handler which stops before EAGAIN to give other
+ * sources their turn does not get a new edge for the data left, hence
+ * it queues its file descriptor to be called again after the next round.
+ */
+void epoll_again(int fd)
+{
+    struct epolls *ep, **tail;
+
+    if (!(ep = epoll_slot(fd)) || ep->queued)
+	return;
+    for (tail = &again; *tail; tail = &(*tail)->again)
+	;
+    ep->again = NULL;
+    ep->queued = 1;
+    *tail = ep;
+}
+
+/* Non zero if handlers are queued, epoll_pwait(2) should not block then */
+int epoll_pending(void)
+{
+    return again != NULL;
+}
 
-    list_for_each_entry(ep, &lpolls, watch) {
-	if (ep == ptr) {
-	    handle = ep->handle;
-	    *fd = ep->fd;
-	    break;
+/* Call the queued handlers once, these may queue themselves again */
+void epoll_redispatch(void)
+{
+    struct epolls *ep = again;
+
+    again = NULL;
+    while (ep) {
+	struct epolls *next = ep->again;
+
+	ep->again = NULL;
+	ep->queued = 0;
+	if (ep->handle) {
+	    const uint64_t start = latency_now();
+	    void (*handle)(int) = ep->handle;
+	    handle(ep->fd);
+	    latency_account(handle, start);
 	}
+	ep = next;
     }
+}
 
-    return handle;
+void (*epoll_handle(void *ptr, int *fd))(int)
+{
+    struct epolls *ep = (struct epolls*)ptr;
+
+    if (!ep || !ep->handle)
+	return NULL;
+    *fd = ep->fd;
+    return ep->handle;
 }
 
 /* Only usefull within forked sub processes */
 void epoll_close_fd(int keep_fd)
 {
-    struct epolls *ep;
+    int fd;
 
-    list_for_each_entry(ep, &lpolls, watch) {
-	if (ep->fd >= 0 && ep->fd != keep_fd)
-	    close(ep->fd);
+    for (fd = 0; fd < nepolls; fd++) {
+	if (epolls[fd] && fd != keep_fd)
+	    close(fd);
     }
 }
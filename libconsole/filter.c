@@ -0,0 +1,404 @@
+/*
+ * filter.c - Per console output filters for blogd
+ *
+ * Copyright 2026 Werner Fink
+ * Copyright 2026 SUSE Software Solutions Germany GmbH
+ *
+ * This source is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <syslog.h>
+#include <sys/uio.h>
+#include "libconsole.h"
+
+/*
+ * Make sure the scratch buffer of a console holds at least len bytes
+ */
+char *filter_buffer(struct console *c, size_t len)
+{
+    if (len > c->fsize) {
+	size_t size = c->fsize ? c->fsize : TRANS_BUFFER_SIZE;
+	char *buf;
+
+	while (size < len)
+	    size <<= 1;
+	if (!(buf = realloc(c->fbuf, size)))
+	    error("can not allocate filter buffer for %s", c->tty);
+	c->fbuf = buf;
+	c->fsize = size;
+    }
+    return c->fbuf;
+}
+
+/*
+ * Strip all escape sequences (FILTER_STRIP) or all but the SGR colour
+ * sequences (FILTER_SGR) from the output of a console.  Sequences may
+ * be split over several chunks, therefore the pending sequence is
+ * kept within the console.  The output buffer has to provide room
+ * for len bytes plus the size of a pending sequence.
+ */
+size_t filter_ansi(struct console *c, const char *in, size_t len, char *out)
+{
+    char *o = out;
+
+    while (len-- > 0) {
+	const int ch = (unsigned char)*in++;
+
+	if (c->esc.state == ESnormal) {
+	    switch (ch) {
+	    case '\033':
+		c->esc.state = ESesc;
+		c->seq[0] = ch;
+		c->slen = 1;
+		break;
+	    case 14:
+	    case 15:				/* Charset shifts */
+		break;
+	    default:
+		*o++ = ch;
+		break;
+	    }
+	    continue;
+	}
+
+	if (c->slen < sizeof(c->seq))
+	    c->seq[c->slen] = ch;
+	c->slen++;
+
+	if (escape_step(&c->esc, ch) == ESC_NEWLINE) {
+	    *o++ = '\n';
+	    continue;
+	}
+	if (c->esc.state != ESnormal)
+	    continue;
+
+	if (c->filter == FILTER_SGR && ch == 'm' && c->seq[1] == '[' && c->slen <= sizeof(c->seq)) {
+	    memcpy(o, c->seq, c->slen);
+	    o += c->slen;
+	}
+	c->slen = 0;
+    }
+
+    return (size_t)(o - out);
+}
+
+/*
+ * Classify a line by its start, that is the kernel log level prefix
+ * <N>, the blogger markers <failed ...> or <done ...>, the systemd
+ * status [FAILED], [DEPEND], [ TIME ], [  OK  ], or the time stamp of
+ * kernel messages which had already passed the console log level.
+ * Escape sequences are skipped.  If the start of the line is not
+ * complete yet the line is not decided.
+ */
+#define PRIO_PEEK	16
+
+static int line_prio(const char *s, size_t n, int *decided)
+{
+    static const struct {
+	const char *tag;
+	int prio;
+    } tags[] = {
+	{ "<failed",	LOG_ERR },
+	{ "<notice",	LOG_NOTICE },
+	{ "<done",	LOG_INFO },
+	{ "<skipped",	LOG_INFO },
+	{ "<unused",	LOG_INFO },
+	{ "[FAILED]",	LOG_ERR },
+	{ "[DEPEND]",	LOG_WARNING },
+	{ "[ TIME ]",	LOG_WARNING },
+	{ "[  OK  ]",	LOG_INFO },
+	{ "blogd:",	LOG_WARNING },
+    };
+    escape_t esc = { ESnormal, 0 };
+    char vis[PRIO_PEEK+1];
+    size_t v = 0, i, t;
+
+    *decided = 0;
+    for (i = 0; i < n && v < PRIO_PEEK; i++) {
+	const int ch = (unsigned char)s[i];
+
+	if (esc.state != ESnormal) {
+	    if (escape_step(&esc, ch) == ESC_NEWLINE)
+		break;
+	    continue;
+	}
+	if (ch == '\n')
+	    break;
+	if (ch == '\033')
+	    esc.state = ESesc;
+	else if (ch >= ' ')
+	    vis[v++] = ch;
+    }
+    if (i < n || v >= PRIO_PEEK || n >= sizeof(((struct console*)0)->head))
+	*decided = 1;
+    vis[v] = '\0';
+
+    if (v >= 3 && vis[0] == '<' && vis[1] >= '0' && vis[1] <= '7' && vis[2] == '>')
+	return vis[1] - '0';
+    for (t = 0; t < sizeof(tags)/sizeof(tags[0]); t++) {
+	if (strncmp(vis, tags[t].tag, strlen(tags[t].tag)) == 0)
+	    return tags[t].prio;
+    }
+    if (v >= 3 && vis[0] == '[') {
+	for (i = 1; i < v && vis[i] == ' '; i++)
+	    ;
+	while (i < v && vis[i] >= '0' && vis[i] <= '9')
+	    i++;
+	if (i < v && i > 1 && vis[i] == '.')
+	    return LOG_WARNING;
+    }
+    return LOG_NOTICE;
+}
+
+/*
+ * Drop all lines with a lower priority than the minimum priority of
+ * the console.  This is done in place, the start of a not yet decided
+ * line is kept and put in front of the next chunk, therefore the
+ * buffer has to provide room for len bytes plus the size of the head.
+ */
+size_t filter_prio(struct console *c, char *buf, size_t len)
+{
+    char *in = buf, *out = buf, *end;
+
+    if (c->hlen) {
+	memmove(buf + c->hlen, buf, len);
+	memcpy(buf, c->head, c->hlen);
+	len += c->hlen;
+	c->hlen = 0;
+    }
+    end = buf + len;
+
+    while (in < end) {
+	const char *nl;
+	size_t n;
+
+	if (c->lprio < 0) {
+	    int decided;
+	    int prio = line_prio(in, (size_t)(end - in), &decided);
+
+	    if (!decided) {
+		c->hlen = (size_t)(end - in);
+		memcpy(c->head, in, c->hlen);
+		break;
+	    }
+	    c->lprio = prio;
+	}
+
+	nl = memchr(in, '\n', (size_t)(end - in));
+	n = nl ? (size_t)(nl - in) + 1 : (size_t)(end - in);
+	if (c->lprio <= c->prio) {
+	    if (out != in)
+		memmove(out, in, n);
+	    out += n;
+	}
+	in += n;
+	if (nl)
+	    c->lprio = -1;
+    }
+
+    return (size_t)(out - buf);
+}
+
+/*
+ * A start of line which does not come to an end, e.g. a prompt, is
+ * decided with what is there after a while, the rest of the line then
+ * follows this decision.  Returns the bytes put into buf.
+ */
+size_t filter_prio_flush(struct console *c, char *buf)
+{
+    const size_t len = c->hlen;
+    int decided;
+
+    if (!len)
+	return 0;
+    c->lprio = line_prio(c->head, len, &decided);
+    c->hlen = 0;
+    if (c->lprio > c->prio)
+	return 0;
+    memcpy(buf, c->head, len);
+    return len;
+}
+
+/*
+ * The input of a write which has failed is held and filtered again
+ * later, therefore the state left by the filters has to be taken back
+ */
+void filter_save(const struct console *c, filter_state_t *st)
+{
+    st->esc = c->esc;
+    st->slen = c->slen;
+    memcpy(st->seq, c->seq, c->slen < sizeof(c->seq) ? c->slen : sizeof(c->seq));
+    st->lprio = c->lprio;
+    st->hlen = c->hlen;
+    memcpy(st->head, c->head, c->hlen);
+}
+
+void filter_restore(struct console *c, const filter_state_t *st)
+{
+    c->esc = st->esc;
+    c->slen = st->slen;
+    memcpy(c->seq, st->seq, st->slen < sizeof(st->seq) ? st->slen : sizeof(st->seq));
+    c->lprio = st->lprio;
+    c->hlen = st->hlen;
+    memcpy(c->head, st->head, st->hlen);
+}
+
+/*
+ * Line wrap and carriage return translation for half duplex and fixed
+ * width consoles like the 3215, braille devices, or dumb terminals.
+ * A carriage return ends a non empty line, a CR LF pair becomes one
+ * line feed even if split over two chunks.  Lines longer than c->wrap
+ * are broken at the last space or at the limit.  The input is scanned
+ * forward once with memchr(3) and memrchr(3), nothing is copied as the
+ * result is a list of iovec pointing into the input or to a static line
+ * feed.  Returns the number of iovec used and advances the input.
+ */
+int filter_wrap(struct console *c, const char **ptr, size_t *len, struct iovec *iov, int max)
+{
+    static char lf[] = "\n";
+    const char *p = *ptr, *const end = p + *len;
+    int n = 0;
+
+#define PUT(b,l)	do { iov[n].iov_base = (void*)(b); iov[n].iov_len = (l); n++; } while (0)
+    while (p < end && n + 2 <= max) {
+	const size_t room = (size_t)c->wrap - c->col;
+	const size_t left = (size_t)(end - p);
+	const size_t win = left < room ? left : room;
+	const char *nl, *cr;
+
+	if (c->skiplf) {
+	    c->skiplf = 0;
+	    if (*p == '\n') {
+		p++;
+		continue;
+	    }
+	}
+
+	/* A line feed just after a full line does not break twice */
+	nl = memchr(p, '\n', left > room ? room + 1 : left);
+	cr = memchr(p, '\r', nl ? (size_t)(nl - p) : win);
+
+	if (cr) {
+	    if (cr > p || c->col) {
+		if (cr > p)
+		    PUT(p, cr - p);
+		PUT(lf, 1);
+		c->col = 0;
+	    }
+	    p = cr + 1;
+	    if (p == end)
+		c->skiplf = 1;
+	    else if (*p == '\n')
+		p++;
+	    continue;
+	}
+	if (nl) {
+	    PUT(p, nl - p + 1);
+	    c->col = 0;
+	    p = nl + 1;
+	    continue;
+	}
+	if (win < room) {			/* Input ends within the line */
+	    PUT(p, win);
+	    c->col += win;
+	    p += win;
+	    continue;
+	}
+
+	nl = memrchr(p, ' ', win);		/* Line is full */
+	if (nl && nl > p) {
+	    PUT(p, nl - p);
+	    p = nl + 1;
+	} else {
+	    PUT(p, win);
+	    p += win;
+	}
+	PUT(lf, 1);
+	c->col = 0;
+    }
+#undef PUT
+
+    *len -= (size_t)(p - *ptr);
+    *ptr = p;
+    return n;
+}
+
+/*
+ * Log levels by number or name
+ */
+static int prio_value(const char *val)
+{
+    static const char *names[] = {
+	"emerg", "alert", "crit", "err", "warning", "notice", "info", "debug"
+    };
+    int n;
+
+    if (val[0] >= '0' && val[0] <= '7' && val[1] == '\0')
+	return val[0] - '0';
+    for (n = 0; n < (int)(sizeof(names)/sizeof(names[0])); n++) {
+	if (strcasecmp(val, names[n]) == 0)
+	    return n;
+    }
+    return -1;
+}
+
+/*
+ * Select the default filters by the type of the console
+ * and apply the blog.console.<tty>.<option>=<value> settings
+ * of the kernel command line.
+ */
+void console_options(struct console *c)
+{
+    const char *name = c->tty;
+    char key[64];
+    char *val;
+
+    if (strncmp(name, "/dev/", 5) == 0)
+	name += 5;
+
+    if (c->flags & (CON_SERIAL|CON_3215|CON_BRL))
+	c->filter = FILTER_STRIP;
+
+    snprintf(key, sizeof(key), "console.%s.filter", name);
+    if ((val = value_cmdline(key))) {
+	if (strcasecmp(val, "raw") == 0)
+	    c->filter = FILTER_RAW;
+	else if (strcasecmp(val, "strip") == 0)
+	    c->filter = FILTER_STRIP;
+	else if (strcasecmp(val, "sgr") == 0)
+	    c->filter = FILTER_SGR;
+	else
+	    warn("unknown filter %s for %s", val, c->tty);
+    }
+
+    snprintf(key, sizeof(key), "console.%s.wrap", name);
+    if ((val = value_cmdline(key))) {
+	if (isinteger(val))
+	    c->wrap = atoi(val);
+	else
+	    warn("invalid columns %s for %s", val, c->tty);
+    }
+
+    snprintf(key, sizeof(key), "console.%s.speed", name);
+    if ((val = value_cmdline(key))) {
+	if (isinteger(val) && atoi(val) > 0)
+	    c->baud = (unsigned int)atoi(val);
+	else
+	    warn("invalid speed %s for %s", val, c->tty);
+    }
+
+    snprintf(key, sizeof(key), "console.%s.prio", name);
+    if ((val = value_cmdline(key))) {
+	int prio = prio_value(val);
+	if (prio < 0)
+	    warn("unknown priority %s for %s", val, c->tty);
+	else
+	    c->prio = prio;
+    }
+}
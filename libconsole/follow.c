@@ -0,0 +1,239 @@
+/*
+ * follow.c - Stream the input of blogd to subscribers on the control socket
+ *
+ * Copyright 2026 Werner Fink
+ * Copyright 2026 SUSE Software Solutions Germany GmbH
+ *
+ * This source is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "listing.h"
+#include "libconsole.h"
+
+/*
+ * All what blogd shows on the consoles or stores into the log is copied
+ * into a ring of FOLLOW_SIZE bytes.  A connection of a MAGIC_FOLLOW
+ * request becomes a follower which is sent the ring and then the new
+ * input, directly out of the ring without a further copy.  The position
+ * of the ring and of each follower is the absolute count of bytes.  A
+ * follower which does not take its data is waited on with EPOLLOUT and
+ * skipped for the new input, if it falls behind more than the ring it
+ * gets a marker with the bytes skipped instead.  Hence a slow follower
+ * never blocks the main loop nor other followers.
+ */
+#ifndef FOLLOW_SIZE
+# define FOLLOW_SIZE	65536
+#endif
+#ifndef SLAB_FOLLOWERS
+# define SLAB_FOLLOWERS	4
+#endif
+
+typedef struct follower_s {
+    list_t node;
+    int fd;
+    int blocked;		/* Waits on EPOLLOUT */
+    uint64_t pos;		/* Next byte of the ring to send */
+    uint64_t skipped;		/* Bytes not yet reported by a marker */
+    size_t mlen, moff;
+    char mark[64];
+} follower_t;
+
+followstats_t followstats;
+static char ring[FOLLOW_SIZE];
+static uint64_t fhead, flushed;
+static list_t followers = { &followers, &followers };
+static slab_t follower_slab;
+
+static void epoll_follow(int fd);
+
+void follow(const char *buf, size_t len)
+{
+    size_t off, first;
+
+    if (fhead + len - flushed > FOLLOW_SIZE && !list_empty(&followers))
+	follow_flush();				/* Push before it is overwritten */
+    fhead += len;
+    if (len > FOLLOW_SIZE) {		/* Only the tail survives */
+	buf += len - FOLLOW_SIZE;
+	len = FOLLOW_SIZE;
+    }
+    off = (size_t)((fhead - len) % FOLLOW_SIZE);
+    first = FOLLOW_SIZE - off;
+    if (first > len)
+	first = len;
+    memcpy(&ring[off], buf, first);
+    if (len > first)
+	memcpy(&ring[0], buf + first, len - first);
+}
+
+static void follow_drop(follower_t *f)
+{
+    epoll_delete(f->fd);
+    close(f->fd);
+    delete(&f->node);
+    slab_free(&follower_slab, f);
+    followstats.subscribers--;
+}
+
+/*
+ * Send the pending marker and the ring from the position of the follower.
+ * Returns 0 if all is sent, 1 if the socket is full, and -1 on error.
+ */
+static int follow_push(follower_t *f)
+{
+    while (1) {
+	struct msghdr msg = {};
+	struct iovec iov[3];
+	size_t off, len, done;
+	ssize_t ret;
+	int n = 0;
+
+	if (fhead - f->pos > FOLLOW_SIZE) {	/* Overwritten in the ring */
+	    f->skipped += fhead - FOLLOW_SIZE - f->pos;
+	    f->pos = fhead - FOLLOW_SIZE;
+	}
+	if (f->skipped && f->moff >= f->mlen) {
+	    f->mlen = snprintf(f->mark, sizeof(f->mark), "\n*** blogd: %llu bytes skipped ***\n",
+			       (unsigned long long)f->skipped);
+	    f->moff = 0;
+	    f->skipped = 0;
+	    followstats.gaps++;
+	}
+	if (f->moff < f->mlen) {
+	    iov[n].iov_base = &f->mark[f->moff];
+	    iov[n].iov_len = f->mlen - f->moff;
+	    n++;
+	}
+	len = (size_t)(fhead - f->pos);
+	off = (size_t)(f->pos % FOLLOW_SIZE);
+	if (len > FOLLOW_SIZE - off) {
+	    iov[n].iov_base = &ring[off];
+	    iov[n].iov_len = FOLLOW_SIZE - off;
+	    n++;
+	    iov[n].iov_base = &ring[0];
+	    iov[n].iov_len = len - (FOLLOW_SIZE - off);
+	    n++;
+	} else if (len) {
+	    iov[n].iov_base = &ring[off];
+	    iov[n].iov_len = len;
+	    n++;
+	}
+	if (!n)
+	    return 0;
+
+	msg.msg_iov = iov;
+	msg.msg_iovlen = n;
+	ret = sendmsg(f->fd, &msg, MSG_DONTWAIT|MSG_NOSIGNAL);
+	if (ret < 0) {
+	    if (errno == EINTR)
+		continue;
+	    if (errno == EAGAIN || errno == EWOULDBLOCK)
+		return 1;
+	    return -1;
+	}
+
+	done = (size_t)ret;
+	if (f->moff < f->mlen) {
+	    size_t m = f->mlen - f->moff;
+	    if (m > done)
+		m = done;
+	    f->moff += m;
+	    done -= m;
+	}
+	f->pos += done;
+	followstats.bytes += done;
+    }
+}
+
+/*
+ * Push to a follower, if its socket is full wait until it is writable
+ */
+static void follow_send(follower_t *f)
+{
+    switch (follow_push(f)) {
+    case 0:
+	if (f->blocked) {
+	    f->blocked = 0;
+	    epoll_addread(f->fd, &epoll_follow);
+	}
+	break;
+    case 1:
+	f->blocked = 1;
+	epoll_addwrite(f->fd, &epoll_follow);
+	break;
+    default:
+	follow_drop(f);
+	break;
+    }
+}
+
+/*
+ * Called after new input has been added by follow()
+ */
+void follow_flush(void)
+{
+    follower_t *f, *n;
+
+    flushed = fhead;
+    list_for_each_entry_safe(f, n, &followers, node) {
+	if (!f->blocked)
+	    follow_send(f);
+    }
+}
+
+/*
+ * The follower is writable again, or has closed its end
+ */
+static void epoll_follow(int fd)
+{
+    follower_t *f, *n;
+
+    list_for_each_entry_safe(f, n, &followers, node) {
+	char buf[64];
+	ssize_t ret;
+
+	if (f->fd != fd)
+	    continue;
+	if (f->blocked) {
+	    follow_send(f);
+	    break;
+	}
+	do {				/* Anything sent by the follower is ignored */
+	    ret = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+	} while (ret > 0 || (ret < 0 && errno == EINTR));
+	if (ret == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+	    follow_drop(f);
+	break;
+    }
+}
+
+/*
+ * A connection becomes a follower, it starts with the oldest byte of the ring
+ */
+void follow_add(int fd)
+{
+    follower_t *f;
+
+    slab_init(&follower_slab, "follower", sizeof(follower_t), SLAB_FOLLOWERS);
+    latency_register(&epoll_follow, "follow");
+
+    f = slab_alloc(&follower_slab);
+    memset(f, 0, sizeof(follower_t));
+    f->fd = fd;
+    f->pos = (fhead > FOLLOW_SIZE) ? fhead - FOLLOW_SIZE : 0;
+    insert(&f->node, &followers);
+    followstats.subscribers++;
+    followstats.total++;
+    epoll_addread(fd, &epoll_follow);
+    follow_send(f);
+}
@@ -0,0 +1,131 @@
+/*
+ * latency.c - Event loop latency instrumentation for blogd
+ *
+ * Copyright 2026 Werner Fink
+ * Copyright 2026 SUSE Software Solutions Germany GmbH
+ *
+ * This source is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "libconsole.h"
+
+/*
+ * Each handler dispatched by more_input() has a slot with the number
+ * of calls, the cumulative and maximal time, and a histogram of the
+ * times with log2 buckets of nano seconds.  The slots live in a named
+ * shared memory page, so blogctl can read them without a request to
+ * blogd.  A slot is written between two increments of its sequence
+ * count, a reader retries as long as the count is odd or has changed.
+ * If no shared memory is available the statistics are kept private.
+ * The count of slots in use is kept private as well, the one of the
+ * page is only written for the readers.
+ */
+static latency_page_t *page, local;
+static const void *handlers[LATENCY_SLOTS];
+static unsigned int nslots;
+
+static latency_page_t *latency_page(void)
+{
+    if (page)
+	return page;
+    if (!(page = shm_create(LATENCY_SHM, sizeof(latency_page_t))))
+	page = &local;
+    memset(page, 0, sizeof(latency_page_t));
+    page->magic = LATENCY_MAGIC;
+    page->version = LATENCY_VERSION;
+    strncpy(page->slot[0].name, "other", sizeof(page->slot[0].name)-1);
+    page->slots = nslots = 1;
+    return page;
+}
+
+/*
+ * Give the handler a name, handlers without are accounted as other
+ */
+void latency_register(const void *fptr, const char *name)
+{
+    latency_page_t *p = latency_page();
+    unsigned int n;
+
+    for (n = 1; n < nslots; n++) {
+	if (handlers[n] == fptr)
+	    return;
+    }
+    if (nslots >= LATENCY_SLOTS) {
+	warn("no latency slot left for %s", name);
+	return;
+    }
+    strncpy(p->slot[n].name, name, sizeof(p->slot[n].name)-1);
+    handlers[n] = fptr;
+    nslots = n + 1;
+    __atomic_store_n(&p->slots, nslots, __ATOMIC_RELEASE);
+}
+
+uint64_t latency_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * Account the time since start to the slot of the handler
+ */
+void latency_account(const void *fptr, uint64_t start)
+{
+    const uint64_t nsec = latency_now() - start;
+    latency_page_t *p = latency_page();
+    unsigned int n, bucket;
+    latency_t *l;
+
+    for (n = nslots - 1; n > 0; n--) {
+	if (handlers[n] == fptr)
+	    break;
+    }
+    l = &p->slot[n];
+
+    bucket = nsec ? 64 - __builtin_clzll(nsec) : 0;
+    if (bucket >= LATENCY_BUCKETS)
+	bucket = LATENCY_BUCKETS-1;
+
+    __atomic_store_n(&l->seq, l->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    l->calls++;
+    l->nsec += nsec;
+    if (nsec > l->max)
+	l->max = nsec;
+    l->hist[bucket]++;
+    __atomic_store_n(&l->seq, l->seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Take a consistent copy of a slot of the page of a running blogd
+ */
+int latency_read(const latency_page_t *p, unsigned int n, latency_t *copy)
+{
+    uint32_t seq;
+    int tries = 1000;
+
+    if (n >= LATENCY_SLOTS)
+	return -1;
+    do {
+	seq = __atomic_load_n(&p->slot[n].seq, __ATOMIC_ACQUIRE);
+	memcpy(copy, (const void*)&p->slot[n], sizeof(latency_t));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (!(seq & 1) && seq == __atomic_load_n(&p->slot[n].seq, __ATOMIC_RELAXED))
+	    return 0;
+    } while (--tries > 0);
+    return -1;
+}
+
+void latency_close(void)
+{
+    if (page && page != &local)
+	shm_remove(LATENCY_SHM);
+}
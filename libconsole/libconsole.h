@@ -12,6 +12,7 @@
 #include <err.h>
 #include <errno.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <signal.h>
 #include <sys/types.h>
@@ -99,6 +100,153 @@ extern void error (const char *fmt, ...) __attribute__((noreturn));
 #define MAGIC_CACHED_PWD	'c'
 #define MAGIC_ASK_PWD		'*'
 #define MAGIC_DETAILS		'!'	/* blogd does always spool log messages */
+#define MAGIC_STATS		'I'	/* Not known by plymouthd, blogd answers its counters */
+#define MAGIC_TRACE		'T'	/* Not known by plymouthd, blogd answers its trace ring */
+#define MAGIC_SESSION		'Z'	/* Not known by plymouthd, blogd keeps the connection for more requests */
+#define MAGIC_LOG		'G'	/* Not known by plymouthd, blogd writes the records to the log only */
+#define MAGIC_FOLLOW		'f'	/* Not known by plymouthd, blogd streams its input on the connection */
+#define MAGIC_DUMP		'd'	/* Not known by plymouthd, blogd answers the log ring not yet written */
+#define MAGIC_SYNC		'y'	/* Not known by plymouthd, blogd answers once the log is on the disk */
+
+/*
+ * A request is the magic character followed by a NUL, or in the framing
+ * of plymouthd by '\002', one byte length, and the argument.  The extended
+ * frame of blogd is a header with the magic, '\003', flags, the version,
+ * and the le32 length of the payload which may hold any bytes.
+ */
+#define FRAME_LEGACY		'\002'
+#define FRAME_EXTENDED		'\003'
+#define FRAME_VERSION		1
+#ifndef  FRAME_MAXIMUM
+# define FRAME_MAXIMUM		1048576
+#endif
+
+typedef struct frame_s {
+    unsigned char magic;
+    unsigned char type;		/* FRAME_EXTENDED */
+    unsigned char flags;	/* None defined yet */
+    unsigned char version;
+    uint32_t len;		/* Little endian */
+} attribute((packed)) frame_t;
+#define FRAME_HEADER		sizeof(frame_t)
+
+/*
+ * The payload of MAGIC_LOG is a batch of records, each of them this
+ * header followed by the tag and the text, both without NUL.  The
+ * answer is an acknowledge if the lines are on the disk, an enquiry
+ * if they wait in the ring for the log file, else a negative one.
+ */
+typedef struct logrec_s {
+    unsigned char prio;		/* 0 (emerg) up to 7 (debug) */
+    unsigned char tlen;		/* Length of the tag */
+    uint32_t len;		/* Little endian length of the text */
+} attribute((packed)) logrec_t;
+
+/*
+ * Escape sequence state machine shared by the log parser and the
+ * console output filters (see do_con_trol() in linux/drivers/tty/vt/vt.c).
+ * The caller handles ESnormal and enters ESesc on '\033', all
+ * other states are driven by escape_step().  A sequence is complete
+ * if the state is back to ESnormal after the step.
+ */
+enum {	ESnormal, ESesc, ESsquare, ESgetpars, ESgotpars, ESfunckey,
+	EShash, ESsetG0, ESsetG1, ESpercent, ESignore, ESnonstd,
+	ESpalette };
+#define NPAR 16
+#define ESC_NEWLINE	1	/* ESC E or ESC D do a line feed */
+
+typedef struct escape_s {
+    unsigned int state;
+    int npar;
+} escape_t;
+
+static inline int escape_step(escape_t *e, const int c)
+{
+    switch (e->state) {
+    case ESesc:
+	e->state = ESnormal;
+	switch (c) {
+	case '[':
+	    e->state = ESsquare;
+	    break;
+	case ']':
+	    e->state = ESnonstd;
+	    break;
+	case '%':
+	    e->state = ESpercent;
+	    break;
+	case 'E':
+	case 'D':
+	    return ESC_NEWLINE;
+	case '(':
+	    e->state = ESsetG0;
+	    break;
+	case ')':
+	    e->state = ESsetG1;
+	    break;
+	case '#':
+	    e->state = EShash;
+	    break;
+#ifdef BLOGD_EXT
+	case '^':				/* Boot log extension */
+	    e->state = ESignore;
+	    break;
+#endif
+	default:
+	    break;
+	}
+	break;
+    case ESnonstd:
+	if (c == 'P') {
+	    e->npar = 0;
+	    e->state = ESpalette;
+	} else
+	    e->state = ESnormal;
+	break;
+    case ESpalette:
+	if ((c>='0'&&c<='9') || (c>='A'&&c<='F') || (c>='a'&&c<='f')) {
+	    e->npar++;
+	    if (e->npar==7)
+		e->state = ESnormal;
+	} else
+	    e->state = ESnormal;
+	break;
+    case ESsquare:
+	e->npar = 0;
+	e->state = ESgetpars;
+	if (c == '[') {
+	    e->state = ESfunckey;
+	    break;
+	}
+	if (c == '?')
+	    break;
+	/* fall through */
+    case ESgetpars:
+	if (c==';' && e->npar<NPAR-1) {
+	    e->npar++;
+	    break;
+	} else if (c>='0' && c<='9')
+	    break;
+	/* fall through */
+    case ESgotpars:
+	e->state = ESnormal;
+	break;
+#ifdef BLOGD_EXT
+    case ESignore:				/* Boot log extension */
+	e->state = ESesc;
+	break;
+#endif
+    case ESpercent:
+    case ESfunckey:
+    case EShash:
+    case ESsetG0:
+    case ESsetG1:
+    default:
+	e->state = ESnormal;
+	break;
+    }
+    return 0;
+}
 
 struct console {
     list_t node;
@@ -110,6 +258,28 @@ struct console {
     ssize_t max_canon;
     ssize_t (*out)(int, const void *, size_t, ssize_t);
     struct termios ltio, otio, ctio;
+    unsigned int baud;		/* Line speed of the budget if not the one of the tty */
+    size_t budget;		/* Bytes of serial line time, 0 if unlimited */
+    char *back;			/* Backlog not yet accepted by the line */
+    size_t blen;
+    unsigned int skipped;	/* Lines dropped since last marker */
+    int midline;
+    char mark[64];		/* Rest of a marker not yet accepted by the line */
+    size_t mlen;
+    int filter;			/* Output filter, see filter.c */
+    escape_t esc;
+    char seq[32];		/* Pending escape sequence */
+    size_t slen;
+    int prio, lprio;		/* Minimum priority and the one of current line */
+    char head[64];		/* Not yet classified start of line */
+    size_t hlen;
+    int wrap;			/* Columns of a fixed width console or 0 */
+    size_t col;
+    int skiplf;
+    char *fbuf;			/* Scratch buffer of the filters */
+    size_t fsize;
+    uint64_t written, dropped;	/* Bytes, see MAGIC_STATS */
+    uint64_t blocked, since;	/* Nano seconds blocked and since when */
 };
 
 #define CON_PRINTBUFFER	(1)
@@ -134,6 +304,8 @@ extern volatile sig_atomic_t signaled;
 extern volatile sig_atomic_t sigchild;
 extern volatile sig_atomic_t nsigsys;
 extern volatile sig_atomic_t nsigio;
+extern volatile sig_atomic_t nsigwinch;
+extern volatile sig_atomic_t nsigusr1;
 extern volatile sig_atomic_t asking;
 
 extern void remember_arg0(volatile char *arg0);
@@ -149,7 +321,7 @@ extern void getconsoles(int io);
 extern void epoll_write_watchdog(int) attribute((noinline));
 
 /* chroot.c */
-extern void new_root(const char *root);
+extern int new_root(const char *root);
 
 /* coldstart.c */
 extern void scan_ask_directory(const char *dir_path);
@@ -167,14 +339,56 @@ extern void popd(void);
 
 /* epoll.c */
 extern void epoll_addread(int fd, void *fptr);
+extern void epoll_addedge(int fd, void *fptr);
+extern void epoll_addhangup(int fd, void *fptr);
 extern void epoll_addsysfs(int fd, void *fptr);
 extern void epoll_addwrite(int fd, void *fptr);
 extern void epoll_answer_once(int fd, void *fptr);
 extern void epoll_reenable(int fd);
 extern void epoll_delete(int fd);
+extern void epoll_collect(void);
+extern void epoll_again(int fd);
+extern int epoll_pending(void);
+extern void epoll_redispatch(void);
 extern void (*epoll_handle(void *ptr, int *fd))(int);
 extern void epoll_close_fd(int keep_fd);
 
+/* filter.c */
+#define FILTER_RAW	0	/* Pass all bytes */
+#define FILTER_STRIP	1	/* Strip escape sequences */
+#define FILTER_SGR	2	/* Strip all but colour sequences */
+#define PRIO_ALL	7	/* LOG_DEBUG, that is no line is dropped */
+extern char *filter_buffer(struct console *c, size_t len);
+extern size_t filter_ansi(struct console *c, const char *in, size_t len, char *out);
+extern size_t filter_prio(struct console *c, char *buf, size_t len);
+extern size_t filter_prio_flush(struct console *c, char *buf);
+typedef struct filter_state_s {	/* Taken back if the output is held */
+    escape_t esc;
+    char seq[32];
+    size_t slen;
+    int lprio;
+    char head[64];
+    size_t hlen;
+} filter_state_t;
+extern void filter_save(const struct console *c, filter_state_t *st);
+extern void filter_restore(struct console *c, const filter_state_t *st);
+#define WRAP_IOV	64
+struct iovec;
+extern int filter_wrap(struct console *c, const char **ptr, size_t *len, struct iovec *iov, int max);
+extern void console_options(struct console *c);
+
+/* follow.c */
+typedef struct followstats_s {
+    uint64_t subscribers;	/* Connected followers */
+    uint64_t total;		/* Followers ever connected */
+    uint64_t bytes;		/* Sent to the followers */
+    uint64_t gaps;		/* Markers sent to slow followers */
+} followstats_t;
+extern followstats_t followstats;
+extern void follow(const char *buf, size_t len);
+extern void follow_flush(void);
+extern void follow_add(int fd);
+
 /* frobnicate.c */
 extern void *frobnicate(void *in, const size_t len);
 
@@ -183,18 +397,93 @@ extern int can_read(int fd, const time_t msec);
 extern int can_write(int fd, const time_t msec);
 extern void clear_input(int fd);
 
+/* latency.c */
+#define LATENCY_SHM	"blogd.latency"
+#define LATENCY_MAGIC	0x626c6174	/* blat */
+#define LATENCY_VERSION	2
+#define LATENCY_BUCKETS	32		/* Bucket n counts times below 2^n nano seconds */
+#define LATENCY_SLOTS	24		/* The handlers of blogd and room for new ones */
+typedef struct latency_s {
+    char name[24];
+    uint32_t seq;
+    uint32_t reserved;
+    uint64_t calls;
+    uint64_t nsec;
+    uint64_t max;
+    uint64_t hist[LATENCY_BUCKETS];
+} latency_t;
+typedef struct latency_page_s {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots;
+    uint32_t reserved;
+    latency_t slot[LATENCY_SLOTS];
+} latency_page_t;
+extern void latency_register(const void *fptr, const char *name);
+extern uint64_t latency_now(void);
+extern void latency_account(const void *fptr, uint64_t start);
+extern int latency_read(const latency_page_t *p, unsigned int n, latency_t *copy);
+extern void latency_close(void);
+
 /* log.c */
+typedef struct logstats_s {
+    uint64_t size;		/* Of the log ring buffer */
+    uint64_t highwater;
+    uint64_t lost;		/* Bytes not fitting into the ring */
+    uint64_t written;		/* Bytes written to the log file */
+    uint64_t flushes, fsyncs;
+    uint64_t kmsg;		/* Bytes read from /dev/kmsg */
+    uint64_t errors;		/* Failed writes or syncs of the log file */
+    uint64_t injected;		/* Bytes of MAGIC_LOG */
+} logstats_t;
+extern logstats_t logstats;
 extern volatile sig_atomic_t nsigsys;
 extern void writelog(void);
 extern void flushlog(void);
 extern void parselog(const char *buf, const size_t s);
 extern void copylog(const char *buf, const size_t s);
+extern uint64_t injectlog(const char *prefix, const size_t plen, const char *buf, const size_t s);
+extern char *snapshotlog(size_t room, size_t *size);
+extern uint64_t storedlog(void);
+extern uint64_t syncedlog(void);
+extern int behindlog(void);
+extern int waitlog(uint64_t pos);
 extern void dump_kmsg(FILE *log);
 extern void start_logging(void);
 extern void stop_logging(void);
 extern FILE *open_logging(int fd);
 extern FILE *close_logging(void);
 
+/* probes.c */
+#if !defined(NO_USDT) && defined(__has_include)
+# if __has_include(<sys/sdt.h>)
+#  define BLOGD_USDT	1
+# endif
+#endif
+#ifdef BLOGD_USDT
+# define _SDT_HAS_SEMAPHORES 1
+# include <sys/sdt.h>
+# define PROBE_DECLARE(name)	extern unsigned short blogd_##name##_semaphore
+# define PROBE_ENABLED(name)	__builtin_expect(blogd_##name##_semaphore, 0)
+# define PROBE1(name,a)		STAP_PROBE1(blogd, name, a)
+# define PROBE2(name,a,b)	STAP_PROBE2(blogd, name, a, b)
+# define PROBE3(name,a,b,c)	STAP_PROBE3(blogd, name, a, b, c)
+#else
+# define PROBE_DECLARE(name)	extern int blogd_probe_##name##_unused
+# define PROBE_ENABLED(name)	0
+# define PROBE1(name,a)		do { if (0) { (void)(a); } } while (0)
+# define PROBE2(name,a,b)	do { if (0) { (void)(a); (void)(b); } } while (0)
+# define PROBE3(name,a,b,c)	do { if (0) { (void)(a); (void)(b); (void)(c); } } while (0)
+#endif
+PROBE_DECLARE(pty_read);		/* fd, bytes */
+PROBE_DECLARE(console_write);		/* fd, bytes, written */
+PROBE_DECLARE(log_drop);		/* bytes */
+PROBE_DECLARE(log_flush);		/* bytes, nano seconds */
+PROBE_DECLARE(log_fsync);		/* fd, nano seconds */
+PROBE_DECLARE(socket_command);		/* magic, pid */
+PROBE_DECLARE(password_start);		/* prompt, mode */
+PROBE_DECLARE(password_done);		/* answered, nano seconds */
+
 /* proc.c */
 extern char *proc2exe(const pid_t pid);
 extern void list_fd(const pid_t pid);
@@ -205,8 +494,39 @@ void free_cmdline(void);
 /* readpw.c */
 extern ssize_t readpw(int fd, char *pass, int eightbit);
 
+/* record.c */
+#define TAPE_MAGIC		"BLOGTAPE"
+#define TAPE_VERSION		1
+#define TAPE_PTY		'p'	/* Chunk read from the pty */
+#define TAPE_FIFO		'f'	/* Chunk read from /dev/blog */
+#define TAPE_SOCKET		's'	/* Request on the control socket */
+#define TAPE_KMSG		'k'	/* Record of /dev/kmsg */
+typedef struct tape_record_s {
+    int type;
+    uint64_t delta;		/* Nano seconds since the record before */
+    size_t len, size;
+    char *data;
+} tape_record_t;
+extern void record_open(const char *path);
+extern void record(int type, const void *buf, size_t len);
+extern void record_flush(void);
+extern void record_close(void);
+extern FILE *tape_open(const char *path, uint64_t *wall);
+extern int tape_next(FILE *fp, tape_record_t *rec);
+
+/* sandbox.c */
+#define SANDBOX_ENV		"BLOG_SANDBOX"
+extern const char *sandbox(void);
+extern const char *sandbox_path(const char *path);
+extern int sandbox_tioccons(int fd);
+extern int sandbox_klogctl(int type, char *buf, int len);
+extern int sandbox_kill(pid_t pid, int sig);
+
 /* shm.c */
 extern void* shm_malloc(size_t size);
+extern void* shm_create(const char *name, size_t size);
+extern const void* shm_attach(const char *name, size_t size);
+extern void shm_remove(const char *name);
 
 /* signals.c */
 extern void set_signal(int sig, struct sigaction *old, sighandler_t handler);
@@ -216,6 +536,19 @@ extern int restart_sig(int sig, int flag);
 extern int setup_signalfd(sigset_t mask);
 #endif
 
+/* slab.c */
+typedef struct slab_s {
+    struct slab_s *next;
+    const char *name;
+    void *free;
+    size_t size, per_page;
+    size_t used, total, pages;
+} slab_t;
+extern void slab_init(slab_t *s, const char *name, size_t size, size_t count);
+extern void *slab_alloc(slab_t *s);
+extern void slab_free(slab_t *s, void *ptr);
+extern void slab_report(void);
+
 /* socket.c */
 extern int open_un_socket_and_listen(void);
 extern int open_un_socket_and_connect(void);
@@ -223,9 +556,56 @@ extern int open_un_socket_and_connect(void);
 /* strings.c */
 extern void str0append(char **buf, size_t *size, const char *str);
 
+/* timer.c */
+typedef struct timeout_s {
+    list_t node;
+    uint64_t expires;		/* Milli seconds of CLOCK_MONOTONIC */
+    void (*handler)(struct timeout_s *);
+    unsigned short level, slot;
+    int pending;
+} timeout_t;
+extern void timeout_init(timeout_t *t, void (*handler)(timeout_t *));
+extern void timeout_add(timeout_t *t, unsigned long msec);
+extern void timeout_del(timeout_t *t);
+extern void timeouts_setup(void);
+
+/* trace.c */
+#define TRACE_MAGIC	0x626c7472	/* bltr */
+#define TRACE_VERSION	2	/* Version 1 had a 32 bit dur */
+enum {
+    TRACE_NONE = 0,
+    TRACE_WAKEUP,		/* Return of epoll_pwait(2), arg is the number of events */
+    TRACE_HANDLER,		/* Handler dispatched for fd */
+    TRACE_READ,			/* Bytes read from fd */
+    TRACE_WRITE,		/* Bytes written to fd */
+    TRACE_EAGAIN,		/* Write to fd would block */
+    TRACE_BLOCKED,		/* Console fd is waiting on epoll */
+    TRACE_UNBLOCKED,		/* Console fd is writable again, dur is the blocked time */
+    TRACE_FLUSH,		/* Log written by the writer thread, arg are the bytes */
+};
+typedef struct trace_event_s {
+    uint64_t ns;		/* CLOCK_MONOTONIC_RAW */
+    uint64_t arg;
+    uint64_t dur;		/* Nano seconds, 0 for instant events */
+    int16_t fd;
+    uint16_t type;
+} trace_event_t;
+typedef struct trace_head_s {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;		/* Events following */
+    uint32_t lost;		/* Events overwritten */
+    uint64_t now;		/* Time of the snapshot */
+} trace_head_t;
+extern void trace(unsigned int type, int fd, uint64_t arg, uint64_t dur);
+extern void *trace_snapshot(size_t *size);
+extern const char *trace_name(unsigned int type);
+
 /* tty.c */
+extern int open_tty_once(const char *name, int mode);
 extern int open_tty(const char *name, int mode);
 extern int request_tty(const char *tty);
+extern unsigned int tty_baudrate(speed_t speed);
 
 /* vmcp.c */
 extern int isinteger(const char *str);
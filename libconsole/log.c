@@ -17,7 +17,9 @@
 #include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
@@ -86,6 +88,16 @@ static volatile ssize_t avail;
 
 static inline void resetlog(void) { tail = head = data; avail = 0; }
 
+/*
+ * Positions in the stream of all bytes stored into the ring: the end
+ * of the stored bytes, the end of the bytes on the disk after the last
+ * sync, and the position a waiter on the event fd asks for.
+ */
+static uint64_t stored, synced, wanted;
+static int syncfd = -1;
+
+logstats_t logstats = { .size = LOG_BUFFER_SIZE };
+
 static inline void storelog(const char *const buf, const size_t len)
 {
     if (len > (size_t)(end - tail)) {
@@ -94,10 +106,16 @@ static inline void storelog(const char *const buf, const size_t len)
 	    warn("log buffer exceeded");
 	    be_warned++;
 	}
+	logstats.lost += len;
+	if (PROBE_ENABLED(log_drop))
+	    PROBE1(log_drop, len);
 	goto xout;
     }
     memcpy(tail, buf, len);
+    stored += len;
     avail = (tail += len) - head;
+    if ((uint64_t)avail > logstats.highwater)
+	logstats.highwater = avail;
 xout:
     return;
 }
@@ -110,28 +128,28 @@ static inline void addlog(const char c)
 	    warn("log buffer exceeded");
 	    be_warned++;
 	}
+	logstats.lost++;
+	if (PROBE_ENABLED(log_drop))
+	    PROBE1(log_drop, 1);
 	goto xout;
     }
     *tail = c;
+    stored++;
     avail = (tail += 1) - head;
+    if ((uint64_t)avail > logstats.highwater)
+	logstats.highwater = avail;
 xout:
     return;
 }
 
-void writelog(void)
+/*
+ * Write out the ring, called with the lock held.  Returns the bytes
+ * written, the ring is dropped if the log file is gone or broken.
+ */
+static size_t drainlog(void)
 {
-    int oldstate;
-
-    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
-
-    lock(&llock);
-    if (!flog) {
-	resetlog();
-	unlock(&llock);
+    size_t done = 0;
 
-	pthread_setcancelstate(oldstate, NULL);
-	return;
-    }
     clearerr(flog);
     while (avail > 0) {
 	size_t ret = (size_t)avail;
@@ -145,10 +163,12 @@ void writelog(void)
 	}
 	ret = fwrite(head, sizeof(unsigned char), ret, flog);
 	if (!ret && ferror(flog)) {
+	    logstats.errors++;
 	    resetlog();
 	    break;
 	}
 	head += ret;
+	done += ret;
 
 	if (head >= tail) {		/* empty, reset buffer */
 	    resetlog();
@@ -160,10 +180,58 @@ void writelog(void)
 	    tail = head + avail;
 	}
     }
+    return done;
+}
+
+void writelog(void)
+{
+    const uint64_t start = latency_now();
+    uint64_t done = 0, pos;
+    int oldstate;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+
+    lock(&llock);
+    if (!flog) {
+	resetlog();
+	unlock(&llock);
+
+	pthread_setcancelstate(oldstate, NULL);
+	return;
+    }
+    done = drainlog();
+    pos = stored;
     unlock(&llock);
     if (flog) {
+	int ret;
+
 	fflush(flog);
-	fdatasync(fileno(flog));
+	if (PROBE_ENABLED(log_fsync)) {
+	    const uint64_t sync = latency_now();
+	    ret = fdatasync(fileno(flog));
+	    PROBE2(log_fsync, fileno(flog), latency_now() - sync);
+	} else
+	    ret = fdatasync(fileno(flog));
+	if (ret < 0 && errno != EINVAL)
+	    logstats.errors++;
+	logstats.fsyncs++;
+	__atomic_store_n(&synced, pos, __ATOMIC_RELEASE);
+	if (done) {
+	    logstats.written += done;
+	    logstats.flushes++;
+	    trace(TRACE_FLUSH, fileno(flog), done, latency_now() - start);
+	    if (PROBE_ENABLED(log_flush))
+		PROBE2(log_flush, done, latency_now() - start);
+	}
+	if (syncfd >= 0) {
+	    const uint64_t want = __atomic_load_n(&wanted, __ATOMIC_ACQUIRE);
+
+	    if (want && pos >= want && __atomic_compare_exchange_n(&wanted, (uint64_t*)&want, 0, 0,
+								     __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+		const uint64_t one = 1;
+		(void)!write(syncfd, &one, sizeof(one));
+	    }
+	}
     }
     pthread_setcancelstate(oldstate, NULL);
 }
@@ -210,15 +278,11 @@ static inline int thread_poll(int msec, mutex_t *outer)
 }
 
 /*
- * Remove Escaped sequences and write out result (see
- * linux/drivers/char/console.c in do_con_trol()).
+ * Remove Escaped sequences and write out result, the
+ * escape state machine is shared with the console filters.
  */
-enum {	ESnormal, ESesc, ESsquare, ESgetpars, ESgotpars, ESfunckey,
-	EShash, ESsetG0, ESsetG1, ESpercent, ESignore, ESnonstd,
-	ESpalette };
-#define NPAR 16
-static unsigned int state = ESnormal;
-static int npar, nl, cr;
+static escape_t esc = { ESnormal, 0 };
+static int nl, cr;
 
 /*
  * Workaround for spinner of fsck/e2fsck
@@ -258,10 +322,8 @@ void parselog(const char *buf, const size_t s)
 
 	nl = 0;
 
-	switch(state) {
+	switch(esc.state) {
 	case ESnormal:
-	default:
-	    state = ESnormal;
 	    switch (c) {
 	    case 0  ...  8:
 	    case 16 ... 23:
@@ -298,7 +360,7 @@ void parselog(const char *buf, const size_t s)
 		break;
 	    case '\033':
 		follow = 0;
-		state = ESesc;
+		esc.state = ESesc;
 		break;
 	    case '\t':
 	    case  32 ... 126:
@@ -337,104 +399,10 @@ void parselog(const char *buf, const size_t s)
 		break;
 	    }
 	    break;
-	case ESesc:
-	    follow = 0;
-	    state = ESnormal;
-	    switch((unsigned char)c) {
-	    case '[':
-		state = ESsquare;
-		break;
-	    case ']':
-		state = ESnonstd;
-		break;
-	    case '%':
-		state = ESpercent;
-		break;
-	    case 'E':
-	    case 'D':
-		addlog('\n');
-		nl = 1;
-		break;
-	    case '(':
-		state = ESsetG0;
-		break;
-	    case ')':
-		state = ESsetG1;
-		break;
-	    case '#':
-		state = EShash;
-		break;
-#ifdef BLOGD_EXT
-	    case '^':				/* Boot log extension */
-		state = ESignore;
-		break;
-#endif
-	    default:
-		break;
-	    }
-	    break;
-	case ESnonstd:
-	    follow = 0;
-	    if        (c == 'P') {
-		npar = 0;
-		state = ESpalette;
-	    } else if (c == 'R')
-		state = ESnormal;
-	    else
-		state = ESnormal;
-	    break;
-	case ESpalette:
-	    follow = 0;
-	    if ((c>='0'&&c<='9') || (c>='A'&&c<='F') || (c>='a'&&c<='f')) {
-		npar++;
-		if (npar==7)
-		    state = ESnormal;
-	    } else
-		state = ESnormal;
-	    break;
-	case ESsquare:
-	    follow = 0;
-	    npar = 0;
-	    state = ESgetpars;
-	    if (c == '[') {
-		state = ESfunckey;
-		break;
-	    }
-#if 0
-	    if (c == 'K')
-		storelog(" el ", 4);
-#endif
-	    if (c == '?')
-		break;
-	case ESgetpars:
-	    follow = 0;
-	    if (c==';' && npar<NPAR-1) {
-		npar++;
-		break;
-	    } else if (c>='0' && c<='9') {
-		break;
-	    } else
-		state = ESgotpars;
-	case ESgotpars:
-	    follow = 0;
-	    state = ESnormal;
-	    break;
-	case ESpercent:
-	    follow = 0;
-	    state = ESnormal;
-	    break;
-	case ESfunckey:
-	case EShash:
-	case ESsetG0:
-	case ESsetG1:
+	default:
 	    follow = 0;
-	    state = ESnormal;
-	    break;
 #ifdef BLOGD_EXT
-	case ESignore:				/* Boot log extension */
-	    follow = 0;
-	    state = ESesc;
-	    {
+	    if (esc.state == ESignore) {		/* Boot log extension */
 		unsigned char echo[64];
 		ssize_t len;
 
@@ -447,8 +415,12 @@ void parselog(const char *buf, const size_t s)
 		tcdrain(fdread);
 		lock(&llock);
 	    }
-	    break;
 #endif
+	    if (escape_step(&esc, c) == ESC_NEWLINE) {
+		addlog('\n');
+		nl = 1;
+	    }
+	    break;
 	}
 	buf++;
 	r--;
@@ -470,98 +442,224 @@ void copylog(const char *buf, const size_t s)
 }
 
 /*
- * Dump the kernel messages read from /dev/kmsg to the boot log
+ * Store one complete line of the control socket without echo on the
+ * consoles.  If the ring is full and the log file is writable the ring
+ * is written out at once, the sync is left to the thread of the log.
+ * Returns the position after the line or 0 if the line was lost.
  */
-void dump_kmsg(FILE *log)
+uint64_t injectlog(const char *prefix, const size_t plen, const char *buf, const size_t s)
 {
-    char buf[BUFSIZ];
-    ssize_t len;
-    int fd;
+    const uint64_t lost = logstats.lost;
+    const size_t len = plen + s + 1;
+    uint64_t pos;
 
-    fd = open("/dev/kmsg", O_RDONLY|O_NONBLOCK);
-    if (fd < 0) {
-	warn("can not open /dev/kmsg");
-	return;
+    lock(&llock);
+    if (!nl)
+	addlog('\n');
+    if (len > (size_t)(end - tail) && flog && !nsigsys && len <= sizeof(data)) {
+	const size_t done = drainlog();
+
+	if (done) {
+	    logstats.written += done;
+	    logstats.flushes++;
+	}
     }
+    storelog(prefix, plen);
+    storelog(buf, s);
+    addlog('\n');
+    nl = 1;
+    pos = stored;
+    logstats.injected += len;
+    unlock(&llock);
 
-    lseek(fd, 0, SEEK_DATA);
+    return logstats.lost == lost ? pos : 0;
+}
 
-    do {
-	len = read(fd, buf, sizeof(buf)-1);
-    } while (len < 0 && errno == EPIPE);
-    if (len >= 0)
-	buf[len] = '\0';
-
-    while (len > 0) {
-	char *p = &buf[0];
-	const char *end;
-	const char *field[6];
-	const char sep[] = ",,,;\n\n";
-	int n;
-
-	end = p + (len - 1);
-	while (p < end && isspace(*p))
-	    p++;
-
-	n = 0;
-	field[n] = p;
-	while ((p = strchr(p, sep[n++]))) {
-	    if (!p || !*p || n > 5)
-		break;
-	    *p++ = '\0';
-	    field[n] = p;
-	}
+/*
+ * A copy of the bytes of the ring not yet written to the log file, that
+ * is all captured so far as long as the log file is not writable.  The
+ * lock is held for the copy only, the caller sends it at its own pace.
+ * The copy starts after room bytes left for the header of the caller.
+ */
+char *snapshotlog(size_t room, size_t *size)
+{
+    char *snap;
+
+    lock(&llock);
+    *size = (size_t)(tail - head);
+    if (!(snap = malloc(room + *size))) {
+	unlock(&llock);
+	error("can not allocate log snapshot");
+    }
+    memcpy(snap + room, head, *size);
+    unlock(&llock);
+
+    return snap;
+}
+
+/*
+ * The position after the last byte stored into the ring
+ */
+uint64_t storedlog(void)
+{
+    uint64_t pos;
+
+    lock(&llock);
+    pos = stored;
+    unlock(&llock);
+
+    return pos;
+}
+
+/*
+ * Non zero if the thread of the boot log is behind and the ring is
+ * more than half full, the reader of the pty then pauses for a while
+ */
+int behindlog(void)
+{
+    return running && flog && avail > (ssize_t)(LOG_BUFFER_SIZE/2);
+}
+
+/*
+ * The position of the bytes known to be on the disk
+ */
+uint64_t syncedlog(void)
+{
+    return __atomic_load_n(&synced, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Ask for a wake up on the returned event fd once the given
+ * position is on the disk
+ */
+int waitlog(uint64_t pos)
+{
+    uint64_t want = __atomic_load_n(&wanted, __ATOMIC_ACQUIRE);
+
+    if (syncfd < 0 && (syncfd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)) < 0)
+	warn("can not create event fd for the log");
+    while ((!want || pos < want) &&
+	   !__atomic_compare_exchange_n(&wanted, &want, pos, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	;
+    flushlog();
+
+    return syncfd;
+}
+
+/*
+ * One record of /dev/kmsg, that is "prio,seq,usec,flags;message"
+ */
+static void kmsg_record(FILE *log, char *p)
+{
+    const char *field[5];
+    const char sep[] = ",,,;";
+    int n;
+
+    while (*p && isspace(*p))
+	p++;
+
+    n = 0;
+    field[n] = p;
+    while (n < 4 && (p = strchr(p, sep[n]))) {
+	*p++ = '\0';
+	field[++n] = p;
+    }
 
-	if (n >= 6) {
-	    struct timeval tv;
-	    uint64_t usec;
-	    char *rest;
-	    int saveerr = errno;
+    if (n >= 4) {
+	struct timeval tv;
+	uint64_t usec;
+	char *rest;
+	int saveerr = errno;
 
-	    errno = 0;
-	    usec = strtoumax(field[2], &rest, 10);
+	errno = 0;
+	usec = strtoumax(field[2], &rest, 10);
 
-	    if (!errno) {
-		char stamp[128];
-		int ret;
+	if (!errno) {
+	    char stamp[128];
+	    int ret;
 
-		tv.tv_usec = usec % 1000000;
-		tv.tv_sec = usec / 1000000;
+	    tv.tv_usec = usec % 1000000;
+	    tv.tv_sec = usec / 1000000;
 
-		ret = snprintf(&stamp[0], sizeof(stamp)-1, "[%5lu.%06lu] ", tv.tv_sec, tv.tv_usec);
-		if (ret < 0)
-		    warn("snprintf error");
-		else {
+	    ret = snprintf(&stamp[0], sizeof(stamp)-1, "[%5lu.%06lu] ", tv.tv_sec, tv.tv_usec);
+	    if (ret < 0)
+		warn("snprintf error");
+	    else {
 #define RINGBUF	0
 #if RINGBUF
-		    stamp[ret] = '\0';
-		    lock(&llock);
-		    storelog(stamp, (size_t)ret);
-		    unlock(&llock);
+		stamp[ret] = '\0';
+		lock(&llock);
+		storelog(stamp, (size_t)ret);
+		unlock(&llock);
 #else
-		    fwrite(&stamp[0], sizeof(char), (size_t)ret, log); 
+		fwrite(&stamp[0], sizeof(char), (size_t)ret, log); 
 #endif
-		}
 	    }
-	    errno = saveerr;
+	}
+	errno = saveerr;
 #if RINGBUF
-	    parselog(field[4], strlen(field[4]));
+	parselog(field[4], strlen(field[4]));
 
-	    lock(&llock);
-	    if (!nl)
-	        addlog('\n');
-	    unlock(&llock);
+	lock(&llock);
+	if (!nl)
+	    addlog('\n');
+	unlock(&llock);
 #else
-	    fwrite(&field[4][0], sizeof(char), strlen(field[4]), log); 
-	    fputc('\n', log);
+	fwrite(&field[4][0], sizeof(char), strlen(field[4]), log); 
+	fputc('\n', log);
 #endif
-	}
+    }
+}
+
+/*
+ * Dump the kernel messages read from /dev/kmsg to the boot log.  The
+ * device returns one record per read, followed by its dictionary lines
+ * which start with a space.  A plain file, e.g. in the sandbox, returns
+ * as many records as fit into the buffer, a partial record at the end
+ * is moved to the start of the buffer for the next read.
+ */
+void dump_kmsg(FILE *log)
+{
+    char buf[BUFSIZ];
+    size_t fill = 0;
+    ssize_t len;
+    int fd;
+
+    fd = open(sandbox_path("/dev/kmsg"), O_RDONLY|O_NONBLOCK);
+    if (fd < 0) {
+	warn("can not open /dev/kmsg");
+	return;
+    }
+
+    lseek(fd, 0, SEEK_DATA);
+
+    while (1) {
+	char *p, *nl;
 
 	do {
-	    len = read(fd, buf, sizeof(buf)-1);
+	    len = read(fd, &buf[fill], sizeof(buf)-1-fill);
 	} while (len < 0 && errno == EPIPE);
-	if (len >= 0)
-	    buf[len] = '\0';
+	if (len <= 0)
+	    break;
+	logstats.kmsg += len;
+	fill += (size_t)len;
+	buf[fill] = '\0';
+
+	p = &buf[0];
+	while ((nl = strchr(p, '\n'))) {
+	    *nl = '\0';
+	    if (*p != ' ') {
+		record(TAPE_KMSG, p, (size_t)(nl - p));
+		kmsg_record(log, p);
+	    }
+	    p = nl + 1;
+	}
+
+	fill = (size_t)(&buf[fill] - p);
+	if (fill >= sizeof(buf)-1)
+	    fill = 0;		/* Overlong record */
+	else if (fill)
+	    memmove(&buf[0], p, fill);
     }
 
     close(fd);
@@ -609,7 +707,10 @@ void start_logging(void)
 	return;
 
     pthread_getschedparam(pthread_self(), &policy, &param);
-    pthread_create(&lthread, NULL, &action, NULL);
+    if ((errno = pthread_create(&lthread, NULL, &action, NULL))) {
+	warn("can not start the thread of the boot log");
+	return;
+    }
 
     policy = SCHED_RR;
     param.sched_priority = sched_get_priority_max(policy)/2 + 1;
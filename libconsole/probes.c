@@ -0,0 +1,33 @@
+/*
+ * probes.c - Semaphores of the USDT probes of blogd
+ *
+ * Copyright 2026 Werner Fink
+ * Copyright 2026 SUSE Software Solutions Germany GmbH
+ *
+ * This source is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "libconsole.h"
+
+/*
+ * A tracer like bpftrace, perf, or SystemTap increments the semaphore
+ * of a probe it attaches to, so the arguments of a probe are only
+ * computed if someone is listening.  Without sys/sdt.h or with the
+ * Makefile option USDT=0 the probes are empty and nothing is here.
+ */
+#ifdef BLOGD_USDT
+# define SEMAPHORE(name) \
+    unsigned short blogd_##name##_semaphore __attribute__((section(".probes"),used))
+
+SEMAPHORE(pty_read);
+SEMAPHORE(console_write);
+SEMAPHORE(log_drop);
+SEMAPHORE(log_flush);
+SEMAPHORE(log_fsync);
+SEMAPHORE(socket_command);
+SEMAPHORE(password_start);
+SEMAPHORE(password_done);
+#endif
@@ -96,7 +96,7 @@ void parse_cmdline(void) {
 #ifdef DEBUG_PROC
     fp = fopen("cmdline", "r");
 #else
-    fp = fopen("/proc/cmdline", "r");
+    fp = fopen(sandbox_path("/proc/cmdline"), "r");
 #endif
     if (!fp)
 	return;
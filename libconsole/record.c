@@ -0,0 +1,180 @@
+/*
+ * record.c - Tape of the raw input of blogd for the replay
+ *
+ * Copyright 2026 Werner Fink
+ * Copyright 2026 SUSE Software Solutions Germany GmbH
+ *
+ * This source is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "libconsole.h"
+
+/*
+ * With blog.record=<file> on the kernel command line blogd writes all
+ * what it reads, that is the chunks of the pty, the messages of the
+ * fifo, the requests of the control socket and the kernel records, to
+ * a tape.  The tape starts with TAPE_MAGIC, the version, three bytes
+ * zero and the wall clock in nano seconds as little endian.  Then each
+ * record is the type, the nano seconds of the monotonic clock since
+ * the record before and the length, both as unsigned LEB128, followed
+ * by the data.  The tape is written with stdio by the main loop only,
+ * it is flushed by the housekeeping and closed if it exceeds RECORD_MAX.
+ */
+#ifndef RECORD_MAX
+# define RECORD_MAX	(64*1024*1024)
+#endif
+
+static FILE *tape;
+static const char *tname;
+static uint64_t last, size;
+
+static void put_uleb(FILE *fp, uint64_t val)
+{
+    do {
+	unsigned char byte = val & 0x7f;
+	if ((val >>= 7))
+	    byte |= 0x80;
+	putc(byte, fp);
+	size++;
+    } while (val);
+}
+
+void record_open(const char *path)
+{
+    const char version[4] = { TAPE_VERSION, 0, 0, 0 };
+    struct timespec ts;
+    uint64_t wall;
+    int fd;
+
+    tname = sandbox_path(path);
+    fd = open(tname, O_WRONLY|O_CREAT|O_TRUNC|O_NOCTTY|O_NOFOLLOW|O_CLOEXEC, S_IRUSR|S_IWUSR);
+    if (fd < 0) {
+	warn("can not open tape %s", tname);
+	return;
+    }
+    if (!(tape = fdopen(fd, "w"))) {
+	warn("can not open tape %s", tname);
+	close(fd);
+	return;
+    }
+    clock_gettime(CLOCK_REALTIME, &ts);
+    wall = htole64((uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec);
+    fwrite(TAPE_MAGIC, 1, sizeof(TAPE_MAGIC)-1, tape);
+    fwrite(version, 1, sizeof(version), tape);
+    fwrite(&wall, 1, sizeof(wall), tape);
+    size = sizeof(TAPE_MAGIC)-1 + sizeof(version) + sizeof(wall);
+    last = latency_now();
+}
+
+void record(int type, const void *buf, size_t len)
+{
+    uint64_t now;
+
+    if (!tape)
+	return;
+    if (size + len > RECORD_MAX) {
+	errno = EFBIG;
+	warn("tape %s is full, recording stopped", tname);
+	record_close();
+	return;
+    }
+    now = latency_now();
+    putc(type, tape);
+    size++;
+    put_uleb(tape, now - last);
+    put_uleb(tape, len);
+    size += fwrite(buf, 1, len, tape);
+    last = now;
+    if (ferror(tape)) {
+	warn("can not write tape %s, recording stopped", tname);
+	record_close();
+    }
+}
+
+void record_flush(void)
+{
+    if (tape)
+	fflush(tape);
+}
+
+void record_close(void)
+{
+    if (!tape)
+	return;
+    if (fclose(tape) != 0)
+	warn("can not write tape %s", tname);
+    tape = NULL;
+}
+
+/*
+ * Read a tape, used by blogreplay
+ */
+static int get_uleb(FILE *fp, uint64_t *val)
+{
+    unsigned int shift = 0;
+    int byte;
+
+    *val = 0;
+    do {
+	if ((byte = getc(fp)) == EOF || shift > 63)
+	    return -1;
+	*val |= (uint64_t)(byte & 0x7f) << shift;
+	shift += 7;
+    } while (byte & 0x80);
+    return 0;
+}
+
+FILE *tape_open(const char *path, uint64_t *wall)
+{
+    char head[sizeof(TAPE_MAGIC)-1 + 4];
+    FILE *fp;
+
+    if (!(fp = fopen(path, "re")))
+	return NULL;
+    if (fread(head, 1, sizeof(head), fp) != sizeof(head) || fread(wall, 1, sizeof(*wall), fp) != sizeof(*wall) ||
+	memcmp(head, TAPE_MAGIC, sizeof(TAPE_MAGIC)-1) || head[sizeof(TAPE_MAGIC)-1] != TAPE_VERSION) {
+	fclose(fp);
+	errno = EINVAL;
+	return NULL;
+    }
+    *wall = le64toh(*wall);
+    return fp;
+}
+
+/*
+ * The next record, the data buffer grows as needed.  Returns 1 for
+ * a record, 0 at the end of the tape, and -1 on a truncated tape.
+ */
+int tape_next(FILE *fp, tape_record_t *rec)
+{
+    uint64_t len;
+    int type;
+
+    if ((type = getc(fp)) == EOF)
+	return 0;
+    if (get_uleb(fp, &rec->delta) < 0 || get_uleb(fp, &len) < 0 || len > RECORD_MAX)
+	return -1;
+    if (len > rec->size) {
+	char *data = realloc(rec->data, (size_t)len);
+	if (!data)
+	    error("can not allocate tape record");
+	rec->data = data;
+	rec->size = (size_t)len;
+    }
+    if (fread(rec->data, 1, (size_t)len, fp) != (size_t)len)
+	return -1;
+    rec->type = type;
+    rec->len = (size_t)len;
+    return 1;
+}
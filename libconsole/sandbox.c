@@ -0,0 +1,106 @@
+/*
+ * sandbox.c - Simulation mode of blogd without a real boot
+ *
+ * Copyright 2026 Werner Fink
+ * Copyright 2026 SUSE Software Solutions Germany GmbH
+ *
+ * This source is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/klog.h>
+#include <sys/stat.h>
+#include "libconsole.h"
+
+/*
+ * If the environment variable BLOG_SANDBOX names a directory, all the
+ * files of the system blogd depends on, like /proc/consoles, /dev/console,
+ * /dev/kmsg, /dev/blog, the boot log or the ask-password directory, are
+ * taken below this directory, and so is the name of the control socket.
+ * The privileged calls which change the state of the system, that is
+ * TIOCCONS, klogctl() and signals to init, do nothing.  Together with
+ * pty pairs as consoles blogd can then run without any privilege.
+ */
+typedef struct sandbox_s {
+    struct sandbox_s *next;
+    const char *orig;
+    char path[];
+} sandbox_t;
+
+static sandbox_t *paths;
+static const char *root;
+static int checked;
+
+const char *sandbox(void)
+{
+    if (!checked) {
+	const char *dir = getenv(SANDBOX_ENV);
+	struct stat st;
+
+	checked = 1;
+	if (dir && *dir) {
+	    if (*dir != '/' || stat(dir, &st) < 0 || !S_ISDIR(st.st_mode))
+		error("%s=%s is not an absolute path of a directory", SANDBOX_ENV, dir);
+	    root = dir;
+	}
+    }
+    return root;
+}
+
+/*
+ * The path in the sandbox, the strings are kept for the life time
+ * of the process as the callers store them in static variables.
+ * Without sandbox or for a path already in the sandbox the path itself
+ * is returned.
+ */
+const char *sandbox_path(const char *path)
+{
+    const size_t rlen = sandbox() ? strlen(root) : 0;
+    sandbox_t *p;
+    size_t plen;
+
+    if (!root || !path || *path != '/')
+	return path;
+    if (strncmp(path, root, rlen) == 0 && path[rlen] == '/')
+	return path;
+    for (p = paths; p; p = p->next) {
+	if (strcmp(p->orig, path) == 0)
+	    return p->path;
+    }
+
+    plen = strlen(path);
+    if (!(p = malloc(sizeof(sandbox_t) + rlen + plen + 1)))
+	error("can not allocate sandbox path");
+    memcpy(p->path, root, rlen);
+    memcpy(p->path + rlen, path, plen + 1);
+    p->orig = p->path + rlen;
+    p->next = paths;
+    paths = p;
+    return p->path;
+}
+
+int sandbox_tioccons(int fd)
+{
+    if (sandbox())
+	return 0;
+    return ioctl(fd, TIOCCONS, NULL);
+}
+
+int sandbox_klogctl(int type, char *buf, int len)
+{
+    if (sandbox())
+	return 0;
+    return klogctl(type, buf, len);
+}
+
+int sandbox_kill(pid_t pid, int sig)
+{
+    if (sandbox() && pid == 1)
+	return 0;
+    return kill(pid, sig);
+}
@@ -26,19 +26,33 @@
  * glibc does not provide a shm_mkstemp(char *template) and not
  * using shm_open() but hard coded /dev/shm seems to by risky,
  * therefore determine the location for POSIX shared memory.
+ * This is done on first use as the environment may point to
+ * a sandbox.
  */
 
 static const char *devshm;
 
-static void _locateshm(void) __attribute__((__constructor__));
 static void _locateshm(void)
 {
     static const char defaultdir[] = "/dev/shm";
     struct statfs st;
+    static int located;
     struct mntent *p;
     FILE *mounts;
     int ret;
 
+    if (located)
+	return;
+    located = 1;
+
+    if (sandbox()) {		/* The dev/shm of the sandbox on any file system */
+	struct stat sst;
+	const char *dir = sandbox_path(defaultdir);
+	if (stat(dir, &sst) == 0 && S_ISDIR(sst.st_mode))
+	    devshm = dir;
+	return;
+    }
+
     ret = statfs(defaultdir, &st);
     if (ret == 0 && (st.f_type == RAMFS_MAGIC || st.f_type == TMPFS_MAGIC)) {
 	devshm = &defaultdir[0];
@@ -76,8 +90,9 @@ void* shm_malloc(size_t size)
     void *area;
     char *template;
     int shmfd = -1;
-    int flags = MAP_LOCKED|MAP_SHARED;
+    int flags = sandbox() ? MAP_SHARED : MAP_LOCKED|MAP_SHARED;
 
+    _locateshm();
     if (devshm) {
 	int ret;
 
@@ -111,3 +126,85 @@ void* shm_malloc(size_t size)
 
     return area;
 }
+
+/*
+ * A named shared memory object which is visible for other
+ * processes, e.g. the statistics of blogd read by blogctl.
+ * An object left over or planted by someone else is never
+ * reused, it is removed and created anew.
+ */
+void* shm_create(const char *name, size_t size)
+{
+    void *area;
+    char *path;
+    int shmfd;
+
+    _locateshm();
+    if (!devshm)
+	return NULL;
+
+    if (asprintf(&path, "%s/%s", devshm, name) < 0)
+	error("can not allocate string for shared memory area");
+
+    (void)unlink(path);
+    shmfd = open(path, O_RDWR|O_CREAT|O_EXCL|O_NOFOLLOW|O_CLOEXEC, 0640);
+    free(path);
+    if (shmfd < 0)
+	return NULL;
+
+    area = NULL;
+    if (ftruncate(shmfd, size) == 0) {
+	area = mmap(NULL, size, PROT_READ|PROT_WRITE, sandbox() ? MAP_SHARED : MAP_LOCKED|MAP_SHARED, shmfd, 0);
+	if (area == MAP_FAILED)
+	    area = NULL;
+    }
+    close(shmfd);
+
+    return area;
+}
+
+const void* shm_attach(const char *name, size_t size)
+{
+    struct stat st;
+    void *area;
+    char *path;
+    int shmfd;
+
+    _locateshm();
+    if (!devshm) {
+	errno = ENOENT;
+	return NULL;
+    }
+
+    if (asprintf(&path, "%s/%s", devshm, name) < 0)
+	error("can not allocate string for shared memory area");
+
+    shmfd = open(path, O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+    free(path);
+    if (shmfd < 0)
+	return NULL;
+
+    area = NULL;
+    if (fstat(shmfd, &st) == 0 && (size_t)st.st_size >= size) {
+	area = mmap(NULL, size, PROT_READ, MAP_SHARED, shmfd, 0);
+	if (area == MAP_FAILED)
+	    area = NULL;
+    } else
+	errno = EPROTO;
+    close(shmfd);
+
+    return area;
+}
+
+void shm_remove(const char *name)
+{
+    char *path;
+
+    _locateshm();
+    if (!devshm)
+	return;
+    if (asprintf(&path, "%s/%s", devshm, name) < 0)
+	return;
+    (void)unlink(path);
+    free(path);
+}
@@ -124,6 +124,12 @@ static void handle_signal_event(int fd)
     case SIGCHLD:
 	sigchild++;
 	break;
+    case SIGWINCH:
+	nsigwinch = SIGWINCH;
+	break;
+    case SIGUSR1:
+	nsigusr1 = SIGUSR1;
+	break;
     default:
 	warn("Signal catched %s but not handled", strsignal(fdsi.ssi_signo));
 	break;
@@ -150,6 +156,7 @@ int setup_signalfd(sigset_t mask)
 	error("can not open signal file descriptor");
 
     epoll_addread(sfd, &handle_signal_event);
+    latency_register(&handle_signal_event, "signal_event");
 
     return sfd;
 }
@@ -0,0 +1,113 @@
+/*
+ * slab.c - Fixed size object pools for blogd
+ *
+ * Copyright 2026 Werner Fink
+ * Copyright 2026 SUSE Software Solutions Germany GmbH
+ *
+ * This source is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "libconsole.h"
+
+/*
+ * As blogd runs with mlockall(MCL_FUTURE) every new heap page is
+ * pinned.  Objects which come and go during boot, like the epoll
+ * registrations and the messages of the control connections, are
+ * therefore taken from pools which are preallocated and only grow
+ * in whole pages.  Pages are never given back, a free object goes
+ * to the free list of its pool.
+ */
+static slab_t *slabs;
+
+static void slab_grow(slab_t *s, size_t pages)
+{
+    const size_t psize = (size_t)getpagesize();
+    size_t len = pages * psize, n;
+    char *page;
+
+    page = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (page == MAP_FAILED)
+	error("can not map %zu pages for slab %s", pages, s->name);
+
+    for (n = 0; n + s->size <= len; n += s->size) {
+	void **obj = (void**)&page[n];
+	*obj = s->free;
+	s->free = obj;
+	s->total++;
+    }
+    s->pages += pages;
+}
+
+void slab_init(slab_t *s, const char *name, size_t size, size_t count)
+{
+    const size_t psize = (size_t)getpagesize();
+
+    if (s->size)
+	return;
+    s->name = name;
+    if (size < sizeof(void*))
+	size = sizeof(void*);
+    s->size = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+    if (s->size > psize)
+	error("object size %zu of slab %s exceeds a page", s->size, name);
+    s->per_page = psize / s->size;
+    s->free = NULL;
+    s->used = s->total = s->pages = 0;
+
+    s->next = slabs;
+    slabs = s;
+
+    slab_grow(s, (count + s->per_page - 1) / s->per_page ? : 1);
+}
+
+void *slab_alloc(slab_t *s)
+{
+    void **obj;
+
+    if (!s->free)
+	slab_grow(s, 1);
+    obj = s->free;
+    s->free = *obj;
+    s->used++;
+    return (void*)obj;
+}
+
+void slab_free(slab_t *s, void *ptr)
+{
+    void **obj = ptr;
+
+    if (!obj)
+	return;
+    *obj = s->free;
+    s->free = obj;
+    s->used--;
+}
+
+/*
+ * Write the occupancy of all pools to the log
+ */
+void slab_report(void)
+{
+    slab_t *s;
+
+    for (s = slabs; s; s = s->next) {
+	char *mesg;
+	int len;
+
+	len = asprintf(&mesg, "blogd: slab %s: %zu of %zu objects of %zu bytes used in %zu pages",
+		       s->name, s->used, s->total, s->size, s->pages);
+	if (len < 0)
+	    error("can not allocate string");
+	copylog(mesg, len);
+	free(mesg);
+    }
+    flushlog();
+}
@@ -12,6 +12,7 @@
 #include <errno.h>
 #include <limits.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -20,12 +21,24 @@
 #include "listing.h"
 #include "libconsole.h"
 
+/*
+ * The abstract UNIX socket of plymouth, in the sandbox its name
+ * starts with the directory of the sandbox.
+ */
+static socklen_t plymouth_address(struct sockaddr_un *su)
+{
+    const char *name = sandbox_path(PLYMOUTH_SOCKET_PATH+1);
+
+    memset(su, 0, sizeof(struct sockaddr_un));
+    su->sun_family = AF_UNIX;
+    strncpy(su->sun_path+1, name, sizeof(su->sun_path)-2);
+    return offsetof(struct sockaddr_un, sun_path) + 1 + strlen(su->sun_path+1);
+}
+
 int open_un_socket_and_listen(void)
 {
-    struct sockaddr_un su = {	/* The abstract UNIX socket of plymouth */
-	.sun_family = AF_UNIX,
-	.sun_path = PLYMOUTH_SOCKET_PATH,
-    };
+    struct sockaddr_un su;
+    const socklen_t len = plymouth_address(&su);
     const int one = 1;
     int fd, ret;
 
@@ -43,7 +56,7 @@ int open_un_socket_and_listen(void)
 	goto err;
     }
 
-    ret = bind(fd, &su, offsetof(struct sockaddr_un, sun_path) + 1 + strlen(su.sun_path+1));
+    ret = bind(fd, &su, len);
     if (ret < 0) {
 	int err = errno;
 	close(fd);
@@ -68,10 +81,8 @@ err:
 
 int open_un_socket_and_connect(void)
 {
-    struct sockaddr_un su = {	/* The abstract UNIX socket of plymouth */
-	.sun_family = AF_UNIX,
-	.sun_path = PLYMOUTH_SOCKET_PATH,
-    };
+    struct sockaddr_un su;
+    const socklen_t len = plymouth_address(&su);
     const int one = 1;
     int fd, ret;
 
@@ -89,7 +100,7 @@ int open_un_socket_and_connect(void)
 	goto err;
     }
 
-    ret = connect(fd, &su, offsetof(struct sockaddr_un, sun_path) + 1 + strlen(su.sun_path+1));
+    ret = connect(fd, &su, len);
     if (ret < 0) {
 	if (errno != ECONNREFUSED)
 	    warn("can not connect on UNIX socket");
@@ -0,0 +1,267 @@
+/*
+ * timer.c - Timer wheel for blogd
+ *
+ * Copyright 2026 Werner Fink
+ * Copyright 2026 SUSE Software Solutions Germany GmbH
+ *
+ * This source is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+#include "listing.h"
+#include "libconsole.h"
+
+/*
+ * Hierarchical timer wheel with a resolution of one milli second.
+ * Each of the WHEEL_LEVELS levels has WHEEL_SLOTS slots, a slot of
+ * level n covers 64^n ticks.  A timer is put on the lowest level
+ * which covers its distance and moves down if the wheel reaches its
+ * slot on the higher level.  The bitmaps of the used slots tell the
+ * next tick with work to do, for this tick a single timerfd of the
+ * epoll set is armed, therefore no handler has to sleep.
+ */
+#define WHEEL_BITS	6
+#define WHEEL_SLOTS	(1<<WHEEL_BITS)
+#define WHEEL_MASK	((uint64_t)WHEEL_SLOTS-1)
+#define WHEEL_LEVELS	4
+#define WHEEL_RANGE	((uint64_t)1<<(WHEEL_BITS*WHEEL_LEVELS))
+
+static struct {
+    list_t slot[WHEEL_LEVELS][WHEEL_SLOTS];
+    uint64_t used[WHEEL_LEVELS];
+    uint64_t now;			/* Last tick done */
+    uint64_t armed;			/* Tick the timerfd is armed for */
+    int fd;
+    int init;
+} wheel = { .fd = -1 };
+
+static uint64_t monotonic_ms(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+	error("can not read monotonic clock");
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static void wheel_init(void)
+{
+    int l, s;
+
+    if (wheel.init)
+	return;
+    for (l = 0; l < WHEEL_LEVELS; l++) {
+	for (s = 0; s < WHEEL_SLOTS; s++)
+	    initial(&wheel.slot[l][s]);
+	wheel.used[l] = 0;
+    }
+    wheel.now = monotonic_ms();
+    wheel.armed = 0;
+    wheel.init = 1;
+}
+
+/*
+ * A timer goes to the lowest level where its expiry and the current tick
+ * share the slot of the next higher level.  The expiry is never before
+ * the current tick, timers longer than the range of the wheel are put
+ * on the last slot and moved again if this slot is reached.
+ */
+static void wheel_insert(timeout_t *t)
+{
+    uint64_t exp = t->expires;
+    unsigned int level, idx;
+
+    if (exp < wheel.now)
+	exp = wheel.now;
+    if (exp - wheel.now >= WHEEL_RANGE)
+	exp = wheel.now + WHEEL_RANGE - 1;
+
+    for (level = 0; level < WHEEL_LEVELS-1; level++) {
+	const unsigned int shift = WHEEL_BITS*(level+1);
+	if ((exp >> shift) == (wheel.now >> shift))
+	    break;
+    }
+    idx = (unsigned int)((exp >> (WHEEL_BITS*level)) & WHEEL_MASK);
+
+    insert(&t->node, wheel.slot[level][idx].prev);
+    wheel.used[level] |= (uint64_t)1 << idx;
+    t->level = level;
+    t->slot = idx;
+}
+
+static void wheel_unlink(timeout_t *t)
+{
+    delete(&t->node);
+    if (list_empty(&wheel.slot[t->level][t->slot]))
+	wheel.used[t->level] &= ~((uint64_t)1 << t->slot);
+}
+
+/*
+ * The next tick with work, that is the expiry of a timer on
+ * the lowest level or the start of a slot on higher levels
+ */
+static uint64_t wheel_next(void)
+{
+    uint64_t best = UINT64_MAX;
+    unsigned int l;
+
+    for (l = 0; l < WHEEL_LEVELS; l++) {
+	const unsigned int shift = WHEEL_BITS*l;
+	const uint64_t base = (wheel.now >> shift) & ~WHEEL_MASK;
+	const unsigned int pos = (unsigned int)((wheel.now >> shift) & WHEEL_MASK);
+	uint64_t later, tick;
+
+	if (!wheel.used[l])
+	    continue;
+	later = (pos == WHEEL_SLOTS-1) ? 0 : wheel.used[l] & (~(uint64_t)0 << (pos+1));
+	if (later)
+	    tick = (base + __builtin_ctzll(later)) << shift;
+	else
+	    tick = (base + WHEEL_SLOTS + __builtin_ctzll(wheel.used[l])) << shift;
+	if (tick < best)
+	    best = tick;
+    }
+    return best;
+}
+
+static void wheel_arm(void)
+{
+    struct itimerspec its = {};
+    uint64_t next;
+
+    if (wheel.fd < 0)
+	return;
+    next = wheel_next();
+    if (next == wheel.armed)
+	return;
+    wheel.armed = next;
+    if (next != UINT64_MAX) {
+	its.it_value.tv_sec  = (time_t)(next / 1000);
+	its.it_value.tv_nsec = (long)(next % 1000) * 1000000;
+    }
+    if (timerfd_settime(wheel.fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+	warn("can not arm timer wheel");
+}
+
+/*
+ * Move the timers of the higher level slots starting at this tick down
+ */
+static void wheel_cascade(uint64_t tick)
+{
+    int level;
+
+    for (level = WHEEL_LEVELS-1; level > 0; level--) {
+	const unsigned int shift = WHEEL_BITS*level;
+	unsigned int idx;
+	list_t list, *ptr, *n;
+
+	if (tick & (((uint64_t)1 << shift) - 1))
+	    continue;
+	idx = (unsigned int)((tick >> shift) & WHEEL_MASK);
+	if (!(wheel.used[level] & ((uint64_t)1 << idx)))
+	    continue;
+
+	initial(&list);
+	join(&wheel.slot[level][idx], &list);
+	initial(&wheel.slot[level][idx]);
+	wheel.used[level] &= ~((uint64_t)1 << idx);
+
+	for (ptr = list.next, n = ptr->next; ptr != &list; ptr = n, n = ptr->next)
+	    wheel_insert(list_entry(ptr, timeout_t, node));
+    }
+}
+
+static void wheel_advance(uint64_t until)
+{
+    while (wheel.now < until) {
+	const uint64_t tick = wheel_next();
+	const unsigned int idx = (unsigned int)(tick & WHEEL_MASK);
+	list_t list;
+
+	if (tick > until) {
+	    wheel.now = until;
+	    break;
+	}
+
+	wheel.now = tick;
+	wheel_cascade(tick);
+
+	initial(&list);
+	join(&wheel.slot[0][idx], &list);
+	initial(&wheel.slot[0][idx]);
+	wheel.used[0] &= ~((uint64_t)1 << idx);
+
+	while (!list_empty(&list)) {
+	    timeout_t *t = list_entry(list.next, timeout_t, node);
+
+	    delete(&t->node);
+	    t->pending = 0;
+	    t->handler(t);
+	}
+    }
+}
+
+static void epoll_timer_wheel(int fd)
+{
+    uint64_t expired;
+
+    if (read(fd, &expired, sizeof(expired)) < 0 && errno != EAGAIN)
+	warn("can not read timer wheel");
+    wheel.armed = 0;
+    wheel_advance(monotonic_ms());
+    wheel_arm();
+}
+
+void timeout_init(timeout_t *t, void (*handler)(timeout_t *))
+{
+    t->node.next = t->node.prev = NULL;
+    t->handler = handler;
+    t->pending = 0;
+}
+
+void timeout_add(timeout_t *t, unsigned long msec)
+{
+    wheel_init();
+    if (t->pending)
+	wheel_unlink(t);
+    t->expires = monotonic_ms() + msec;
+    if (t->expires <= wheel.now)
+	t->expires = wheel.now + 1;	/* The current tick is already done */
+    t->pending = 1;
+    wheel_insert(t);
+    wheel_arm();
+}
+
+void timeout_del(timeout_t *t)
+{
+    if (!t->pending)
+	return;
+    wheel_unlink(t);
+    t->pending = 0;
+    wheel_arm();
+}
+
+/*
+ * Register the timerfd of the wheel on the epoll file descriptor
+ */
+void timeouts_setup(void)
+{
+    wheel_init();
+    if (wheel.fd >= 0)
+	return;
+    wheel.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+    if (wheel.fd < 0)
+	error("can not open timer for the timer wheel");
+    epoll_addread(wheel.fd, &epoll_timer_wheel);
+    latency_register(&epoll_timer_wheel, "timer_wheel");
+    wheel.armed = 0;
+    wheel_arm();
+}
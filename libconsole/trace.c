@@ -0,0 +1,97 @@
+/*
+ * trace.c - Trace ring of the hot paths of blogd
+ *
+ * Copyright 2026 Werner Fink
+ * Copyright 2026 SUSE Software Solutions Germany GmbH
+ *
+ * This source is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "libconsole.h"
+
+/*
+ * A fixed ring of the last TRACE_EVENTS events, always on and without
+ * any allocation.  The slot is claimed with an atomic increment as the
+ * writer thread of the log traces as well.  The ring is only copied
+ * on a MAGIC_TRACE request, blogctl does the formatting.
+ */
+#ifndef TRACE_EVENTS
+# define TRACE_EVENTS	4096
+#endif
+#if (TRACE_EVENTS & (TRACE_EVENTS-1))
+# error TRACE_EVENTS has to be a power of two
+#endif
+
+static trace_event_t ring[TRACE_EVENTS];
+static uint64_t count;
+
+void trace(unsigned int type, int fd, uint64_t arg, uint64_t dur)
+{
+    const uint64_t n = __atomic_fetch_add(&count, 1, __ATOMIC_RELAXED);
+    trace_event_t *ev = &ring[n & (TRACE_EVENTS-1)];
+
+    ev->ns = latency_now();
+    ev->arg = arg;
+    ev->dur = dur;
+    ev->fd = (int16_t)fd;
+    ev->type = (uint16_t)type;
+}
+
+/*
+ * Copy the ring from the oldest to the newest event behind a header
+ */
+void *trace_snapshot(size_t *size)
+{
+    const uint64_t n = __atomic_load_n(&count, __ATOMIC_ACQUIRE);
+    const uint32_t num = n < TRACE_EVENTS ? (uint32_t)n : TRACE_EVENTS;
+    const uint32_t first = (uint32_t)((n - num) & (TRACE_EVENTS-1));
+    trace_head_t *head;
+    trace_event_t *ev;
+    char *buf;
+
+    *size = sizeof(trace_head_t) + num * sizeof(trace_event_t);
+    if (!(buf = malloc(*size)))
+	error("can not allocate trace snapshot");
+
+    head = (trace_head_t*)buf;
+    head->magic = TRACE_MAGIC;
+    head->version = TRACE_VERSION;
+    head->count = num;
+    head->lost = (uint32_t)(n - num > UINT32_MAX ? UINT32_MAX : n - num);
+    head->now = latency_now();
+
+    ev = (trace_event_t*)(buf + sizeof(trace_head_t));
+    if (first + num <= TRACE_EVENTS)
+	memcpy(ev, &ring[first], num * sizeof(trace_event_t));
+    else {
+	const uint32_t part = TRACE_EVENTS - first;
+	memcpy(ev, &ring[first], part * sizeof(trace_event_t));
+	memcpy(ev + part, &ring[0], (num - part) * sizeof(trace_event_t));
+    }
+    return buf;
+}
+
+const char *trace_name(unsigned int type)
+{
+    static const char *names[] = {
+	[TRACE_NONE]	  = "none",
+	[TRACE_WAKEUP]	  = "wakeup",
+	[TRACE_HANDLER]	  = "handler",
+	[TRACE_READ]	  = "read",
+	[TRACE_WRITE]	  = "write",
+	[TRACE_EAGAIN]	  = "eagain",
+	[TRACE_BLOCKED]	  = "blocked",
+	[TRACE_UNBLOCKED] = "unblocked",
+	[TRACE_FLUSH]	  = "flush",
+    };
+
+    if (type >= sizeof(names)/sizeof(names[0]) || !names[type])
+	return "unknown";
+    return names[type];
+}
@@ -21,26 +21,18 @@
 #include <unistd.h>
 #include "libconsole.h"
 
-int open_tty(const char *name, int flags)
+/*
+ * Open a tty without waiting, on EIO the caller may retry later
+ */
+int open_tty_once(const char *name, int flags)
 {
-    int ret, fd;
+    int fd;
 
-    ret = 0;
-    do {
-	if (ret++ > 20)
-	    return -1;
-
-	fd = open(name, flags);
-	if (fd >= 0)
-	    break;
-	if (errno != EIO)
-	    return -1;
-	usleep(50000);
-
-    } while (errno == EIO);
+    fd = open(name, flags);
+    if (fd < 0)
+	return -1;
 
-    ret = isatty(fd);
-    if (!ret) {
+    if (!isatty(fd)) {
 	close(fd);
 	errno = ENOTTY;
 	return -1;
@@ -49,6 +41,20 @@ int open_tty(const char *name, int flags)
     return fd;
 }
 
+/*
+ * Open a tty and retry on EIO for about a second, not to be used
+ * within the event loop of blogd
+ */
+int open_tty(const char *name, int flags)
+{
+    int tries = 0, fd;
+
+    while ((fd = open_tty_once(name, flags)) < 0 && errno == EIO && tries++ < 20)
+	usleep(50000);
+
+    return fd;
+}
+
 int request_tty(const char *tty)
 {
     struct sigaction saved_sighup;
@@ -155,3 +161,72 @@ out:
     close(nd);
     return fd;
 }
+
+/*
+ * Translate the termios speed of a serial line into bits per second
+ */
+unsigned int tty_baudrate(speed_t speed)
+{
+    static const struct {
+	speed_t speed;
+	unsigned int baud;
+    } table[] = {
+	{ B50,	    50 },	{ B75,	    75 },	{ B110,	    110 },
+	{ B134,	    134 },	{ B150,	    150 },	{ B200,	    200 },
+	{ B300,	    300 },	{ B600,	    600 },	{ B1200,    1200 },
+	{ B1800,    1800 },	{ B2400,    2400 },	{ B4800,    4800 },
+	{ B9600,    9600 },	{ B19200,   19200 },	{ B38400,   38400 },
+#ifdef B57600
+	{ B57600,   57600 },
+#endif
+#ifdef B115200
+	{ B115200,  115200 },
+#endif
+#ifdef B230400
+	{ B230400,  230400 },
+#endif
+#ifdef B460800
+	{ B460800,  460800 },
+#endif
+#ifdef B500000
+	{ B500000,  500000 },
+#endif
+#ifdef B576000
+	{ B576000,  576000 },
+#endif
+#ifdef B921600
+	{ B921600,  921600 },
+#endif
+#ifdef B1000000
+	{ B1000000, 1000000 },
+#endif
+#ifdef B1152000
+	{ B1152000, 1152000 },
+#endif
+#ifdef B1500000
+	{ B1500000, 1500000 },
+#endif
+#ifdef B2000000
+	{ B2000000, 2000000 },
+#endif
+#ifdef B2500000
+	{ B2500000, 2500000 },
+#endif
+#ifdef B3000000
+	{ B3000000, 3000000 },
+#endif
+#ifdef B3500000
+	{ B3500000, 3500000 },
+#endif
+#ifdef B4000000
+	{ B4000000, 4000000 },
+#endif
+    };
+    size_t n;
+
+    for (n = 0; n < sizeof(table)/sizeof(table[0]); n++) {
+	if (table[n].speed == speed)
+	    return table[n].baud;
+    }
+    return 0;
+}
@@ -24,7 +24,7 @@
 /* Check if the system supports VTs (e.g. not s390x) */
 int vt_supported(void)
 {
-    return (access("/sys/devices/virtual/tty/tty0/active", R_OK) == 0);
+    return (access(sandbox_path("/sys/devices/virtual/tty/tty0/active"), R_OK) == 0);
 }
 
 /* Checks if the terminal is running within a graphical environment (X11/Wayland) */